@@ -122,20 +122,25 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Loads the slice of the L2 table at l2_offset that contains the entry for
+ * the guest offset into memory. If the slice is in the cache, the cache is
+ * used; otherwise it is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 and a pointer to the L2 slice in *l2_slice on success, or
+ * -errno if the read from the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+    uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcowState *s = bs->opaque;
+    int start_of_slice = offset_to_l2_index(s, offset) -
+                         offset_to_l2_slice_index(s, offset);
     int ret;
 
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    ret = qcow2_cache_get(bs, s->l2_table_cache,
+                          l2_offset + start_of_slice * sizeof(uint64_t),
+                          (void**) l2_slice);
 
     return ret;
 }
@@ -182,14 +187,19 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The new table is written one slice at a time, so it is never held in the
+ * cache as a whole.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
+    size_t slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->l2_size / s->l2_slice_size;
     uint64_t old_l2_offset;
-    uint64_t *l2_table;
+    uint64_t *l2_slice = NULL;
     int64_t l2_offset;
+    int slice;
     int ret;
 
     old_l2_offset = s->l1_table[l1_index];
@@ -208,44 +218,50 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
+    for (slice = 0; slice < n_slices; slice++) {
+        /* allocate a new entry in the l2 cache */
+        trace_qcow2_l2_allocate_get_empty(bs, l1_index);
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void**) &l2_slice);
+        if (ret < 0) {
+            goto fail;
+        }
 
-    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        return ret;
-    }
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new table */
+            memset(l2_slice, 0, slice_size2);
+        } else {
+            uint64_t* old_slice;
+
+            /* if there was an old l2 table, read it from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_size2,
+                (void**) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
 
-    l2_table = *table;
+            memcpy(l2_slice, old_slice, slice_size2);
 
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
-
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
-        if (ret < 0) {
-            goto fail;
+            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        /* write the l2 slice to the file */
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
-        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
+        trace_qcow2_l2_allocate_write_l2(bs, l1_index);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
         if (ret < 0) {
             goto fail;
         }
     }
 
-    /* write the l2 table to the file */
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
-
-    trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -259,13 +275,14 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_slice) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
+    }
     s->l1_table[l1_index] = old_l2_offset;
     return ret;
 }
@@ -278,17 +295,17 @@ fail:
  * cluster which may require a different handling)
  */
 static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t start, uint64_t stop_flags)
+        uint64_t *l2_slice, uint64_t start, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK;
-    uint64_t offset = be64_to_cpu(l2_table[0]) & mask;
+    uint64_t offset = be64_to_cpu(l2_slice[0]) & mask;
 
     if (!offset)
         return 0;
 
     for (i = start; i < start + nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
+        uint64_t l2_entry = be64_to_cpu(l2_slice[i]) & mask;
         if (offset + (uint64_t) i * cluster_size != l2_entry) {
             break;
         }
@@ -297,12 +314,12 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
 	return (i - start);
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_slice)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        int type = qcow2_get_cluster_type(be64_to_cpu(l2_slice[i]));
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -421,22 +438,23 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int l2_index;
-    uint64_t l1_index, l2_offset, *l2_table;
+    uint64_t l1_index, l2_offset, *l2_slice;
     int l1_bits, c;
     unsigned int index_in_cluster, nb_clusters;
-    uint64_t nb_available, nb_needed;
+    uint64_t nb_available, nb_needed, bytes_per_slice;
     int ret;
 
     index_in_cluster = (offset >> 9) & (s->cluster_sectors - 1);
     nb_needed = *num + index_in_cluster;
 
     l1_bits = s->l2_bits + s->cluster_bits;
+    bytes_per_slice = (uint64_t)s->l2_slice_size << s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the l2 slice
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    nb_available = bytes_per_slice - (offset & (bytes_per_slice - 1));
 
     /* compute the number of available sectors */
 
@@ -462,17 +480,17 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         goto out;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    l2_index = offset_to_l2_slice_index(s, offset);
+    *cluster_offset = be64_to_cpu(l2_slice[l2_index]);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
     ret = qcow2_get_cluster_type(*cluster_offset);
@@ -487,19 +505,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             return -EIO;
         }
         c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
+                &l2_slice[l2_index], 0,
                 QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_free_clusters(nb_clusters, &l2_slice[l2_index]);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
         c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
+                &l2_slice[l2_index], 0,
                 QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         break;
@@ -507,7 +525,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         abort();
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
 
     nb_available = (c * s->cluster_sectors);
 
@@ -524,21 +542,21 @@ out:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the slice of the l2 table that contains it.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 slice and the cluster index in the l2 slice are given to
+ * the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
 static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
-                             uint64_t **new_l2_table,
+                             uint64_t **new_l2_slice,
                              int *new_l2_index)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int l2_index;
     uint64_t l1_index, l2_offset;
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
     int ret;
 
     /* seek the the l2 offset in the l1 table */
@@ -556,15 +574,9 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
@@ -574,13 +586,21 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
                                 QCOW2_DISCARD_OTHER);
         }
+
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
-    *new_l2_table = l2_table;
+    *new_l2_slice = l2_slice;
     *new_l2_index = l2_index;
 
     return 0;
@@ -605,26 +625,26 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 {
     BDRVQcowState *s = bs->opaque;
     int l2_index, ret;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int64_t cluster_offset;
     int nb_csectors;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return 0;
     }
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
     if (cluster_offset & L2E_OFFSET_MASK) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
         return 0;
     }
 
     cluster_offset = qcow2_alloc_bytes(bs, compressed_size);
     if (cluster_offset < 0) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
         return 0;
     }
 
@@ -639,9 +659,9 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     /* compressed clusters never have the copied flag */
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
-    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    l2_slice[l2_index] = cpu_to_be64(cluster_offset);
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     if (ret < 0) {
         return 0;
     }
@@ -678,18 +698,128 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+/*
+ * Completes a request that was written into the last cluster of another
+ * in-flight allocation (see handle_join()). That allocation is the one that
+ * links the cluster into the L2 table, once our data is written (see
+ * qcow2_alloc_cluster_data_written()), so all that is left is waiting until
+ * it has done so.
+ */
+static int link_joined_l2(BlockDriverState *bs, QCowL2Meta *m)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowL2Meta *old_alloc;
+    uint64_t cluster_offset;
+    int num = s->cluster_sectors;
+    int ret;
+
+again:
+    QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
+        uint64_t old_end = old_alloc->offset +
+            ((uint64_t) old_alloc->nb_clusters << s->cluster_bits);
+
+        if (old_alloc != m && !old_alloc->joined &&
+            m->offset >= old_alloc->offset && m->offset < old_end)
+        {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&old_alloc->dependent_requests);
+            qemu_co_mutex_lock(&s->lock);
+            goto again;
+        }
+    }
+
+    ret = qcow2_get_cluster_offset(bs, m->offset, &num, &cluster_offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* If the allocation we joined has failed, our data isn't reachable */
+    if (ret != QCOW2_CLUSTER_NORMAL || cluster_offset != m->alloc_offset) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Called once the data of the requests described by the list m has been
+ * written, successfully or not (ret). The allocations they joined may then
+ * link their last cluster into the L2 table. If the write has failed, they
+ * first fill the area of the failed request like a COW region.
+ */
+void qcow2_alloc_cluster_data_written(QCowL2Meta *m, int ret)
+{
+    for (; m != NULL; m = m->next) {
+        QCowL2Meta *donor = m->join_donor;
+
+        if (donor == NULL) {
+            continue;
+        }
+        m->join_donor = NULL;
+
+        if (ret < 0) {
+            donor->join_failed = g_renew(Qcow2COWRegion, donor->join_failed,
+                                         donor->nb_join_failed + 1);
+            donor->join_failed[donor->nb_join_failed++] = (Qcow2COWRegion) {
+                .offset     = m->offset - donor->offset + m->cow_start.offset,
+                .nb_sectors = (m->cow_end.offset - m->cow_start.offset)
+                              >> BDRV_SECTOR_BITS,
+            };
+        }
+        if (--donor->nb_joiners == 0) {
+            qemu_co_queue_restart_all(&donor->join_queue);
+        }
+    }
+}
+
+/*
+ * Waits until the requests that joined the allocation m have written their
+ * data. Must be called without s->lock held.
+ */
+void qcow2_alloc_cluster_wait_joiners(QCowL2Meta *m)
+{
+    while (m->nb_joiners > 0) {
+        qemu_co_queue_wait(&m->join_queue);
+    }
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
     int i, j = 0, l2_index, ret;
-    uint64_t *old_cluster, *l2_table;
+    uint64_t *old_cluster, *l2_slice;
     uint64_t cluster_offset = m->alloc_offset;
 
     trace_qcow2_cluster_link_l2(qemu_coroutine_self(), m->nb_clusters);
     assert(m->nb_clusters > 0);
 
+    /* From now on handle_join() must leave our COW regions alone */
+    m->linking = true;
+
+    if (m->joined) {
+        return link_joined_l2(bs, m);
+    }
+
+    /*
+     * Requests that joined us write their data into our last cluster. The
+     * L2 entry must not point to it before that data is on the disk.
+     */
+    if (m->nb_joiners > 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        qcow2_alloc_cluster_wait_joiners(m);
+        qemu_co_mutex_lock(&s->lock);
+    }
+
     old_cluster = g_malloc(m->nb_clusters * sizeof(uint64_t));
 
+    /* joined requests that failed left their area unwritten */
+    for (i = 0; i < m->nb_join_failed; i++) {
+        ret = perform_cow(bs, m, &m->join_failed[i]);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
     /* copy content of unmodified sectors */
     ret = perform_cow(bs, m, &m->cow_start);
     if (ret < 0) {
@@ -710,11 +840,14 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
                                    s->refcount_block_cache);
     }
 
-    ret = get_cluster_table(bs, m->offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, m->offset, &l2_slice, &l2_index);
     if (ret < 0) {
         goto err;
     }
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+
+    /* handle_alloc() never allocates across an L2 slice boundary */
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
 
     for (i = 0; i < m->nb_clusters; i++) {
         /* if two concurrent writes happen to the same unallocated cluster
@@ -723,15 +856,15 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        if(l2_slice[l2_index + i] != 0)
+            old_cluster[j++] = l2_slice[l2_index + i];
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
+        l2_slice[l2_index + i] = cpu_to_be64((cluster_offset +
                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
      }
 
 
-    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     if (ret < 0) {
         goto err;
     }
@@ -762,12 +895,12 @@ err:
  * which must copy from the backing file)
  */
 static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
-    uint64_t *l2_table, int l2_index)
+    uint64_t *l2_slice, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = be64_to_cpu(l2_slice[l2_index + i]);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -855,6 +988,96 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+/*
+ * Checks if the request starts exactly where the guest data of an in-flight
+ * allocation ends, i.e. at the start of its COW area at the end. This is the
+ * common case of sequential writes into a fresh image, which would otherwise
+ * have to wait until the whole earlier request has completed.
+ *
+ * Instead, the area up to the end of that allocation's last cluster is taken
+ * out of its COW and written in place by this request, which then only waits
+ * for the L2 update of the earlier request (see link_joined_l2()).
+ *
+ * Returns:
+ *   0:     if there is no allocation to join. *bytes is unchanged.
+ *
+ *   1:     if the request joined an allocation. *bytes may have decreased
+ *          and describes the length of the area that can be written to,
+ *          *host_offset is the host offset of guest_offset.
+ */
+static int handle_join(BlockDriverState *bs, uint64_t guest_offset,
+    uint64_t *host_offset, uint64_t *bytes, QCowL2Meta **m)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowL2Meta *old_alloc, *other;
+    uint64_t cow_end_bytes, end;
+    QCowL2Meta *old_m = *m;
+
+    QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
+        if (!old_alloc->joined && !old_alloc->linking &&
+            old_alloc->cow_end.nb_sectors > 0 &&
+            old_alloc->offset + old_alloc->cow_end.offset == guest_offset)
+        {
+            break;
+        }
+    }
+
+    if (old_alloc == NULL) {
+        return 0;
+    }
+
+    cow_end_bytes = old_alloc->cow_end.nb_sectors << BDRV_SECTOR_BITS;
+    *bytes = MIN(*bytes, cow_end_bytes);
+    end = guest_offset + *bytes;
+
+    /* Nobody else may be writing to the area that we take over */
+    QLIST_FOREACH(other, &s->cluster_allocs, next_in_flight) {
+        if (other != old_alloc &&
+            end > l2meta_cow_start(other) &&
+            guest_offset < l2meta_cow_end(other))
+        {
+            return 0;
+        }
+    }
+
+    trace_qcow2_handle_join(qemu_coroutine_self(), guest_offset, *bytes);
+
+    old_alloc->cow_end.offset += *bytes;
+    old_alloc->cow_end.nb_sectors -= *bytes >> BDRV_SECTOR_BITS;
+    old_alloc->nb_joiners++;
+
+    *m = g_malloc0(sizeof(**m));
+
+    **m = (QCowL2Meta) {
+        .next           = old_m,
+
+        .alloc_offset   = old_alloc->alloc_offset +
+                          start_of_cluster(s, guest_offset - old_alloc->offset),
+        .offset         = start_of_cluster(s, guest_offset),
+        .nb_clusters    = 1,
+        .nb_available   = (offset_into_cluster(s, guest_offset) + *bytes)
+                          >> BDRV_SECTOR_BITS,
+        .joined         = true,
+        .join_donor     = old_alloc,
+
+        .cow_start = {
+            .offset     = offset_into_cluster(s, guest_offset),
+            .nb_sectors = 0,
+        },
+        .cow_end = {
+            .offset     = offset_into_cluster(s, guest_offset) + *bytes,
+            .nb_sectors = 0,
+        },
+    };
+    qemu_co_queue_init(&(*m)->dependent_requests);
+    qemu_co_queue_init(&(*m)->join_queue);
+    QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+
+    *host_offset = (*m)->alloc_offset + offset_into_cluster(s, guest_offset);
+
+    return 1;
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If
@@ -883,7 +1106,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
     BDRVQcowState *s = bs->opaque;
     int l2_index;
     uint64_t cluster_offset;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     unsigned int nb_clusters;
     unsigned int keep_clusters;
     int ret, pret;
@@ -895,22 +1118,22 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     /* Find L2 entry for the first involved cluster */
-    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -929,7 +1152,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
             count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index], 0,
+                                      &l2_slice[l2_index], 0,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
@@ -944,7 +1167,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Cleanup */
 out:
-    pret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    pret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     if (pret < 0) {
         return pret;
     }
@@ -1031,7 +1254,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 {
     BDRVQcowState *s = bs->opaque;
     int l2_index;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     uint64_t entry;
     unsigned int nb_clusters;
     int ret;
@@ -1043,28 +1266,28 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     assert(*bytes > 0);
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     /* Find L2 entry for the first involved cluster */
-    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = be64_to_cpu(l2_slice[l2_index]);
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
         nb_clusters = 1;
     } else {
-        nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
+        nb_clusters = count_cow_clusters(s, nb_clusters, l2_slice, l2_index);
     }
 
     /* This function is only called when there were no non-COW clusters, so if
@@ -1072,7 +1295,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
-    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     if (ret < 0) {
         return ret;
     }
@@ -1135,6 +1358,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
+    qemu_co_queue_init(&(*m)->join_queue);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
 
     *host_offset = alloc_cluster_offset + offset_into_cluster(s, guest_offset);
@@ -1211,6 +1435,19 @@ again:
 
         cur_bytes = remaining;
 
+        /*
+         * 0. If the request continues an in-flight allocation, write the rest
+         *    of its last cluster instead of waiting for it to complete. This
+         *    is only done at the start of the request, where we are still
+         *    free to choose the host offset.
+         */
+        if (cluster_offset == 0) {
+            ret = handle_join(bs, start, &cluster_offset, &cur_bytes, m);
+            if (ret) {
+                continue;
+            }
+        }
+
         /*
          * Now start gathering as many contiguous clusters as possible:
          *
@@ -1334,43 +1571,43 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     unsigned int nb_clusters)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int l2_index;
     int ret;
     int i;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = be64_to_cpu(l2_slice[l2_index + i]);
         if ((old_offset & L2E_OFFSET_MASK) == 0) {
             continue;
         }
 
         /* First remove L2 entries */
-        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        l2_table[l2_index + i] = cpu_to_be64(0);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        l2_slice[l2_index + i] = cpu_to_be64(0);
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
     }
 
-    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     if (ret < 0) {
         return ret;
     }
@@ -1400,7 +1637,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     s->cache_discards = true;
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     while (nb_clusters > 0) {
         ret = discard_single_l2(bs, offset, nb_clusters);
         if (ret < 0) {
@@ -1421,42 +1658,47 @@ fail:
 
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
- * clusters.
+ * all clusters in the same L2 slice) and returns the number of zeroed
+ * clusters. With BDRV_REQ_MAY_UNMAP, the clusters are freed as well.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
-    unsigned int nb_clusters)
+    unsigned int nb_clusters, int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int l2_index;
     int ret;
     int i;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = be64_to_cpu(l2_slice[l2_index + i]);
 
         /* Update L2 entries */
-        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
         if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
+        } else if ((flags & BDRV_REQ_MAY_UNMAP) &&
+                   (old_offset & L2E_OFFSET_MASK)) {
+            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            qcow2_free_clusters(bs, old_offset & L2E_OFFSET_MASK,
+                                s->cluster_size, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            l2_slice[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
         }
     }
 
-    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     if (ret < 0) {
         return ret;
     }
@@ -1464,7 +1706,8 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     return nb_clusters;
 }
 
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+    int flags)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int nb_clusters;
@@ -1475,13 +1718,13 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
     s->cache_discards = true;
 
     while (nb_clusters > 0) {
-        ret = zero_single_l2(bs, offset, nb_clusters);
+        ret = zero_single_l2(bs, offset, nb_clusters, flags);
         if (ret < 0) {
             goto fail;
         }
@@ -30,6 +30,7 @@
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
+#include "qapi/qmp/qint.h"
 #include "trace.h"
 
 /*
@@ -346,6 +347,21 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Generate discard requests when other clusters are freed",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the L2 table slices kept in the L2 cache",
+        },
         { /* end of list */ }
     },
 };
@@ -355,10 +371,11 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
-    QemuOpts *opts;
+    QemuOpts *opts = NULL;
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    uint64_t l2_cache_tables, refcount_cache_tables, l2_cache_entry_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -515,9 +532,69 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         }
     }
 
-    /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* L2 tables are loaded and written back in slices, so that sparse
+     * accesses to images with large clusters don't waste cache memory */
+    l2_cache_entry_size = qemu_opt_get_size(opts,
+        QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+        MIN(s->cluster_size, DEFAULT_L2_CACHE_ENTRY_SIZE));
+    if (l2_cache_entry_size < BDRV_SECTOR_SIZE ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "L2 cache entry size must "
+                      "be a power of two between %d and the cluster size "
+                      "(%d)", (int)BDRV_SECTOR_SIZE, s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    /* alloc L2 table/refcount block cache. A size given by the user is
+     * capped to the tables the image can use at this point: the L2 slices
+     * mapping the whole disk, and the refcount blocks the refcount table
+     * has room for. The defaults are small enough and stay as they are,
+     * as the image may still grow. */
+    s->l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE, 0);
+    s->refcount_cache_size = qemu_opt_get_size(opts,
+        QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
+    if (s->l2_cache_size) {
+        l2_cache_tables = MIN(s->l2_cache_size / l2_cache_entry_size,
+            DIV_ROUND_UP(DIV_ROUND_UP(header.size, s->cluster_size),
+                         s->l2_slice_size));
+    } else {
+        l2_cache_tables = (uint64_t)L2_CACHE_SIZE * s->cluster_size /
+                          l2_cache_entry_size;
+    }
+    if (s->refcount_cache_size) {
+        refcount_cache_tables = MIN(s->refcount_cache_size / s->cluster_size,
+                                    s->refcount_table_size);
+    } else {
+        refcount_cache_tables = REFCOUNT_CACHE_SIZE;
+    }
+    if (l2_cache_tables > INT_MAX || refcount_cache_tables > INT_MAX) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "Metadata cache size too "
+                      "large");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_table_cache = qcow2_cache_create(bs,
+        MAX(l2_cache_tables, MIN_L2_CACHE_SIZE), l2_cache_entry_size);
+    s->refcount_block_cache = qcow2_cache_create(bs,
+        MAX(refcount_cache_tables, REFCOUNT_CACHE_SIZE), s->cluster_size);
+    if (!s->l2_table_cache || !s->refcount_block_cache) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "Could not allocate "
+                      "metadata caches");
+        ret = -ENOMEM;
+        goto fail;
+    }
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -583,15 +660,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     }
 
     /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (error_is_set(&local_err)) {
-        qerror_report_err(local_err);
-        error_free(local_err);
-        ret = -EINVAL;
-        goto fail;
-    }
-
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
 
@@ -606,6 +674,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
     qemu_opts_del(opts);
+    opts = NULL;
 
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         qerror_report(ERROR_CLASS_GENERIC_ERROR, "Lazy refcounts require "
@@ -623,6 +692,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     return ret;
 
  fail:
+    if (opts) {
+        qemu_opts_del(opts);
+    }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -633,6 +705,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     return ret;
@@ -954,6 +1029,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
         qemu_co_mutex_lock(&s->lock);
+        qcow2_alloc_cluster_data_written(l2meta, ret);
         if (ret < 0) {
             goto fail;
         }
@@ -974,6 +1050,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             qemu_co_queue_restart_all(&l2meta->dependent_requests);
 
             next = l2meta->next;
+            g_free(l2meta->join_failed);
             g_free(l2meta);
             l2meta = next;
         }
@@ -988,15 +1065,22 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 fail:
     qemu_co_mutex_unlock(&s->lock);
 
+    /* If we joined an allocation and never wrote our data, it must fail */
+    qcow2_alloc_cluster_data_written(l2meta, ret);
+
     while (l2meta != NULL) {
         QCowL2Meta *next;
 
+        /* Requests that joined us still write to our cluster */
+        qcow2_alloc_cluster_wait_joiners(l2meta);
+
         if (l2meta->nb_clusters != 0) {
             QLIST_REMOVE(l2meta, next_in_flight);
         }
         qemu_co_queue_restart_all(&l2meta->dependent_requests);
 
         next = l2meta->next;
+        g_free(l2meta->join_failed);
         g_free(l2meta);
         l2meta = next;
     }
@@ -1057,6 +1141,16 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
     options = qdict_new();
     qdict_put(options, QCOW2_OPT_LAZY_REFCOUNTS,
               qbool_from_int(s->use_lazy_refcounts));
+    if (s->l2_cache_size) {
+        qdict_put(options, QCOW2_OPT_L2_CACHE_SIZE,
+                  qint_from_int(s->l2_cache_size));
+    }
+    if (s->refcount_cache_size) {
+        qdict_put(options, QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+                  qint_from_int(s->refcount_cache_size));
+    }
+    qdict_put(options, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+              qint_from_int(s->l2_slice_size * sizeof(uint64_t)));
 
     memset(s, 0, sizeof(BDRVQcowState));
     qcow2_open(bs, options, flags);
@@ -1555,7 +1649,7 @@ static int qcow2_make_empty(BlockDriverState *bs)
 }
 
 static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors)
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
     int ret;
     BDRVQcowState *s = bs->opaque;
@@ -1568,7 +1662,7 @@ static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     /* Whatever is left can use real zero clusters */
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
+        nb_sectors, flags);
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -1762,6 +1856,33 @@ static int64_t qcow2_vm_state_offset(BDRVQcowState *s)
 	return (int64_t)s->l1_vm_state_index << (s->cluster_bits + s->l2_bits);
 }
 
+static BlockCacheStatsList *qcow2_cache_stats_entry(Qcow2Cache *c,
+                                                    const char *name,
+                                                    BlockCacheStatsList *next)
+{
+    BlockCacheStatsList *entry = g_malloc0(sizeof(*entry));
+    BlockCacheStats *stats = g_malloc0(sizeof(*stats));
+    uint64_t size, hits, misses;
+
+    qcow2_cache_get_stats(c, &size, &hits, &misses);
+    stats->name = g_strdup(name);
+    stats->size = size;
+    stats->hits = hits;
+    stats->misses = misses;
+    entry->value = stats;
+    entry->next = next;
+    return entry;
+}
+
+static BlockCacheStatsList *qcow2_get_cache_stats(const BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockCacheStatsList *list;
+
+    list = qcow2_cache_stats_entry(s->refcount_block_cache, "refcount", NULL);
+    return qcow2_cache_stats_entry(s->l2_table_cache, "l2", list);
+}
+
 static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1897,6 +2018,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_cache_stats = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -51,7 +51,15 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default number of clusters in the caches, unless set in bytes with the
+   l2-cache-size and refcount-cache-size options */
 #define L2_CACHE_SIZE 16
+/* Minimum number of L2 slices in the cache */
+#define MIN_L2_CACHE_SIZE 2
+
+/* L2 tables are cached in slices of this many bytes (or of a whole table
+   for smaller clusters), unless set with the l2-cache-entry-size option */
+#define DEFAULT_L2_CACHE_ENTRY_SIZE 4096
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
@@ -63,6 +71,9 @@
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -163,6 +174,7 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size;
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -173,6 +185,9 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    /* cache sizes in bytes given by the user, 0 for the defaults */
+    uint64_t l2_cache_size;
+    uint64_t refcount_cache_size;
 
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
@@ -258,6 +273,41 @@ typedef struct QCowL2Meta
     /** Number of newly allocated clusters */
     int nb_clusters;
 
+    /**
+     * The request writes to the last cluster of another in-flight
+     * allocation, which links that cluster into the L2 table. This one must
+     * wait for it to complete before completing itself.
+     */
+    bool joined;
+
+    /**
+     * Set once the COW and L2 update have started; from then on the COW
+     * regions can't be shortened any more.
+     */
+    bool linking;
+
+    /**
+     * For a joined request, the allocation it joined until our data write
+     * has completed (see qcow2_alloc_cluster_data_written()).
+     */
+    struct QCowL2Meta *join_donor;
+
+    /**
+     * Number of joined requests whose data write to our last cluster hasn't
+     * completed yet. The L2 table may only point to the cluster once they
+     * all have.
+     */
+    int nb_joiners;
+    CoQueue join_queue;
+
+    /**
+     * The areas of joined requests whose data write has failed. They are
+     * copied like the COW regions before the L2 update, so that only the
+     * failed request sees the error.
+     */
+    Qcow2COWRegion *join_failed;
+    int nb_join_failed;
+
     /**
      * Requests that overlap with this allocation and wait to be restarted
      * when the allocating request has completed.
@@ -355,6 +405,11 @@ static inline int offset_to_l2_index(BDRVQcowState *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -449,9 +504,12 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          int compressed_size);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
+void qcow2_alloc_cluster_data_written(QCowL2Meta *m, int ret);
+void qcow2_alloc_cluster_wait_joiners(QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors);
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+    int flags);
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -464,7 +522,8 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
@@ -478,5 +537,7 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *size, uint64_t *hits,
+                           uint64_t *misses);
 
 #endif
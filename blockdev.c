@@ -317,6 +317,7 @@ static DriveInfo *blockdev_init(QemuOpts *all_opts,
     ThrottleConfig cfg;
     int snapshot = 0;
     bool copy_on_read;
+    BdrvDetectZeroes detect_zeroes = BDRV_DETECT_ZEROES_OFF;
     int ret;
     Error *error = NULL;
     QemuOpts *opts;
@@ -437,6 +438,18 @@ static DriveInfo *blockdev_init(QemuOpts *all_opts,
         }
     }
 
+    if ((buf = qemu_opt_get(opts, "detect-zeroes")) != NULL) {
+        if (bdrv_parse_detect_zeroes(buf, &detect_zeroes) != 0) {
+            error_report("invalid detect-zeroes option");
+            return NULL;
+        }
+        if (detect_zeroes == BDRV_DETECT_ZEROES_UNMAP &&
+            !(bdrv_flags & BDRV_O_UNMAP)) {
+            error_report("detect-zeroes=unmap requires discard=unmap");
+            return NULL;
+        }
+    }
+
     if (qemu_opt_get_bool(opts, "cache.writeback", true)) {
         bdrv_flags |= BDRV_O_CACHE_WB;
     }
@@ -618,6 +631,7 @@ static DriveInfo *blockdev_init(QemuOpts *all_opts,
     dinfo->bdrv = bdrv_new(dinfo->id);
     dinfo->bdrv->open_flags = snapshot ? BDRV_O_SNAPSHOT : 0;
     dinfo->bdrv->read_only = ro;
+    dinfo->bdrv->detect_zeroes = detect_zeroes;
     dinfo->devaddr = devaddr;
     dinfo->type = type;
     dinfo->bus = bus_id;
@@ -1937,6 +1951,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "discard",
             .type = QEMU_OPT_STRING,
             .help = "discard operation (ignore/off, unmap/on)",
+        },{
+            .name = "detect-zeroes",
+            .type = QEMU_OPT_STRING,
+            .help = "turn writes of zeroes into zero writes (off, on, unmap)",
         },{
             .name = "cache.writeback",
             .type = QEMU_OPT_BOOL,
@@ -73,8 +73,13 @@ static inline void cpu_exec_start(CPUArchState *env)
 {
 }
 
+/* With a single thread, the code buffer recycling or flush that
+   tb_gen_code and tb_flush leave pending can be done right away.  */
 static inline void cpu_exec_end(CPUArchState *env)
 {
+    if (unlikely(tb_recycle_pending())) {
+        tb_recycle_deferred(env);
+    }
 }
 
 static inline void start_exclusive(void)
@@ -175,7 +180,9 @@ void cpu_loop(CPUX86State *env)
     //target_siginfo_t info;
 
     for(;;) {
+        cpu_exec_start(env);
         trapnr = cpu_x86_exec(env);
+        cpu_exec_end(env);
         switch(trapnr) {
         case 0x80:
             /* syscall from int $0x80 */
@@ -516,7 +523,9 @@ void cpu_loop(CPUSPARCState *env)
     //target_siginfo_t info;
 
     while (1) {
+        cpu_exec_start(env);
         trapnr = cpu_sparc_exec (env);
+        cpu_exec_end(env);
 
         switch (trapnr) {
 #ifndef TARGET_SPARC64
@@ -22,6 +22,7 @@
 #include "tcg.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
+#include "sysemu/cpus.h"
 
 bool qemu_cpu_has_work(CPUState *cpu)
 {
@@ -90,14 +91,73 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock();
     tb = tb_gen_code(env, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
                      max_cycles);
+    tb_unlock();
     cpu->current_tb = tb;
     /* execute the generated code */
     cpu_tb_exec(cpu, tb->tc_ptr);
     cpu->current_tb = NULL;
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
+}
+
+typedef struct TBDesc {
+    CPUArchState *env;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    tb_page_addr_t phys_page1;
+} TBDesc;
+
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const TBDesc *desc = d;
+
+    if (!tb->invalid &&
+        tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        } else {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Find translated block using physical mappings.  Does not take tb_lock,
+   but in system emulation the caller must hold the BQL if it may have to
+   refill the code TLB.  */
+TranslationBlock *tb_htable_lookup(CPUArchState *env, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags)
+{
+    tb_page_addr_t phys_pc;
+    TBDesc desc;
+
+    desc.env = env;
+    desc.pc = pc;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    phys_pc = get_page_addr_code(env, pc);
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+
+    return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc,
+                      tb_hash_func(phys_pc, pc, flags));
 }
 
 static TranslationBlock *tb_find_slow(CPUArchState *env,
@@ -105,54 +165,34 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
+#if !defined(CONFIG_USER_ONLY)
+    bool locked;
 
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+    /* Code TLB refills walk the memory map and thus need the BQL, which
+       must be taken before tb_lock.  */
+    locked = qemu_tcg_lock_iothread();
+#endif
 
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
+    ENV_GET_CPU(env)->tb_invalidated_flag = false;
+
+    tb = tb_htable_lookup(env, pc, cs_base, flags);
+    if (!tb) {
+        tb_lock();
+        /* another thread may have translated it meanwhile */
+        tb = tb_htable_lookup(env, pc, cs_base, flags);
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(env, pc, cs_base, flags, 0);
         }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
+        tb_unlock();
     }
+
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+#if !defined(CONFIG_USER_ONLY)
+    qemu_tcg_unlock_iothread(locked);
+#endif
     return tb;
 }
 
@@ -174,6 +214,62 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+/* Like tb_find_fast, for generated code ending with an indirect branch:
+   the code of the next TB if it is in the jump cache, else the epilogue
+   that returns to the main loop to look it up there.  */
+void *helper_lookup_tb_ptr(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags || tb->invalid)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
+        qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
+                 tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
+    }
+    return tb->tc_ptr;
+}
+
+/* Count an exit of LAST_TB, whose exits are still being counted, by
+   index N to TB, and form a trace when done.  Returns true if the TB to
+   execute must be looked up again.  */
+static bool tb_profile_exit(CPUArchState *env, TranslationBlock *last_tb,
+                            int n, TranslationBlock *tb)
+{
+    TranslationBlock *trace;
+#if !defined(CONFIG_USER_ONLY)
+    bool locked;
+#endif
+
+    if (tb->cs_base != last_tb->cs_base || tb->flags != last_tb->flags) {
+        /* a trace is translated in a single context, give up */
+        last_tb->exit_count[0] = TB_TRACE_THRESHOLD;
+        return false;
+    }
+    last_tb->exit_pc[n] = tb->pc;
+    if (++last_tb->exit_count[n] + last_tb->exit_count[n ^ 1] !=
+        TB_TRACE_THRESHOLD) {
+        return false;
+    }
+
+#if !defined(CONFIG_USER_ONLY)
+    locked = qemu_tcg_lock_iothread();
+#endif
+    tb_lock();
+    trace = tb_gen_trace(env, last_tb);
+    tb_unlock();
+#if !defined(CONFIG_USER_ONLY)
+    qemu_tcg_unlock_iothread(locked);
+#endif
+    return trace != NULL;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -297,6 +393,12 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    /* interrupt controllers are device state; if one of
+                       the paths below longjmps, the lock is dropped
+                       there */
+                    bool locked = qemu_tcg_lock_iothread();
+#endif
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -573,6 +675,9 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    qemu_tcg_unlock_iothread(locked);
+#endif
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
@@ -595,29 +700,50 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS */
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
+                if (cpu->tb_invalidated_flag) {
                     /* as some TB could have been invalidated because
                        of memory exceptions while generating the code, we
                        must recompute the hash index here */
                     next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                    cpu->tb_invalidated_flag = false;
                 }
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
                     qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
                 }
+                /* count the exits of the calling TB until it can be
+                   turned into a trace; it is not chained meanwhile */
+                if (next_tb != 0 && !use_icount && !singlestep &&
+                    !cpu->singlestep_enabled) {
+                    TranslationBlock *last_tb;
+
+                    last_tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+                    if (last_tb->exit_count[0] + last_tb->exit_count[1] <
+                        TB_TRACE_THRESHOLD) {
+                        if (tb_profile_exit(env, last_tb,
+                                            next_tb & TB_EXIT_MASK, tb)) {
+                            tb = tb_find_fast(env);
+                        }
+                        next_tb = 0;
+                    }
+                }
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    tb_lock();
+                    /* another thread may have invalidated either TB
+                       since they were looked up */
+                    if (!cpu->tb_invalidated_flag) {
+                        tb_add_jump((TranslationBlock *)
+                                    (next_tb & ~TB_EXIT_MASK),
+                                    next_tb & TB_EXIT_MASK, tb);
+                    }
+                    tb_unlock();
                 }
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -681,6 +807,14 @@ int cpu_exec(CPUArchState *env)
              * local variables as longjmp is marked 'noreturn'. */
             cpu = current_cpu;
             env = cpu->env_ptr;
+            /* Drop locks taken by whatever longjmp'ed out */
+            tb_lock_reset();
+#if !defined(CONFIG_USER_ONLY)
+            qemu_tcg_lock_iothread_reset();
+#if defined(TARGET_I386)
+            x86_cpu_lock_reset();
+#endif
+#endif
         }
     } /* for(;;) */
 
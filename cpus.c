@@ -37,6 +37,7 @@
 #include "sysemu/qtest.h"
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
+#include "tcg.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -62,6 +63,42 @@
 
 static CPUState *next_cpu;
 
+/* Run each vCPU in a host thread of its own (-accel tcg,thread=multi).  */
+static bool mttcg_enabled;
+
+bool qemu_tcg_mttcg_enabled(void)
+{
+    return mttcg_enabled;
+}
+
+void qemu_tcg_configure(QemuOpts *opts)
+{
+    const char *t = qemu_opt_get(opts, "thread");
+
+    if (!t) {
+        return;
+    }
+    if (strcmp(t, "multi") == 0) {
+        /* vCPU threads rely on real thread-local storage for current_cpu
+           and the lock state, which we only have on Linux hosts, and on
+           atomic TLB updates, which guests wider than the host lack.  */
+#if defined(TARGET_SUPPORTS_MTTCG) && defined(CONFIG_LINUX) && \
+    !TCG_OVERSIZED_GUEST
+        mttcg_enabled = true;
+#else
+        fprintf(stderr, "qemu: multi-threaded TCG is not supported "
+                "for this guest on this host\n");
+        exit(1);
+#endif
+    } else if (strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+    } else {
+        fprintf(stderr, "qemu: invalid thread mode '%s' "
+                "(expected single or multi)\n", t);
+        exit(1);
+    }
+}
+
 bool cpu_is_stopped(CPUState *cpu)
 {
     return cpu->stopped || !runstate_is_running();
@@ -108,6 +145,9 @@ static QEMUTimer *icount_vm_timer;
 static QEMUTimer *icount_warp_timer;
 static int64_t vm_clock_warp_start;
 static int64_t qemu_icount;
+/* Wait in real time for the next QEMU_CLOCK_VIRTUAL timer when all vCPUs
+   are idle, rather than warping to it right away.  */
+static bool icount_sleep = true;
 
 typedef struct TimersState {
     int64_t cpu_ticks_prev;
@@ -332,7 +372,17 @@ void qemu_clock_warp(QEMUClockType type)
         deadline = INT32_MAX;
     }
 
-    if (deadline > 0) {
+    if (deadline > 0 && !icount_sleep) {
+        /*
+         * With sleep=off, advance QEMU_CLOCK_VIRTUAL to the next event
+         * right away.  Virtual time then only depends on the instructions
+         * executed and not on how long the host takes to run them, and
+         * idle periods cost no real time at all.
+         */
+        vm_clock_warp_start = -1;
+        qemu_icount_bias += deadline;
+        qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+    } else if (deadline > 0) {
         /*
          * Ensure QEMU_CLOCK_VIRTUAL proceeds even when the virtual CPU goes to
          * sleep.  Otherwise, the CPU might be waiting for a future timer
@@ -369,21 +419,64 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+static QemuOptsList qemu_icount_opts = {
+    .name = "icount",
+    .implied_opt_name = "shift",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_icount_opts.head),
+    .desc = {
+        {
+            .name = "shift",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "sleep",
+            .type = QEMU_OPT_BOOL,
+        },
+        { /* end of list */ }
+    },
+};
+
 void configure_icount(const char *option)
 {
+    QemuOpts *opts;
+    const char *shift;
+    bool adaptive;
+
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
     if (!option) {
         return;
     }
 
+    opts = qemu_opts_parse(&qemu_icount_opts, option, 1);
+    if (!opts) {
+        exit(1);
+    }
+    shift = qemu_opt_get(opts, "shift");
+    if (!shift) {
+        fprintf(stderr, "qemu: -icount: shift=N|auto is required\n");
+        exit(1);
+    }
+    adaptive = strcmp(shift, "auto") == 0;
+    if (!adaptive) {
+        icount_time_shift = strtol(shift, NULL, 0);
+    }
+    icount_sleep = qemu_opt_get_bool(opts, "sleep", true);
+    qemu_opts_del(opts);
+
     icount_warp_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
                                           icount_warp_rt, NULL);
-    if (strcmp(option, "auto") != 0) {
-        icount_time_shift = strtol(option, NULL, 0);
+    if (!adaptive) {
         use_icount = 1;
         return;
     }
 
+    if (!icount_sleep) {
+        /* the adaptive mode ties virtual time to real time, which is
+           exactly what sleep=off does not do */
+        fprintf(stderr, "qemu: -icount: shift=auto and sleep=off "
+                "are incompatible\n");
+        exit(1);
+    }
+
     use_icount = 2;
 
     /* 125MIPS seems a reasonable initial guess at the guest speed.
@@ -635,6 +728,7 @@ static void qemu_tcg_init_cpu_signals(void)
 static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+static DEFINE_TLS(bool, iothread_locked);
 
 static QemuThread io_thread;
 
@@ -647,6 +741,12 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* Exclusive sections for multi-threaded TCG, see tcg_start_exclusive() */
+static QemuMutex tcg_exclusive_lock;
+static QemuCond tcg_exclusive_cond;
+static QemuCond tcg_exclusive_resume;
+static int tcg_pending_cpus;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -655,6 +755,9 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&tcg_exclusive_lock);
+    qemu_cond_init(&tcg_exclusive_cond);
+    qemu_cond_init(&tcg_exclusive_resume);
 
     qemu_thread_get_self(&io_thread);
 }
@@ -775,12 +878,22 @@ static void qemu_kvm_wait_io_event(CPUState *cpu)
     qemu_wait_io_event_common(cpu);
 }
 
+static void qemu_tcg_mt_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void *qemu_kvm_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
     int r;
 
     qemu_mutex_lock(&qemu_global_mutex);
+    tls_var(iothread_locked) = true;
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     current_cpu = cpu;
@@ -862,6 +975,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     qemu_thread_get_self(cpu->thread);
 
     qemu_mutex_lock(&qemu_global_mutex);
+    tls_var(iothread_locked) = true;
     CPU_FOREACH(cpu) {
         cpu->thread_id = qemu_get_thread_id();
         cpu->created = true;
@@ -894,6 +1008,110 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Exclusive sections let one vCPU thread of multi-threaded TCG stop all
+ * others outside cpu_exec(), e.g. to recycle the translation buffer.  This
+ * is the same protocol as start_exclusive() in linux-user/main.c.  The BQL
+ * must not be held, since vCPUs may need it to leave cpu_exec().  */
+static void tcg_exclusive_idle(void)
+{
+    while (tcg_pending_cpus) {
+        qemu_cond_wait(&tcg_exclusive_resume, &tcg_exclusive_lock);
+    }
+}
+
+static void tcg_start_exclusive(void)
+{
+    CPUState *other_cpu;
+
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    tcg_exclusive_idle();
+
+    tcg_pending_cpus = 1;
+    /* Make all other cpus stop executing.  */
+    CPU_FOREACH(other_cpu) {
+        if (other_cpu->running) {
+            tcg_pending_cpus++;
+            cpu_exit(other_cpu);
+        }
+    }
+    while (tcg_pending_cpus > 1) {
+        qemu_cond_wait(&tcg_exclusive_cond, &tcg_exclusive_lock);
+    }
+}
+
+static void tcg_end_exclusive(void)
+{
+    tcg_pending_cpus = 0;
+    qemu_cond_broadcast(&tcg_exclusive_resume);
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void tcg_cpu_exec_start(CPUState *cpu)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    tcg_exclusive_idle();
+    cpu->running = true;
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void tcg_cpu_exec_end(CPUState *cpu)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    cpu->running = false;
+    if (tcg_pending_cpus > 1) {
+        tcg_pending_cpus--;
+        if (tcg_pending_cpus == 1) {
+            qemu_cond_signal(&tcg_exclusive_cond);
+        }
+    }
+    tcg_exclusive_idle();
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static int tcg_cpu_exec(CPUArchState *env);
+
+/* In multi-threaded mode every vCPU executes translated code in a thread
+ * of its own, without holding the BQL; see qemu_tcg_lock_iothread().  */
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    CPUArchState *env = cpu->env_ptr;
+    int r;
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+    current_cpu = cpu;
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            qemu_mutex_unlock_iothread();
+            tcg_cpu_exec_start(cpu);
+            r = tcg_cpu_exec(env);
+            tcg_cpu_exec_end(cpu);
+            if (tb_recycle_pending()) {
+                /* the code buffer is full, recycle its oldest region
+                   (or flush it, if that was requested) while nobody
+                   can be executing from it */
+                tcg_start_exclusive();
+                tb_recycle_deferred(env);
+                tcg_end_exclusive();
+            }
+            qemu_mutex_lock_iothread();
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_tcg_mt_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -936,7 +1154,10 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (mttcg_enabled) {
+        /* vCPU threads check for exit requests between TBs */
+        cpu_exit(cpu);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -968,7 +1189,7 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -979,13 +1200,45 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+/* Translated code of multi-threaded TCG runs without the BQL, so helpers
+ * and slow paths that touch devices or the memory map must take it.  This
+ * returns true if the lock was taken here and has to be released with
+ * qemu_tcg_unlock_iothread(); with a single TCG thread the lock is always
+ * held already and both are no-ops.  */
+bool qemu_tcg_lock_iothread(void)
+{
+    if (mttcg_enabled && !tls_var(iothread_locked)) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
+void qemu_tcg_unlock_iothread(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Drop the BQL if a vCPU thread longjmp'ed out of a section that had taken
+ * it with qemu_tcg_lock_iothread().  */
+void qemu_tcg_lock_iothread_reset(void)
+{
+    if (mttcg_enabled && tls_var(iothread_locked)) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu;
@@ -1011,7 +1264,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1047,6 +1300,18 @@ void resume_all_vcpus(void)
 
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
+    if (mttcg_enabled) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        qemu_thread_create(cpu->thread, qemu_tcg_mt_cpu_thread_fn, cpu,
+                           QEMU_THREAD_JOINABLE);
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
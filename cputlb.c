@@ -26,6 +26,11 @@
 #include "exec/cputlb.h"
 
 #include "exec/memory-internal.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "sysemu/cpus.h"
+#include "tcg.h"
+#include "translate-all.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -40,6 +45,101 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
     .addend     = -1,
 };
 
+/* True if TE cannot match any access, e.g. it was flushed.  */
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read & te->addr_write & te->addr_code & TLB_INVALID_MASK;
+}
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
+                             size_t max_entries)
+{
+    desc->window_begin_ns = ns;
+    desc->window_max_entries = max_entries;
+}
+
+#if defined(TCG_TARGET_IMPLEMENTS_DYN_TLB)
+/* Flushes are counted in windows of this length, and a TLB is only
+   shrunk if it was sparsely used during the whole window.  */
+#define TLB_RESIZE_WINDOW_NS (100 * 1000 * 1000)
+
+static void tlb_mmu_alloc(CPUArchState *env, int mmu_idx, size_t n_entries)
+{
+    env->tlb_mask[mmu_idx] = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+    env->tlb_table[mmu_idx] = g_new(CPUTLBEntry, n_entries);
+    env->iotlb[mmu_idx] = g_new(hwaddr, n_entries);
+}
+
+/* Called on flush, with the entries of the TLB about to be discarded.
+ * Double the size of the TLB if more than 70% of it was in use at some
+ * point during the current window; halve it (or more) if less than 30%
+ * was in use during a whole window, which is the time it takes for the
+ * working set of a guest to settle.
+ */
+static void tlb_mmu_resize(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+    size_t old_size = tlb_n_entries(env, mmu_idx);
+    size_t new_size = old_size;
+    size_t rate;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bool window_expired = now > desc->window_begin_ns + TLB_RESIZE_WINDOW_NS;
+    bool locked;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = pow2ceil(desc->window_max_entries);
+        size_t expected_rate = desc->window_max_entries * 100 / (ceil ?: 1);
+
+        /* Leave some headroom so that the next window does not grow
+           the TLB straight back.  */
+        if (expected_rate > 70) {
+            ceil *= 2;
+        }
+        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(desc, now, desc->n_used_entries);
+        }
+        return;
+    }
+
+    /* cpu_tlb_reset_dirty_all() walks the TLBs of all vCPUs with the
+       iothread lock held.  */
+    locked = qemu_tcg_lock_iothread();
+    g_free(env->tlb_table[mmu_idx]);
+    g_free(env->iotlb[mmu_idx]);
+    tlb_mmu_alloc(env, mmu_idx, new_size);
+    qemu_tcg_unlock_iothread(locked);
+    tlb_window_reset(desc, now, 0);
+}
+#endif
+
+void tlb_init(CPUArchState *env)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+
+        tlb_window_reset(desc, now, 0);
+        desc->n_used_entries = 0;
+#if defined(TCG_TARGET_IMPLEMENTS_DYN_TLB)
+        tlb_mmu_alloc(env, mmu_idx, 1 << CPU_TLB_DYN_DEFAULT_BITS);
+#endif
+    }
+    tlb_flush(env, 1);
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -52,34 +152,107 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
-void tlb_flush(CPUArchState *env, int flush_global)
+static void tlb_flush_nocheck(CPUArchState *env, uint16_t idxmap)
 {
     CPUState *cpu = ENV_GET_CPU(env);
-    int i;
+    int mmu_idx;
+    size_t i;
 
 #if defined(DEBUG_TLB)
-    printf("tlb_flush:\n");
+    printf("tlb_flush: mmu_idx map 0x%" PRIx16 "\n", idxmap);
 #endif
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    for (i = 0; i < CPU_TLB_SIZE; i++) {
-        int mmu_idx;
-
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
+        }
+#if defined(TCG_TARGET_IMPLEMENTS_DYN_TLB)
+        tlb_mmu_resize(env, mmu_idx);
+#endif
+        for (i = 0; i < tlb_n_entries(env, mmu_idx); i++) {
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
+        env->tlb_d[mmu_idx].n_used_entries = 0;
+
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
     }
 
+    /* tb_jmp_cache is indexed by virtual pc only, whatever the MMU mode
+       the TBs were translated for.  */
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
+    /* The large page range may still be mapped by the modes we kept.  */
+    if (idxmap == ALL_MMUIDX_BITS) {
+        env->vtlb_index = 0;
+        env->tlb_flush_addr = -1;
+        env->tlb_flush_mask = 0;
+    }
     tlb_flush_count++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+static void tlb_flush_async_work(void *opaque)
+{
+    tlb_flush(opaque, 1);
+}
+
+void tlb_flush(CPUArchState *env, int flush_global)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    /* A vCPU of multi-threaded TCG may be using its TLB right now; have
+       it flush the TLB itself before it executes any more code.  */
+    if (qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_async_work, env);
+        return;
+    }
+
+    tlb_flush_nocheck(env, ALL_MMUIDX_BITS);
+}
+
+typedef struct TLBFlushByMMUIdxData {
+    CPUArchState *env;
+    uint16_t idxmap;
+} TLBFlushByMMUIdxData;
+
+static void tlb_flush_by_mmuidx_async_work(void *opaque)
+{
+    TLBFlushByMMUIdxData *data = opaque;
+
+    tlb_flush_by_mmuidx(data->env, data->idxmap);
+    g_free(data);
+}
+
+/* Flush only the TLBs of the MMU modes whose bit is set in IDXMAP; the
+ * entries of the other modes stay valid.  Targets use this when a change
+ * of translation regime only affects some of their MMU modes.
+ */
+void tlb_flush_by_mmuidx(CPUArchState *env, uint16_t idxmap)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    idxmap &= ALL_MMUIDX_BITS;
+    if (!idxmap) {
+        return;
+    }
+
+    if (qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu)) {
+        TLBFlushByMMUIdxData *data = g_new(TLBFlushByMMUIdxData, 1);
+
+        data->env = env;
+        data->idxmap = idxmap;
+        async_run_on_cpu(cpu, tlb_flush_by_mmuidx_async_work, data);
+        return;
+    }
+
+    tlb_flush_nocheck(env, idxmap);
+}
+
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -88,17 +261,21 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         *tlb_entry = s_cputlb_empty_entry;
+        return true;
     }
+    return false;
 }
 
-void tlb_flush_page(CPUArchState *env, target_ulong addr)
+void tlb_flush_page_by_mmuidx(CPUArchState *env, target_ulong addr,
+                              uint16_t idxmap)
 {
     CPUState *cpu = ENV_GET_CPU(env);
     int i;
     int mmu_idx;
 
 #if defined(DEBUG_TLB)
-    printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
+    printf("tlb_flush_page: " TARGET_FMT_lx " mmu_idx map 0x%" PRIx16 "\n",
+           addr, idxmap);
 #endif
     /* Check if we need to flush due to large pages.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
@@ -107,7 +284,7 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
                TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                env->tlb_flush_addr, env->tlb_flush_mask);
 #endif
-        tlb_flush(env, 1);
+        tlb_flush_by_mmuidx(env, idxmap);
         return;
     }
     /* must reset current TB so that interrupts cannot modify the
@@ -115,14 +292,32 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
     cpu->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        int k;
+
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
+        }
+        i = tlb_index(env, mmu_idx, addr);
+        if (tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr)) {
+            env->tlb_d[mmu_idx].n_used_entries--;
+        }
+
+        /* check whether there are entries that need to be flushed in
+           the vtlb */
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
     }
 
     tb_flush_jmp_cache(env, addr);
 }
 
+void tlb_flush_page(CPUArchState *env, target_ulong addr)
+{
+    tlb_flush_page_by_mmuidx(env, addr, ALL_MMUIDX_BITS);
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -153,7 +348,13 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
+#if TCG_OVERSIZED_GUEST
+            /* no multi-threaded TCG for such guests, nobody races with us */
             tlb_entry->addr_write |= TLB_NOTDIRTY;
+#else
+            /* may race with the owning vCPU in multi-threaded TCG */
+            atomic_or(&tlb_entry->addr_write, TLB_NOTDIRTY);
+#endif
         }
     }
 }
@@ -194,12 +395,17 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
 
         env = cpu->env_ptr;
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            unsigned int i;
+            size_t i;
 
-            for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (i = 0; i < tlb_n_entries(env, mmu_idx); i++) {
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -219,10 +425,17 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = tlb_index(env, mmu_idx, vaddr);
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -256,7 +469,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   int mmu_idx, target_ulong size)
 {
     MemoryRegionSection *section;
-    unsigned int index;
+    unsigned int index, vidx;
     target_ulong address;
     target_ulong code_address;
     uintptr_t addend;
@@ -293,9 +506,25 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(env, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+
+    /* Do not discard the translation currently held in te, evict it into
+       the victim tlb instead.  An entry for the very page being installed
+       would only become a stale duplicate, so drop that one.  */
+    if (tlb_entry_is_empty(te)) {
+        env->tlb_d[mmu_idx].n_used_entries++;
+    } else if ((te->addr_read & TARGET_PAGE_MASK) != (vaddr & TARGET_PAGE_MASK)
+               && (te->addr_write & TARGET_PAGE_MASK) !=
+                  (vaddr & TARGET_PAGE_MASK)
+               && (te->addr_code & TARGET_PAGE_MASK) !=
+                  (vaddr & TARGET_PAGE_MASK)) {
+        vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -324,6 +553,41 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     }
 }
 
+/* Look up the victim tlb for PAGE after a miss at INDEX of the direct
+   mapped tlb, and swap the two entries on a hit.  ELT_OFS is the offset
+   within CPUTLBEntry of the comparator for the access type (addr_read,
+   addr_write or addr_code).  */
+bool victim_tlb_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong page)
+{
+    int vidx;
+
+    for (vidx = CPU_VTLB_SIZE - 1; vidx >= 0; --vidx) {
+        CPUTLBEntry *vtlb = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vtlb + elt_ofs);
+
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == page) {
+            CPUTLBEntry *tlb = &env->tlb_table[mmu_idx][index];
+            CPUTLBEntry tmptlb;
+            hwaddr tmpiotlb;
+
+            if (tlb_entry_is_empty(tlb)) {
+                env->tlb_d[mmu_idx].n_used_entries++;
+            }
+            tmptlb = *tlb;
+            *tlb = *vtlb;
+            *vtlb = tmptlb;
+            tmpiotlb = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = tmpiotlb;
+            env->tlb_d[mmu_idx].victim_hits++;
+            return true;
+        }
+    }
+    env->tlb_d[mmu_idx].victim_misses++;
+    return false;
+}
+
 /* NOTE: this function can trigger an exception */
 /* NOTE2: the returned address is not exactly the physical address: it
  * is actually a ram_addr_t (in system mode; the user mode emulation
@@ -335,11 +599,12 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     void *p;
     MemoryRegion *mr;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
+        page_index = tlb_index(env1, mmu_idx, addr);
     }
     pd = env1->iotlb[mmu_idx][page_index] & ~TARGET_PAGE_MASK;
     mr = iotlb_to_region(pd);
@@ -358,6 +623,103 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* Atomic operations on guest memory, for the tcg_gen_atomic_* ops.  IO
+   memory goes through the softmmu helpers under the iothread lock; this
+   is only atomic with respect to the other accesses that do the same,
+   which is fine since IO memory has no host atomics anyway.  RAM whose
+   writes are tracked uses the host atomic instructions like other RAM,
+   after the tracking done by the notdirty memory region for stores.  */
+
+static inline bool atomic_slow_lock(void)
+{
+    return qemu_tcg_lock_iothread();
+}
+
+static inline void atomic_slow_unlock(bool locked)
+{
+    qemu_tcg_unlock_iothread(locked);
+}
+
+/* Fill the tlb entry for writing the page of ADDR; this is where the
+   guest faults are raised.  */
+static int atomic_tlb_fill(CPUArchState *env, target_ulong addr, int mmu_idx,
+                           uintptr_t retaddr)
+{
+    int index = tlb_index(env, mmu_idx, addr);
+    target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+
+    if ((addr & TARGET_PAGE_MASK)
+        != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))
+        && !victim_tlb_hit(env, mmu_idx, index,
+                           offsetof(CPUTLBEntry, addr_write),
+                           addr & TARGET_PAGE_MASK)) {
+        bool locked = qemu_tcg_lock_iothread();
+        tlb_fill(env, addr, 1, mmu_idx, retaddr - GETPC_ADJ);
+        qemu_tcg_unlock_iothread(locked);
+        index = tlb_index(env, mmu_idx, addr);
+    }
+    return index;
+}
+
+/* Invalidate the TBs of the page and mark it dirty, as a store through
+   notdirty_mem_write would, before the page is written directly.  */
+static void atomic_notdirty_write(CPUArchState *env, int mmu_idx, int index,
+                                  target_ulong addr, int size,
+                                  uintptr_t retaddr)
+{
+    ram_addr_t ram_addr;
+    int dirty_flags;
+    bool locked = qemu_tcg_lock_iothread();
+
+    ram_addr = (env->iotlb[mmu_idx][index] & TARGET_PAGE_MASK) + addr;
+    env->mem_io_vaddr = addr;
+    env->mem_io_pc = retaddr;
+    dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
+    if (!(dirty_flags & CODE_DIRTY_FLAG)) {
+        tb_invalidate_phys_page_fast(ram_addr, size);
+        dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
+    }
+    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    if (dirty_flags == 0xff) {
+        tlb_set_dirty(env, addr);
+    }
+    qemu_tcg_unlock_iothread(locked);
+}
+
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               int size, int mmu_idx, uintptr_t retaddr)
+{
+    int index = atomic_tlb_fill(env, addr, mmu_idx, retaddr);
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+
+    if (unlikely(((addr & ~TARGET_PAGE_MASK) + size - 1) >= TARGET_PAGE_SIZE)) {
+        /* fault on the second page now rather than halfway through the
+           slow path, which holds a lock */
+        atomic_tlb_fill(env, addr + size - 1, mmu_idx, retaddr);
+        return NULL;
+    }
+    if (unlikely(te->addr_write & ~TARGET_PAGE_MASK)) {
+        if ((te->addr_write & ~TARGET_PAGE_MASK) != TLB_NOTDIRTY) {
+            return NULL;
+        }
+        atomic_notdirty_write(env, mmu_idx, index, addr, size, retaddr);
+    }
+    return (void *)((uintptr_t)addr + te->addend);
+}
+
+#define SHIFT 0
+#include "exec/atomic_template.h"
+
+#define SHIFT 1
+#include "exec/atomic_template.h"
+
+#define SHIFT 2
+#include "exec/atomic_template.h"
+
+#define SHIFT 3
+#include "exec/atomic_template.h"
+
 #define MMUSUFFIX _cmmu
 #undef GETPC
 #define GETPC() ((uintptr_t)0)
@@ -40,6 +40,7 @@ these four paragraphs for those parts of this code that are retained.
  */
 #include "config.h"
 
+#include <math.h>
 #include "fpu/softfloat.h"
 
 /*----------------------------------------------------------------------------
@@ -74,6 +75,160 @@ void set_floatx80_rounding_precision(int val STATUS_PARAM)
     STATUS(floatx80_rounding_precision) = val;
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  Once the inexact flag has been raised, an operation on
+| zero or normal inputs, rounded to nearest-even, whose result is a normal
+| number cannot raise any other flag; the host FPU then computes exactly the
+| same result as the software implementation, only much faster.  Everything
+| else (denormals, infinities, NaNs, division by zero, other rounding modes,
+| results that may have overflowed or underflowed) is left to the software
+| implementation.  Hosts that evaluate floating-point expressions with extra
+| precision (x87) would round twice, so they never take the fast path.
+*----------------------------------------------------------------------------*/
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0 && \
+    !defined(__FAST_MATH__)
+#define USE_HOST_FPU 1
+#else
+#define USE_HOST_FPU 0
+#endif
+
+enum {
+    host_fpu_add,
+    host_fpu_sub,
+    host_fpu_mul,
+    host_fpu_div,
+    host_fpu_sqrt
+};
+
+typedef union {
+    float32 s;
+    float h;
+} float32_host;
+
+typedef union {
+    float64 s;
+    double h;
+} float64_host;
+
+INLINE flag host_fpu_usable(float_status *status)
+{
+    return (STATUS(float_exception_flags) & float_flag_inexact) &&
+           STATUS(float_rounding_mode) == float_round_nearest_even;
+}
+
+INLINE flag float32_is_zero_or_normal(float32 a)
+{
+    uint32_t exp = (float32_val(a) >> 23) & 0xff;
+
+    return exp != 0xff && (exp != 0 || (float32_val(a) & 0x7fffffff) == 0);
+}
+
+INLINE flag float64_is_zero_or_normal(float64 a)
+{
+    uint64_t exp = (float64_val(a) >> 52) & 0x7ff;
+
+    return exp != 0x7ff &&
+           (exp != 0 || (float64_val(a) & 0x7fffffffffffffffULL) == 0);
+}
+
+/*----------------------------------------------------------------------------
+| Computes `a' op `b' (or the square root of `a') on the host FPU and stores
+| it in `zPtr', returning 1, if the result is known to be the one the software
+| implementation would return without raising any flag not already set.
+| Returns 0 otherwise, in which case the software implementation must be used.
+| The result must also be at least twice the smallest normal number, so that
+| tininess cannot have been detected before rounding.
+*----------------------------------------------------------------------------*/
+INLINE flag float32_host_op(int op, float32 a, float32 b, float32 *zPtr
+                            STATUS_PARAM)
+{
+    float32_host ua, ub, uz;
+    uint32_t exp;
+
+    if (!USE_HOST_FPU || !host_fpu_usable(status) ||
+        !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case host_fpu_add:
+        uz.h = ua.h + ub.h;
+        break;
+    case host_fpu_sub:
+        uz.h = ua.h - ub.h;
+        break;
+    case host_fpu_mul:
+        uz.h = ua.h * ub.h;
+        break;
+    case host_fpu_div:
+        if (float32_is_zero(b)) {
+            return 0;
+        }
+        uz.h = ua.h / ub.h;
+        break;
+    case host_fpu_sqrt:
+        if (float32_is_neg(a)) {
+            return 0;
+        }
+        uz.h = sqrtf(ua.h);
+        break;
+    default:
+        return 0;
+    }
+    exp = (float32_val(uz.s) >> 23) & 0xff;
+    if (exp < 2 || exp == 0xff) {
+        return 0;
+    }
+    *zPtr = uz.s;
+    return 1;
+}
+
+INLINE flag float64_host_op(int op, float64 a, float64 b, float64 *zPtr
+                            STATUS_PARAM)
+{
+    float64_host ua, ub, uz;
+    uint64_t exp;
+
+    if (!USE_HOST_FPU || !host_fpu_usable(status) ||
+        !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case host_fpu_add:
+        uz.h = ua.h + ub.h;
+        break;
+    case host_fpu_sub:
+        uz.h = ua.h - ub.h;
+        break;
+    case host_fpu_mul:
+        uz.h = ua.h * ub.h;
+        break;
+    case host_fpu_div:
+        if (float64_is_zero(b)) {
+            return 0;
+        }
+        uz.h = ua.h / ub.h;
+        break;
+    case host_fpu_sqrt:
+        if (float64_is_neg(a)) {
+            return 0;
+        }
+        uz.h = sqrt(ua.h);
+        break;
+    default:
+        return 0;
+    }
+    exp = (float64_val(uz.s) >> 52) & 0x7ff;
+    if (exp < 2 || exp == 0x7ff) {
+        return 0;
+    }
+    *zPtr = uz.s;
+    return 1;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the fraction bits of the half-precision floating-point value `a'.
 *----------------------------------------------------------------------------*/
@@ -1866,7 +2021,12 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
+    float32 z;
     flag aSign, bSign;
+
+    if (float32_host_op(host_fpu_add, a, b, &z STATUS_VAR)) {
+        return z;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1889,7 +2049,12 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
+    float32 z;
     flag aSign, bSign;
+
+    if (float32_host_op(host_fpu_sub, a, b, &z STATUS_VAR)) {
+        return z;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1912,12 +2077,17 @@ float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 
 float32 float32_mul( float32 a, float32 b STATUS_PARAM )
 {
+    float32 z;
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig;
     uint64_t zSig64;
     uint32_t zSig;
 
+    if (float32_host_op(host_fpu_mul, a, b, &z STATUS_VAR)) {
+        return z;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1975,9 +2145,14 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
 
 float32 float32_div( float32 a, float32 b STATUS_PARAM )
 {
+    float32 z;
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+
+    if (float32_host_op(host_fpu_div, a, b, &z STATUS_VAR)) {
+        return z;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -2347,10 +2522,15 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags STATUS_PARAM)
 
 float32 float32_sqrt( float32 a STATUS_PARAM )
 {
+    float32 z;
     flag aSign;
     int_fast16_t aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+
+    if (float32_host_op(host_fpu_sqrt, a, float32_zero, &z STATUS_VAR)) {
+        return z;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat32Frac( a );
@@ -3429,7 +3609,12 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
+    float64 z;
     flag aSign, bSign;
+
+    if (float64_host_op(host_fpu_add, a, b, &z STATUS_VAR)) {
+        return z;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3452,7 +3637,12 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
+    float64 z;
     flag aSign, bSign;
+
+    if (float64_host_op(host_fpu_sub, a, b, &z STATUS_VAR)) {
+        return z;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3475,10 +3665,15 @@ float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 
 float64 float64_mul( float64 a, float64 b STATUS_PARAM )
 {
+    float64 z;
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
 
+    if (float64_host_op(host_fpu_mul, a, b, &z STATUS_VAR)) {
+        return z;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3536,11 +3731,16 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
 
 float64 float64_div( float64 a, float64 b STATUS_PARAM )
 {
+    float64 z;
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+
+    if (float64_host_op(host_fpu_div, a, b, &z STATUS_VAR)) {
+        return z;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3920,10 +4120,15 @@ float64 float64_muladd(float64 a, float64 b, float64 c, int flags STATUS_PARAM)
 
 float64 float64_sqrt( float64 a STATUS_PARAM )
 {
+    float64 z;
     flag aSign;
     int_fast16_t aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+
+    if (float64_host_op(host_fpu_sqrt, a, float64_zero, &z STATUS_VAR)) {
+        return z;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat64Frac( a );
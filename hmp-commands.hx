@@ -366,6 +366,22 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "start or stop profiling the translated code",
+        .mhandler.cmd = hmp_tb_profile,
+    },
+
+STEXI
+@item tb-profile [on|off]
+@findex tb-profile
+Start or stop counting the executions of the translated blocks and the
+helper calls, see @code{info tb-profile}.  Starting the profiler resets
+the counts.
 ETEXI
 
     {
@@ -1629,6 +1645,8 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tb-profile [@var{max}]
+show the @var{max} most executed translated blocks and most called helpers
 @item info numa
 show NUMA information
 @item info kvm
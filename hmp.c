@@ -72,6 +72,42 @@ void hmp_info_kvm(Monitor *mon, const QDict *qdict)
     qapi_free_KvmInfo(info);
 }
 
+void hmp_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    TbProfileInfo *info;
+    TbProfileBlockInfoList *block;
+    TbProfileHelperInfoList *helper;
+    Error *err = NULL;
+
+    info = qmp_query_tb_profile(qdict_haskey(qdict, "max"),
+                                qdict_get_try_int(qdict, "max", 0), &err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    monitor_printf(mon, "TB profiler: %s\n",
+                   info->enabled ? "running" : "stopped");
+    monitor_printf(mon, "%-18s %14s %6s %6s %10s\n",
+                   "pc", "executions", "guest", "host", "xlate ns");
+    for (block = info->blocks; block; block = block->next) {
+        monitor_printf(mon, "0x%016" PRIx64 " %14" PRId64 " %6" PRId64
+                       " %6" PRId64 " %10" PRId64 "\n",
+                       block->value->pc, block->value->exec_count,
+                       block->value->guest_size, block->value->host_size,
+                       block->value->translate_ns);
+    }
+    if (info->helpers) {
+        monitor_printf(mon, "\n%-32s %14s\n", "helper", "calls");
+    }
+    for (helper = info->helpers; helper; helper = helper->next) {
+        monitor_printf(mon, "%-32s %14" PRId64 "\n",
+                       helper->value->name, helper->value->call_count);
+    }
+
+    qapi_free_TbProfileInfo(info);
+}
+
 void hmp_info_status(Monitor *mon, const QDict *qdict)
 {
     StatusInfo *info;
@@ -391,6 +427,7 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
 void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
 {
     BlockStatsList *stats_list, *stats;
+    BlockCacheStatsList *cache;
 
     stats_list = qmp_query_blockstats(NULL);
 
@@ -417,6 +454,13 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+
+        for (cache = stats->value->caches; cache; cache = cache->next) {
+            monitor_printf(mon, "    %s cache: size=%" PRId64
+                           " hits=%" PRId64 " misses=%" PRId64 "\n",
+                           cache->value->name, cache->value->size,
+                           cache->value->hits, cache->value->misses);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -866,6 +910,15 @@ void hmp_set_link(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &errp);
 }
 
+void hmp_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    bool enable = qdict_get_bool(qdict, "enable");
+    Error *errp = NULL;
+
+    qmp_tb_profile(enable, &errp);
+    hmp_handle_error(mon, &errp);
+}
+
 void hmp_block_passwd(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_str(qdict, "device");
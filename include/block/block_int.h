@@ -112,10 +112,11 @@ struct BlockDriver {
      * Efficiently zero a region of the disk image.  Typically an image format
      * would use a compact metadata representation to implement this.  This
      * function pointer may be NULL and .bdrv_co_writev() will be called
-     * instead.
+     * instead.  With BDRV_REQ_MAY_UNMAP in flags the driver may free the
+     * space used by the region.
      */
     int coroutine_fn (*bdrv_co_write_zeroes)(BlockDriverState *bs,
-        int64_t sector_num, int nb_sectors);
+        int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
@@ -156,6 +157,8 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* Statistics of the metadata caches of the format, for query-blockstats */
+    BlockCacheStatsList *(*bdrv_get_cache_stats)(const BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -221,6 +224,8 @@ struct BlockDriverState {
     int sg;        /* if true, the device is a /dev/sg* */
     int copy_on_read; /* if true, copy read backing sectors into image
                          note this is a reference count */
+    BdrvDetectZeroes detect_zeroes; /* turn all-zero writes into zero
+                                       writes */
 
     BlockDriver *drv; /* NULL means no media */
     void *opaque;
@@ -0,0 +1,218 @@
+/*
+ * Atomic read-modify-write helpers
+ *
+ * Generate the helpers behind the tcg_gen_atomic_* ops for one access
+ * size.  Included from user-exec.c and cputlb.c, which define:
+ *
+ * atomic_mmu_lookup(env, addr, size, mmu_idx, retaddr): the host address
+ *   of the guest memory to modify, raising the guest fault if it cannot
+ *   be written.  With a softmmu, NULL if the access must go through the
+ *   slow path helpers, e.g. because it is to IO memory or crosses a page
+ *   boundary.
+ * atomic_slow_lock(), atomic_slow_unlock(locked): serialize the accesses
+ *   that cannot use a host atomic instruction.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define DATA_SIZE (1 << SHIFT)
+
+#if DATA_SIZE == 8
+#define SUFFIX q
+#define USUFFIX q
+#define MMU_USUFFIX q
+#define DATA_TYPE uint64_t
+#define ABI_TYPE uint64_t
+#define TSWAP(x) tswap64(x)
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_8
+#define HOST_ATOMIC 1
+#endif
+#elif DATA_SIZE == 4
+#define SUFFIX l
+#define USUFFIX l
+#define MMU_USUFFIX ul
+#define DATA_TYPE uint32_t
+#define ABI_TYPE uint32_t
+#define TSWAP(x) tswap32(x)
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_4
+#define HOST_ATOMIC 1
+#endif
+#elif DATA_SIZE == 2
+#define SUFFIX w
+#define USUFFIX uw
+#define MMU_USUFFIX uw
+#define DATA_TYPE uint16_t
+#define ABI_TYPE uint32_t
+#define TSWAP(x) tswap16(x)
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_2
+#define HOST_ATOMIC 1
+#endif
+#elif DATA_SIZE == 1
+#define SUFFIX b
+#define USUFFIX ub
+#define MMU_USUFFIX ub
+#define DATA_TYPE uint8_t
+#define ABI_TYPE uint32_t
+#define TSWAP(x) (x)
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_1
+#define HOST_ATOMIC 1
+#endif
+#else
+#error unsupported data size
+#endif
+
+#ifndef HOST_ATOMIC
+#define HOST_ATOMIC 0
+#endif
+
+/* x86 hosts can do atomic operations at any address; others fault on
+   misaligned ones.  */
+#if defined(__i386__) || defined(__x86_64__)
+#define HOST_ATOMIC_OK(addr) 1
+#else
+#define HOST_ATOMIC_OK(addr) (((addr) & (DATA_SIZE - 1)) == 0)
+#endif
+
+/* Operations of the slow path.  */
+#ifndef ATOMIC_OP_CMPXCHG
+#define ATOMIC_OP_CMPXCHG 0
+#define ATOMIC_OP_XCHG    1
+#define ATOMIC_OP_ADD     2
+#endif
+
+/* Emulate an atomic operation with plain accesses, for the accesses that
+   cannot use the host atomic instructions.  This is only atomic with
+   respect to the other accesses that go through here, which is fine for
+   IO memory and for sizes the host has no atomic instructions for, but
+   not for the misaligned accesses on hosts that require alignment.  */
+static DATA_TYPE glue(atomic_slow_rmw, SUFFIX)(CPUArchState *env,
+                                               target_ulong addr,
+                                               DATA_TYPE *haddr, int op,
+                                               DATA_TYPE cmpv, DATA_TYPE val,
+                                               int mmu_idx, uintptr_t retaddr)
+{
+    DATA_TYPE old, new;
+    bool locked = atomic_slow_lock();
+
+#ifdef CONFIG_SOFTMMU
+    if (!haddr) {
+        old = glue(glue(helper_ret_ld, MMU_USUFFIX), _mmu)(env, addr, mmu_idx,
+                                                          retaddr);
+    } else
+#endif
+    {
+        old = glue(glue(ld, USUFFIX), _p)(haddr);
+    }
+    switch (op) {
+    case ATOMIC_OP_CMPXCHG:
+        new = old == cmpv ? val : old;
+        break;
+    case ATOMIC_OP_XCHG:
+        new = val;
+        break;
+    default:
+        new = old + val;
+        break;
+    }
+    if (op != ATOMIC_OP_CMPXCHG || old == cmpv) {
+#ifdef CONFIG_SOFTMMU
+        if (!haddr) {
+            glue(glue(helper_ret_st, SUFFIX), _mmu)(env, addr, new, mmu_idx,
+                                                    retaddr);
+        } else
+#endif
+        {
+            glue(glue(st, SUFFIX), _p)(haddr, new);
+        }
+    }
+    atomic_slow_unlock(locked);
+    return old;
+}
+
+ABI_TYPE glue(helper_atomic_cmpxchg, SUFFIX)(CPUArchState *env,
+                                             target_ulong addr,
+                                             ABI_TYPE cmpv, ABI_TYPE newv,
+                                             uint32_t mmu_idx)
+{
+    uintptr_t retaddr = GETRA();
+    DATA_TYPE *haddr = atomic_mmu_lookup(env, addr, DATA_SIZE, mmu_idx,
+                                         retaddr);
+
+#if HOST_ATOMIC
+    if (likely(haddr && HOST_ATOMIC_OK(addr))) {
+        DATA_TYPE old = atomic_cmpxchg(haddr, TSWAP((DATA_TYPE)cmpv),
+                                       TSWAP((DATA_TYPE)newv));
+        return TSWAP(old);
+    }
+#endif
+    return glue(atomic_slow_rmw, SUFFIX)(env, addr, haddr, ATOMIC_OP_CMPXCHG,
+                                         cmpv, newv, mmu_idx, retaddr);
+}
+
+ABI_TYPE glue(helper_atomic_xchg, SUFFIX)(CPUArchState *env,
+                                          target_ulong addr, ABI_TYPE val,
+                                          uint32_t mmu_idx)
+{
+    uintptr_t retaddr = GETRA();
+    DATA_TYPE *haddr = atomic_mmu_lookup(env, addr, DATA_SIZE, mmu_idx,
+                                         retaddr);
+
+#if HOST_ATOMIC
+    if (likely(haddr && HOST_ATOMIC_OK(addr))) {
+        DATA_TYPE old = atomic_xchg(haddr, TSWAP((DATA_TYPE)val));
+        return TSWAP(old);
+    }
+#endif
+    return glue(atomic_slow_rmw, SUFFIX)(env, addr, haddr, ATOMIC_OP_XCHG,
+                                         0, val, mmu_idx, retaddr);
+}
+
+ABI_TYPE glue(helper_atomic_fetch_add, SUFFIX)(CPUArchState *env,
+                                               target_ulong addr,
+                                               ABI_TYPE val, uint32_t mmu_idx)
+{
+    uintptr_t retaddr = GETRA();
+    DATA_TYPE *haddr = atomic_mmu_lookup(env, addr, DATA_SIZE, mmu_idx,
+                                         retaddr);
+
+#if HOST_ATOMIC
+    if (likely(haddr && HOST_ATOMIC_OK(addr))) {
+#if defined(BSWAP_NEEDED) && DATA_SIZE > 1
+        /* the host can only add in its own byte order */
+        DATA_TYPE old, new;
+
+        do {
+            old = atomic_read(haddr);
+            new = TSWAP((DATA_TYPE)(TSWAP(old) + val));
+        } while (atomic_cmpxchg(haddr, old, new) != old);
+        return TSWAP(old);
+#else
+        return atomic_fetch_add(haddr, (DATA_TYPE)val);
+#endif
+    }
+#endif
+    return glue(atomic_slow_rmw, SUFFIX)(env, addr, haddr, ATOMIC_OP_ADD,
+                                         0, val, mmu_idx, retaddr);
+}
+
+#undef SHIFT
+#undef DATA_SIZE
+#undef SUFFIX
+#undef USUFFIX
+#undef MMU_USUFFIX
+#undef DATA_TYPE
+#undef ABI_TYPE
+#undef TSWAP
+#undef HOST_ATOMIC
+#undef HOST_ATOMIC_OK
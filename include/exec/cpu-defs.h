@@ -72,8 +72,25 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+#include "tcg-target.h"
+
+#if defined(TCG_TARGET_IMPLEMENTS_DYN_TLB)
+/* The TLB of each MMU mode is allocated separately and resized on flush,
+   between 2^CPU_TLB_DYN_MIN_BITS and 2^CPU_TLB_DYN_MAX_BITS entries,
+   depending on how much of it was used.  The TCG backend indexes it with
+   tlb_mask[mmu_idx] rather than with a constant.  */
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+#define CPU_TLB_DYN_MAX_BITS 16
+#else
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+#endif
+/* Size of the fully associative victim TLB that catches conflict misses
+   of the direct mapped TLB above.  */
+#define CPU_VTLB_SIZE 8
+/* Bitmap of all the MMU modes, for tlb_flush_by_mmuidx() and friends.  */
+#define ALL_MMUIDX_BITS ((1 << NB_MMU_MODES) - 1)
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -103,16 +120,49 @@ typedef struct CPUTLBEntry {
 
 QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 
+/* Use of the TLB of one MMU mode since the last flush, and the maximum
+   seen over the current window of flushes; drives the resizing of
+   dynamically sized TLBs.  The victim TLB statistics are only updated by
+   the vCPU owning the TLB, so they need no atomics.  */
+typedef struct CPUTLBDesc {
+    int64_t window_begin_ns;
+    size_t window_max_entries;
+    size_t n_used_entries;
+    size_t victim_hits;
+    size_t victim_misses;
+} CPUTLBDesc;
+
+#if defined(TCG_TARGET_IMPLEMENTS_DYN_TLB)
+#define CPU_COMMON_TLB_TABLES
+
+/* Must survive the memset() of the CPU reset code.  */
+#define CPU_COMMON_TLB_DYN                                              \
+    CPUTLBDesc tlb_d[NB_MMU_MODES];                                     \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    hwaddr *iotlb[NB_MMU_MODES];
+#else
+#define CPU_COMMON_TLB_TABLES                                           \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];
+
+#define CPU_COMMON_TLB_DYN                                              \
+    CPUTLBDesc tlb_d[NB_MMU_MODES];
+#endif
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
-    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPU_COMMON_TLB_TABLES                                               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    unsigned int vtlb_index;
 
 #else
 
 #define CPU_COMMON_TLB
+#define CPU_COMMON_TLB_DYN
 
 #endif
 
@@ -168,6 +218,7 @@ typedef struct CPUWatchpoint {
     /* from this point: preserved by CPU reset */                       \
     /* ice debug support */                                             \
     QTAILQ_HEAD(breakpoints_head, CPUBreakpoint) breakpoints;            \
+    CPU_COMMON_TLB_DYN                                                  \
                                                                         \
     QTAILQ_HEAD(watchpoints_head, CPUWatchpoint) watchpoints;            \
     CPUWatchpoint *watchpoint_hit;                                      \
@@ -87,6 +87,7 @@ void QEMU_NORETURN cpu_io_recompile(CPUArchState *env, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUArchState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *head);
 void cpu_exec_init(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUArchState *env1);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
@@ -96,11 +97,17 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
                               int is_cpu_write_access);
 #if !defined(CONFIG_USER_ONLY)
 /* cputlb.c */
+void tlb_init(CPUArchState *env);
 void tlb_flush_page(CPUArchState *env, target_ulong addr);
 void tlb_flush(CPUArchState *env, int flush_global);
+void tlb_flush_page_by_mmuidx(CPUArchState *env, target_ulong addr,
+                              uint16_t idxmap);
+void tlb_flush_by_mmuidx(CPUArchState *env, uint16_t idxmap);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
+bool victim_tlb_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong page);
 void tb_invalidate_phys_addr(hwaddr addr);
 #else
 static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
@@ -110,12 +117,22 @@ static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 static inline void tlb_flush(CPUArchState *env, int flush_global)
 {
 }
+
+static inline void tlb_flush_page_by_mmuidx(CPUArchState *env,
+                                            target_ulong addr, uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_by_mmuidx(CPUArchState *env, uint16_t idxmap)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial size of the TB hash table, which grows with the number of TBs */
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -144,8 +161,6 @@ struct TranslationBlock {
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -166,25 +181,92 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* set by tb_phys_invalidate() */
+    bool invalid;
+    /* exits of this TB taken through the main loop and where they led,
+       counted up to TB_TRACE_THRESHOLD (see tb_gen_trace) */
+    uint16_t exit_count[2];
+    target_ulong exit_pc[2];
+    /* blocks this TB is made of, if it is a trace */
+    struct TBTrace *trace;
+    /* where the executions of this TB are counted, if it was translated
+       while the TB profiler was running */
+    struct TBProfile *prof;
 };
 
+/* Execution profile of the TBs with a given pc, cs_base and flags, which
+   outlives them so that the counts are kept across flushes.  */
+typedef struct TBProfile {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    uint64_t exec_count;
+    uint64_t translate_ns;
+    uint32_t guest_size;
+    uint32_t host_size;
+} TBProfile;
+
+/* A TB whose exits have been taken TB_TRACE_THRESHOLD times is chained
+   like any other, and if one of its direct exits was taken most of the
+   time it is replaced by a trace: a TB made of it and of up to
+   TB_TRACE_MAX_BLOCKS - 1 TBs that follow along the hottest exits.  */
+#define TB_TRACE_THRESHOLD 32
+#define TB_TRACE_MAX_BLOCKS 4
+
+typedef struct TBTrace {
+    int nb_blocks;
+    target_ulong pc[TB_TRACE_MAX_BLOCKS];
+    uint16_t size[TB_TRACE_MAX_BLOCKS];
+    /* exit of each block leading to the next one */
+    uint8_t exit[TB_TRACE_MAX_BLOCKS];
+} TBTrace;
+
 #include "exec/spinlock.h"
+#include "qemu/qht.h"
+
+/* The code buffer is split into at most CODE_GEN_MAX_REGIONS regions of
+   equal size, each with its own allocation cursor and its own slice of
+   the TB array.  Code is generated in one region at a time; when it is
+   full, the next one is recycled, which only invalidates the TBs of that
+   region (the oldest ones) instead of flushing everything.  */
+#define CODE_GEN_MAX_REGIONS 8
+
+typedef struct TBRegion {
+    uint8_t *start;
+    /* threshold past which no new TB is started in the region */
+    uint8_t *end;
+    /* allocation cursor */
+    uint8_t *ptr;
+    TranslationBlock *tbs;
+    int nb_tbs;
+    int max_tbs;
+} TBRegion;
 
 typedef struct TBContext TBContext;
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-    int nb_tbs;
-    /* any access to the tbs or the page table must use this lock */
+    /* TBs hashed by physical pc, pc and flags; see tb_hash_func() */
+    QHT htable;
+    TBRegion regions[CODE_GEN_MAX_REGIONS];
+    int n_regions;
+    size_t region_size;
+    /* region new code goes to */
+    int cur_region;
+    /* any access to the tbs or the page table must use this lock,
+       taken with tb_lock() */
     spinlock_t tb_lock;
+    /* current region full, see tb_recycle_deferred() */
+    bool recycle_pending;
+    /* all TBs must be flushed, see tb_recycle_deferred() */
+    bool flush_pending;
 
     /* statistics */
     int tb_flush_count;
+    int tb_recycle_count;
     int tb_phys_invalidate_count;
-
-    int tb_invalidated_flag;
+    int tb_trace_count;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -202,13 +284,26 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    h = (uint64_t)phys_pc * 0x9e3779b97f4a7c15ULL + pc;
+    h = (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL + flags;
+    return h ^ (h >> 32);
 }
 
+TranslationBlock *tb_htable_lookup(CPUArchState *env, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags);
+
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
+bool tb_recycle_pending(void);
+void tb_recycle_deferred(CPUArchState *env);
+void tb_lock(void);
+void tb_unlock(void);
+void tb_lock_reset(void);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
 #if defined(USE_DIRECT_JUMP)
@@ -377,6 +472,22 @@ bool io_mem_write(struct MemoryRegion *mr, hwaddr addr,
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
 
+/* Number of entries of the TLB of MMU mode MMU_IDX.  */
+static inline size_t tlb_n_entries(CPUArchState *env, int mmu_idx)
+{
+#if defined(TCG_TARGET_IMPLEMENTS_DYN_TLB)
+    return (env->tlb_mask[mmu_idx] >> CPU_TLB_ENTRY_BITS) + 1;
+#else
+    return CPU_TLB_SIZE;
+#endif
+}
+
+/* Index of the TLB entry that may map ADDR in MMU mode MMU_IDX.  */
+static inline int tlb_index(CPUArchState *env, int mmu_idx, target_ulong addr)
+{
+    return (addr >> TARGET_PAGE_BITS) & (tlb_n_entries(env, mmu_idx) - 1);
+}
+
 uint8_t helper_ldb_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 uint16_t helper_ldw_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 uint32_t helper_ldl_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
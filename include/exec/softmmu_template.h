@@ -23,6 +23,7 @@
  */
 #include "qemu/timer.h"
 #include "exec/memory.h"
+#include "sysemu/cpus.h"
 
 #define DATA_SIZE (1 << SHIFT)
 
@@ -70,14 +71,22 @@
 #define ADDR_READ addr_read
 #endif
 
+/* Probe the victim tlb for the page of ADDR, swapping a hit back into the
+   direct mapped tlb so that the caller can just reload its entry.  */
+#define VICTIM_TLB_HIT(ty)                                                    \
+    victim_tlb_hit(env, mmu_idx, index, offsetof(CPUTLBEntry, ty),            \
+                   addr & TARGET_PAGE_MASK)
+
 static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
                                               hwaddr physaddr,
                                               target_ulong addr,
                                               uintptr_t retaddr)
 {
     uint64_t val;
-    MemoryRegion *mr = iotlb_to_region(physaddr);
+    MemoryRegion *mr;
+    bool locked = qemu_tcg_lock_iothread();
 
+    mr = iotlb_to_region(physaddr);
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     env->mem_io_pc = retaddr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !can_do_io(env)) {
@@ -86,6 +95,7 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
 
     env->mem_io_vaddr = addr;
     io_mem_read(mr, physaddr, &val, 1 << SHIFT);
+    qemu_tcg_unlock_iothread(locked);
     return val;
 }
 
@@ -98,9 +108,10 @@ glue(glue(helper_ret_ld, USUFFIX), MMUSUFFIX)(CPUArchState *env,
                                               target_ulong addr, int mmu_idx,
                                               uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     uintptr_t haddr;
+    bool locked;
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
@@ -113,7 +124,14 @@ glue(glue(helper_ret_ld, USUFFIX), MMUSUFFIX)(CPUArchState *env,
             do_unaligned_access(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
         }
 #endif
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!VICTIM_TLB_HIT(ADDR_READ)) {
+            /* the page walk may touch device and memory map state */
+            locked = qemu_tcg_lock_iothread();
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+            qemu_tcg_unlock_iothread(locked);
+            /* the fill may have resized the tlb */
+            index = tlb_index(env, mmu_idx, addr);
+        }
         tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     }
 
@@ -196,8 +214,10 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
                                           target_ulong addr,
                                           uintptr_t retaddr)
 {
-    MemoryRegion *mr = iotlb_to_region(physaddr);
+    MemoryRegion *mr;
+    bool locked = qemu_tcg_lock_iothread();
 
+    mr = iotlb_to_region(physaddr);
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !can_do_io(env)) {
         cpu_io_recompile(env, retaddr);
@@ -206,6 +226,7 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
     env->mem_io_vaddr = addr;
     env->mem_io_pc = retaddr;
     io_mem_write(mr, physaddr, val, 1 << SHIFT);
+    qemu_tcg_unlock_iothread(locked);
 }
 
 void
@@ -213,9 +234,10 @@ glue(glue(helper_ret_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
                                              target_ulong addr, DATA_TYPE val,
                                              int mmu_idx, uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     uintptr_t haddr;
+    bool locked;
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
@@ -228,7 +250,12 @@ glue(glue(helper_ret_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
             do_unaligned_access(env, addr, 1, mmu_idx, retaddr);
         }
 #endif
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!VICTIM_TLB_HIT(addr_write)) {
+            locked = qemu_tcg_lock_iothread();
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+            qemu_tcg_unlock_iothread(locked);
+            index = tlb_index(env, mmu_idx, addr);
+        }
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     }
 
@@ -297,6 +324,7 @@ glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulong addr,
 #undef LSUFFIX
 #undef DATA_SIZE
 #undef ADDR_READ
+#undef VICTIM_TLB_HIT
 #undef WORD_TYPE
 #undef SDATA_TYPE
 #undef USUFFIX
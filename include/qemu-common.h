@@ -343,6 +343,7 @@ size_t qemu_iovec_from_buf(QEMUIOVector *qiov, size_t offset,
                            const void *buf, size_t bytes);
 size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
+bool qemu_iovec_is_zero(QEMUIOVector *qiov);
 
 bool buffer_is_zero(const void *buf, size_t len);
 
@@ -414,6 +415,9 @@ static inline bool is_power_of_2(uint64_t value)
 /* round down to the nearest power of 2*/
 int64_t pow2floor(int64_t value);
 
+/* round up to the nearest power of 2 (0 for 0) */
+int64_t pow2ceil(int64_t value);
+
 #include "qemu/module.h"
 
 /*
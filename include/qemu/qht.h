@@ -0,0 +1,130 @@
+/*
+ * Resizable hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "qemu/thread.h"
+
+typedef struct QHT QHT;
+typedef struct QHTMap QHTMap;
+typedef struct QHTStats QHTStats;
+
+/* Grow the table as it fills up, instead of just chaining more buckets.  */
+#define QHT_MODE_AUTO_RESIZE 0x1
+
+struct QHT {
+    QHTMap *map;
+    /* serializes qht_insert, qht_remove and qht_reset; lookups never
+       take it */
+    QemuMutex lock;
+    /* maps replaced by a resize, that lookups may still be walking */
+    QHTMap *retired;
+    size_t n_entries;
+    unsigned int n_resizes;
+    unsigned int mode;
+};
+
+struct QHTStats {
+    size_t head_buckets;
+    size_t used_head_buckets;
+    size_t entries;
+    /* number of buckets in the chains of the used head buckets */
+    size_t chain_buckets;
+    size_t max_chain;
+    unsigned int resizes;
+};
+
+/* Returns true if the object P is the one described by USERP.  */
+typedef bool (*qht_lookup_func_t)(const void *p, const void *userp);
+typedef void (*qht_iter_func_t)(void *p, uint32_t hash, void *userp);
+
+/**
+ * qht_init:
+ * @ht: the table to initialize
+ * @n_elems: number of entries the table should hold without resizing
+ * @mode: QHT_MODE_* flags
+ */
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode);
+
+/**
+ * qht_destroy:
+ * @ht: the table
+ *
+ * Free all the memory of @ht.  No lookup may be running.
+ */
+void qht_destroy(QHT *ht);
+
+/**
+ * qht_insert:
+ * @ht: the table
+ * @p: the object to insert, must not be NULL
+ * @hash: hash of @p
+ *
+ * Returns false if @p was already in @ht.
+ */
+bool qht_insert(QHT *ht, void *p, uint32_t hash);
+
+/**
+ * qht_lookup:
+ * @ht: the table
+ * @func: comparison function
+ * @userp: opaque description of the object looked for, passed to @func
+ * @hash: hash of the object looked for
+ *
+ * Lookups do not take any lock and may run concurrently with updates of
+ * the table.  A lookup racing with qht_insert may miss the object being
+ * inserted, and one racing with qht_remove may still return the object
+ * being removed; callers that care must serialize with the writers and
+ * look up again.
+ *
+ * Returns the first object for which @func returns true, or NULL.
+ */
+void *qht_lookup(QHT *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash);
+
+/**
+ * qht_remove:
+ * @ht: the table
+ * @p: the object to remove
+ * @hash: hash of @p
+ *
+ * Returns false if @p was not in @ht.
+ */
+bool qht_remove(QHT *ht, const void *p, uint32_t hash);
+
+/**
+ * qht_reset:
+ * @ht: the table
+ *
+ * Remove all the entries of @ht, keeping its current size, and free the
+ * maps retired by earlier resizes.  There being no safe point at which
+ * to free them otherwise, no lookup may be running while this is called.
+ */
+void qht_reset(QHT *ht);
+
+/**
+ * qht_iter:
+ * @ht: the table
+ * @func: function called for each entry
+ * @userp: opaque pointer passed to @func
+ *
+ * @func must not modify @ht.
+ */
+void qht_iter(QHT *ht, qht_iter_func_t func, void *userp);
+
+/**
+ * qht_statistics:
+ * @ht: the table
+ * @stats: filled with the occupancy statistics of @ht
+ */
+void qht_statistics(QHT *ht, QHTStats *stats);
+
+#endif
@@ -1,12 +1,20 @@
 #ifndef QEMU_CPUS_H
 #define QEMU_CPUS_H
 
+#include "qemu/option.h"
+
 /* cpus.c */
 void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
 
+void qemu_tcg_configure(QemuOpts *opts);
+bool qemu_tcg_mttcg_enabled(void);
+bool qemu_tcg_lock_iothread(void);
+void qemu_tcg_unlock_iothread(bool locked);
+void qemu_tcg_lock_iothread_reset(void);
+
 void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
 void cpu_synchronize_all_post_init(void);
@@ -29,6 +29,7 @@
 #include "qemu.h"
 #include "qemu-common.h"
 #include "qemu/cache-utils.h"
+#include "qemu/atomic.h"
 #include "cpu.h"
 #include "tcg.h"
 #include "qemu/timer.h"
@@ -43,6 +44,7 @@ const char *argv0;
 int gdbstub_port;
 envlist_t *envlist;
 const char *cpu_model;
+static const char *tb_cache_dir;
 unsigned long mmap_min_addr;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long guest_base;
@@ -152,55 +154,151 @@ static inline void exclusive_idle(void)
 static inline void start_exclusive(void)
 {
     CPUState *other_cpu;
+    int running_cpus;
 
     pthread_mutex_lock(&exclusive_lock);
     exclusive_idle();
 
-    pending_cpus = 1;
     /* Make all other cpus stop executing.  */
+    atomic_set(&pending_cpus, 1);
+
+    /* Write pending_cpus before reading other_cpu->running.  */
+    smp_mb();
+    running_cpus = 0;
     CPU_FOREACH(other_cpu) {
-        if (other_cpu->running) {
-            pending_cpus++;
+        if (atomic_read(&other_cpu->running)) {
+            other_cpu->has_waiter = true;
+            running_cpus++;
             cpu_exit(other_cpu);
         }
     }
-    if (pending_cpus > 1) {
+    atomic_set(&pending_cpus, running_cpus + 1);
+    while (pending_cpus > 1) {
         pthread_cond_wait(&exclusive_cond, &exclusive_lock);
     }
+
+    /* Nobody can start another exclusive operation until end_exclusive
+       resets pending_cpus, so the lock need not be kept.  */
+    pthread_mutex_unlock(&exclusive_lock);
 }
 
 /* Finish an exclusive operation.  */
 static inline void end_exclusive(void)
 {
-    pending_cpus = 0;
+    pthread_mutex_lock(&exclusive_lock);
+    atomic_set(&pending_cpus, 0);
     pthread_cond_broadcast(&exclusive_resume);
     pthread_mutex_unlock(&exclusive_lock);
 }
 
-/* Wait for exclusive ops to finish, and begin cpu execution.  */
+/* Wait for exclusive ops to finish, and begin cpu execution.  The lock is
+   only taken while an exclusive operation is pending, so that threads do
+   not serialize on it every time they enter or leave cpu_exec.  */
 static inline void cpu_exec_start(CPUState *cpu)
 {
-    pthread_mutex_lock(&exclusive_lock);
-    exclusive_idle();
-    cpu->running = true;
-    pthread_mutex_unlock(&exclusive_lock);
+    atomic_set(&cpu->running, true);
+
+    /* Write cpu->running before reading pending_cpus.  */
+    smp_mb();
+
+    /* If start_exclusive saw cpu->running, it counted this cpu (has_waiter
+       is set) and kicked it; it will be released by cpu_exec_end.
+       Otherwise, wait for the exclusive operation to complete.  */
+    if (unlikely(atomic_read(&pending_cpus))) {
+        pthread_mutex_lock(&exclusive_lock);
+        if (!cpu->has_waiter) {
+            atomic_set(&cpu->running, false);
+            exclusive_idle();
+            atomic_set(&cpu->running, true);
+        }
+        pthread_mutex_unlock(&exclusive_lock);
+    }
 }
 
 /* Mark cpu as not executing, and release pending exclusive ops.  */
 static inline void cpu_exec_end(CPUState *cpu)
 {
-    pthread_mutex_lock(&exclusive_lock);
-    cpu->running = false;
-    if (pending_cpus > 1) {
-        pending_cpus--;
-        if (pending_cpus == 1) {
-            pthread_cond_signal(&exclusive_cond);
+    atomic_set(&cpu->running, false);
+
+    /* Write cpu->running before reading pending_cpus.  */
+    smp_mb();
+
+    /* If start_exclusive did not count this cpu, the next cpu_exec_start
+       waits for the exclusive operation instead.  */
+    if (unlikely(atomic_read(&pending_cpus))) {
+        pthread_mutex_lock(&exclusive_lock);
+        if (cpu->has_waiter) {
+            cpu->has_waiter = false;
+            atomic_set(&pending_cpus, pending_cpus - 1);
+            if (pending_cpus == 1) {
+                pthread_cond_signal(&exclusive_cond);
+            }
         }
+        pthread_mutex_unlock(&exclusive_lock);
+    }
+
+    /* tb_gen_code and tb_flush leave the code buffer alone while other
+       threads may be running from it; do the work now that they can be
+       stopped.  */
+    if (unlikely(tb_recycle_pending())) {
+        start_exclusive();
+        tb_recycle_deferred(cpu->env_ptr);
+        end_exclusive();
     }
-    exclusive_idle();
-    pthread_mutex_unlock(&exclusive_lock);
 }
 
+#if defined(TARGET_ARM) || defined(TARGET_MIPS) || defined(TARGET_ALPHA)
+/* Store NEWVAL at guest address ADDR if it holds OLDVAL, atomically with
+   respect to the other cpus.  This is the store half of load-locked/
+   store-conditional pairs.  It is done with a host compare-and-swap on
+   that address only, so the other cpus need not be stopped; values are
+   in host byte order, like those of get_user/put_user.
+   Returns 0 if the value was stored, 1 if the comparison failed, and -1
+   if ADDR cannot be written.  */
+static int cmpxchg_user(abi_ulong addr, uint64_t oldval, uint64_t newval,
+                        int size)
+{
+    void *p;
+    bool done;
+
+    if (!access_ok(VERIFY_WRITE, addr, size)) {
+        return -1;
+    }
+    p = g2h(addr);
+    switch (size) {
+    case 1:
+        done = __sync_bool_compare_and_swap((uint8_t *)p, (uint8_t)oldval,
+                                            (uint8_t)newval);
+        break;
+    case 2:
+        done = __sync_bool_compare_and_swap((uint16_t *)p, tswap16(oldval),
+                                            tswap16(newval));
+        break;
+    case 4:
+        done = __sync_bool_compare_and_swap((uint32_t *)p, tswap32(oldval),
+                                            tswap32(newval));
+        break;
+    case 8:
+#if HOST_LONG_BITS == 64
+        done = __sync_bool_compare_and_swap((uint64_t *)p, tswap64(oldval),
+                                            tswap64(newval));
+#else
+        /* No 64-bit compare-and-swap everywhere; stop the world instead.  */
+        start_exclusive();
+        done = tswap64(*(uint64_t *)p) == oldval;
+        if (done) {
+            *(uint64_t *)p = tswap64(newval);
+        }
+        end_exclusive();
+#endif
+        break;
+    default:
+        abort();
+    }
+    return done ? 0 : 1;
+}
+#endif
+
 void cpu_list_lock(void)
 {
     pthread_mutex_lock(&cpu_list_mutex);
@@ -284,7 +382,9 @@ void cpu_loop(CPUX86State *env)
     target_siginfo_t info;
 
     for(;;) {
+        cpu_exec_start(cs);
         trapnr = cpu_x86_exec(env);
+        cpu_exec_end(cs);
         switch(trapnr) {
         case 0x80:
             /* linux syscall from int $0x80 */
@@ -468,17 +568,13 @@ void cpu_loop(CPUX86State *env)
  */
 static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
 {
-    uint64_t oldval, newval, val;
+    uint64_t oldval, newval;
     uint32_t addr, cpsr;
     target_siginfo_t info;
 
     /* Based on the 32 bit code in do_kernel_trap */
 
-    /* XXX: This only works between threads, not between processes.
-       It's probably possible to implement this with native host
-       operations. However things like ldrex/strex are much harder so
-       there's not much point trying.  */
-    start_exclusive();
+    /* XXX: This only works between threads, not between processes.  */
     cpsr = cpsr_read(env);
     addr = env->regs[2];
 
@@ -492,31 +588,23 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
         goto segv;
     };
 
-    if (get_user_u64(val, addr)) {
-        env->cp15.c6_data = addr;
-        goto segv;
-    }
-
-    if (val == oldval) {
-        val = newval;
-
-        if (put_user_u64(val, addr)) {
-            env->cp15.c6_data = addr;
-            goto segv;
-        };
-
+    switch (cmpxchg_user(addr, oldval, newval, 8)) {
+    case 0:
         env->regs[0] = 0;
         cpsr |= CPSR_C;
-    } else {
+        break;
+    case 1:
         env->regs[0] = -1;
         cpsr &= ~CPSR_C;
+        break;
+    default:
+        env->cp15.c6_data = addr;
+        goto segv;
     }
     cpsr_write(env, cpsr, CPSR_C);
-    end_exclusive();
     return;
 
 segv:
-    end_exclusive();
     /* We get the PC of the entry address - which is as good as anything,
        on a real kernel what you get depends on which mode it uses. */
     info.si_signo = SIGSEGV;
@@ -525,8 +613,6 @@ segv:
     info.si_code = TARGET_SEGV_MAPERR;
     info._sifields._sigfault._addr = env->cp15.c6_data;
     queue_signal(env, info.si_signo, &info);
-
-    end_exclusive();
 }
 
 /* Handle a jump to the kernel code page.  */
@@ -535,27 +621,17 @@ do_kernel_trap(CPUARMState *env)
 {
     uint32_t addr;
     uint32_t cpsr;
-    uint32_t val;
 
     switch (env->regs[15]) {
     case 0xffff0fa0: /* __kernel_memory_barrier */
-        /* ??? No-op. Will need to do better for SMP.  */
+        smp_mb();
         break;
     case 0xffff0fc0: /* __kernel_cmpxchg */
-         /* XXX: This only works between threads, not between processes.
-            It's probably possible to implement this with native host
-            operations. However things like ldrex/strex are much harder so
-            there's not much point trying.  */
-        start_exclusive();
+         /* XXX: This only works between threads, not between processes.  */
         cpsr = cpsr_read(env);
         addr = env->regs[2];
         /* FIXME: This should SEGV if the access fails.  */
-        if (get_user_u32(val, addr))
-            val = ~env->regs[0];
-        if (val == env->regs[0]) {
-            val = env->regs[1];
-            /* FIXME: Check for segfaults.  */
-            put_user_u32(val, addr);
+        if (cmpxchg_user(addr, env->regs[0], env->regs[1], 4) == 0) {
             env->regs[0] = 0;
             cpsr |= CPSR_C;
         } else {
@@ -563,7 +639,6 @@ do_kernel_trap(CPUARMState *env)
             cpsr &= ~CPSR_C;
         }
         cpsr_write(env, cpsr, CPSR_C);
-        end_exclusive();
         break;
     case 0xffff0fe0: /* __kernel_get_tls */
         env->regs[0] = env->cp15.c13_tls2;
@@ -587,84 +662,6 @@ do_kernel_trap(CPUARMState *env)
 }
 #endif
 
-static int do_strex(CPUARMState *env)
-{
-    uint32_t val;
-    int size;
-    int rc = 1;
-    int segv = 0;
-    uint32_t addr;
-    start_exclusive();
-    addr = env->exclusive_addr;
-    if (addr != env->exclusive_test) {
-        goto fail;
-    }
-    size = env->exclusive_info & 0xf;
-    switch (size) {
-    case 0:
-        segv = get_user_u8(val, addr);
-        break;
-    case 1:
-        segv = get_user_u16(val, addr);
-        break;
-    case 2:
-    case 3:
-        segv = get_user_u32(val, addr);
-        break;
-    default:
-        abort();
-    }
-    if (segv) {
-        env->cp15.c6_data = addr;
-        goto done;
-    }
-    if (val != env->exclusive_val) {
-        goto fail;
-    }
-    if (size == 3) {
-        segv = get_user_u32(val, addr + 4);
-        if (segv) {
-            env->cp15.c6_data = addr + 4;
-            goto done;
-        }
-        if (val != env->exclusive_high) {
-            goto fail;
-        }
-    }
-    val = env->regs[(env->exclusive_info >> 8) & 0xf];
-    switch (size) {
-    case 0:
-        segv = put_user_u8(val, addr);
-        break;
-    case 1:
-        segv = put_user_u16(val, addr);
-        break;
-    case 2:
-    case 3:
-        segv = put_user_u32(val, addr);
-        break;
-    }
-    if (segv) {
-        env->cp15.c6_data = addr;
-        goto done;
-    }
-    if (size == 3) {
-        val = env->regs[(env->exclusive_info >> 12) & 0xf];
-        segv = put_user_u32(val, addr + 4);
-        if (segv) {
-            env->cp15.c6_data = addr + 4;
-            goto done;
-        }
-    }
-    rc = 0;
-fail:
-    env->regs[15] += 4;
-    env->regs[(env->exclusive_info >> 4) & 0xf] = rc;
-done:
-    end_exclusive();
-    return segv;
-}
-
 #ifdef TARGET_ABI32
 void cpu_loop(CPUARMState *env)
 {
@@ -861,12 +858,6 @@ void cpu_loop(CPUARMState *env)
             if (do_kernel_trap(env))
               goto error;
             break;
-        case EXCP_STREX:
-            if (do_strex(env)) {
-                addr = env->cp15.c6_data;
-                goto do_segv;
-            }
-            break;
         default:
         error:
             fprintf(stderr, "qemu: unhandled CPU exception 0x%x - aborting\n",
@@ -938,12 +929,6 @@ void cpu_loop(CPUARMState *env)
                 queue_signal(env, info.si_signo, &info);
             }
             break;
-        case EXCP_STREX:
-            if (do_strex(env)) {
-                addr = env->cp15.c6_data;
-                goto do_segv;
-            }
-            break;
         default:
             fprintf(stderr, "qemu: unhandled CPU exception 0x%x - aborting\n",
                     trapnr);
@@ -1168,7 +1153,9 @@ void cpu_loop (CPUSPARCState *env)
     target_siginfo_t info;
 
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_sparc_exec (env);
+        cpu_exec_end(cs);
 
         /* Compute PSR before exposing state.  */
         if (env->cc_op != CC_OP_FLAGS) {
@@ -1360,63 +1347,6 @@ do {                                                                    \
     }                                                                   \
 } while (0)
 
-static int do_store_exclusive(CPUPPCState *env)
-{
-    target_ulong addr;
-    target_ulong page_addr;
-    target_ulong val;
-    int flags;
-    int segv = 0;
-
-    addr = env->reserve_ea;
-    page_addr = addr & TARGET_PAGE_MASK;
-    start_exclusive();
-    mmap_lock();
-    flags = page_get_flags(page_addr);
-    if ((flags & PAGE_READ) == 0) {
-        segv = 1;
-    } else {
-        int reg = env->reserve_info & 0x1f;
-        int size = (env->reserve_info >> 5) & 0xf;
-        int stored = 0;
-
-        if (addr == env->reserve_addr) {
-            switch (size) {
-            case 1: segv = get_user_u8(val, addr); break;
-            case 2: segv = get_user_u16(val, addr); break;
-            case 4: segv = get_user_u32(val, addr); break;
-#if defined(TARGET_PPC64)
-            case 8: segv = get_user_u64(val, addr); break;
-#endif
-            default: abort();
-            }
-            if (!segv && val == env->reserve_val) {
-                val = env->gpr[reg];
-                switch (size) {
-                case 1: segv = put_user_u8(val, addr); break;
-                case 2: segv = put_user_u16(val, addr); break;
-                case 4: segv = put_user_u32(val, addr); break;
-#if defined(TARGET_PPC64)
-                case 8: segv = put_user_u64(val, addr); break;
-#endif
-                default: abort();
-                }
-                if (!segv) {
-                    stored = 1;
-                }
-            }
-        }
-        env->crf[0] = (stored << 1) | xer_so;
-        env->reserve_addr = (target_ulong)-1;
-    }
-    if (!segv) {
-        env->nip += 4;
-    }
-    mmap_unlock();
-    end_exclusive();
-    return segv;
-}
-
 void cpu_loop(CPUPPCState *env)
 {
     CPUState *cs = CPU(ppc_env_get_cpu(env));
@@ -1800,15 +1730,6 @@ void cpu_loop(CPUPPCState *env)
             }
             env->gpr[3] = ret;
             break;
-        case POWERPC_EXCP_STCX:
-            if (do_store_exclusive(env)) {
-                info.si_signo = TARGET_SIGSEGV;
-                info.si_errno = 0;
-                info.si_code = TARGET_SEGV_MAPERR;
-                info._sifields._sigfault._addr = env->nip;
-                queue_signal(env, info.si_signo, &info);
-            }
-            break;
         case EXCP_DEBUG:
             {
                 int sig;
@@ -2189,49 +2110,32 @@ static const uint8_t mips_syscall_args[] = {
 static int do_store_exclusive(CPUMIPSState *env)
 {
     target_ulong addr;
-    target_ulong page_addr;
-    target_ulong val;
-    int flags;
     int segv = 0;
     int reg;
     int d;
 
     addr = env->lladdr;
-    page_addr = addr & TARGET_PAGE_MASK;
-    start_exclusive();
-    mmap_lock();
-    flags = page_get_flags(page_addr);
-    if ((flags & PAGE_READ) == 0) {
+    if (!access_ok(VERIFY_READ, addr & TARGET_PAGE_MASK, 1)) {
         segv = 1;
     } else {
         reg = env->llreg & 0x1f;
         d = (env->llreg & 0x20) != 0;
-        if (d) {
-            segv = get_user_s64(val, addr);
-        } else {
-            segv = get_user_s32(val, addr);
-        }
-        if (!segv) {
-            if (val != env->llval) {
-                env->active_tc.gpr[reg] = 0;
-            } else {
-                if (d) {
-                    segv = put_user_u64(env->llnewval, addr);
-                } else {
-                    segv = put_user_u32(env->llnewval, addr);
-                }
-                if (!segv) {
-                    env->active_tc.gpr[reg] = 1;
-                }
-            }
+        switch (cmpxchg_user(addr, env->llval, env->llnewval, d ? 8 : 4)) {
+        case 0:
+            env->active_tc.gpr[reg] = 1;
+            break;
+        case 1:
+            env->active_tc.gpr[reg] = 0;
+            break;
+        default:
+            segv = 1;
+            break;
         }
     }
     env->lladdr = -1;
     if (!segv) {
         env->active_tc.PC += 4;
     }
-    mmap_unlock();
-    end_exclusive();
     return segv;
 }
 
@@ -2496,7 +2400,9 @@ void cpu_loop(CPUOpenRISCState *env)
     int trapnr, gdbsig;
 
     for (;;) {
+        cpu_exec_start(cs);
         trapnr = cpu_exec(env);
+        cpu_exec_end(cs);
         gdbsig = 0;
 
         switch (trapnr) {
@@ -2556,6 +2462,9 @@ void cpu_loop(CPUOpenRISCState *env)
         case EXCP_NR:
             qemu_log("\nNR\n");
             break;
+        case EXCP_INTERRUPT:
+            /* just indicate that signals should be handled asap */
+            break;
         default:
             qemu_log("\nqemu: unhandled CPU exception %#x - aborting\n",
                      trapnr);
@@ -2584,7 +2493,9 @@ void cpu_loop(CPUSH4State *env)
     target_siginfo_t info;
 
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_sh4_exec (env);
+        cpu_exec_end(cs);
 
         switch (trapnr) {
         case 0x160:
@@ -2644,7 +2555,9 @@ void cpu_loop(CPUCRISState *env)
     target_siginfo_t info;
     
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_cris_exec (env);
+        cpu_exec_end(cs);
         switch (trapnr) {
         case 0xaa:
             {
@@ -2703,7 +2616,9 @@ void cpu_loop(CPUMBState *env)
     target_siginfo_t info;
     
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_mb_exec (env);
+        cpu_exec_end(cs);
         switch (trapnr) {
         case 0xaa:
             {
@@ -2806,7 +2721,9 @@ void cpu_loop(CPUM68KState *env)
     TaskState *ts = env->opaque;
 
     for(;;) {
+        cpu_exec_start(cs);
         trapnr = cpu_m68k_exec(env);
+        cpu_exec_end(cs);
         switch(trapnr) {
         case EXCP_ILLEGAL:
             {
@@ -2892,7 +2809,7 @@ void cpu_loop(CPUM68KState *env)
 #ifdef TARGET_ALPHA
 static void do_store_exclusive(CPUAlphaState *env, int reg, int quad)
 {
-    target_ulong addr, val, tmp;
+    target_ulong addr, tmp;
     target_siginfo_t info;
     int ret = 0;
 
@@ -2901,33 +2818,23 @@ static void do_store_exclusive(CPUAlphaState *env, int reg, int quad)
     env->lock_addr = -1;
     env->lock_st_addr = 0;
 
-    start_exclusive();
-    mmap_lock();
-
     if (addr == tmp) {
-        if (quad ? get_user_s64(val, addr) : get_user_s32(val, addr)) {
-            goto do_sigsegv;
-        }
-
-        if (val == env->lock_value) {
-            tmp = env->ir[reg];
-            if (quad ? put_user_u64(tmp, addr) : put_user_u32(tmp, addr)) {
-                goto do_sigsegv;
-            }
+        switch (cmpxchg_user(addr, env->lock_value, env->ir[reg],
+                             quad ? 8 : 4)) {
+        case 0:
             ret = 1;
+            break;
+        case 1:
+            break;
+        default:
+            goto do_sigsegv;
         }
     }
     env->ir[reg] = ret;
     env->pc += 4;
-
-    mmap_unlock();
-    end_exclusive();
     return;
 
  do_sigsegv:
-    mmap_unlock();
-    end_exclusive();
-
     info.si_signo = TARGET_SIGSEGV;
     info.si_errno = 0;
     info.si_code = TARGET_SEGV_MAPERR;
@@ -2943,7 +2850,9 @@ void cpu_loop(CPUAlphaState *env)
     abi_long sysret;
 
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_alpha_exec (env);
+        cpu_exec_end(cs);
 
         /* All of the traps imply a transition through PALcode, which
            implies an REI instruction has been executed.  Which means
@@ -3129,7 +3038,9 @@ void cpu_loop(CPUS390XState *env)
     target_ulong addr;
 
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_s390x_exec(env);
+        cpu_exec_end(cs);
         switch (trapnr) {
         case EXCP_INTERRUPT:
             /* Just indicate that signals should be handled asap.  */
@@ -3342,6 +3253,11 @@ static void handle_arg_ld_prefix(const char *arg)
     interp_prefix = strdup(arg);
 }
 
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_dir = arg;
+}
+
 static void handle_arg_pagesize(const char *arg)
 {
     qemu_host_page_size = atoi(arg);
@@ -3469,6 +3385,8 @@ static const struct qemu_argument arg_table[] = {
     {"R",          "QEMU_RESERVED_VA", true,  handle_arg_reserved_va,
      "size",       "reserve 'size' bytes for guest virtual address space"},
 #endif
+    {"tbcache",    "QEMU_TBCACHE",     true,  handle_arg_tb_cache,
+     "dir",        "save translated code in 'dir' and reuse it later"},
     {"d",          "QEMU_LOG",         true,  handle_arg_log,
      "item[,...]", "enable logging of specified items "
      "(use '-d help' for a list of items)"},
@@ -3729,6 +3647,10 @@ int main(int argc, char **argv, char **envp)
 
     thread_cpu = cpu;
 
+    if (tb_cache_dir) {
+        tb_cache_init(tb_cache_dir, filename, cpu_model);
+    }
+
     if (getenv("QEMU_STRACE")) {
         do_strace = 1;
     }
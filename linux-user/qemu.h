@@ -268,6 +268,13 @@ void cpu_list_unlock(void);
 void mmap_fork_start(void);
 void mmap_fork_end(int child);
 
+/* tbcache.c */
+void tb_cache_init(const char *dir, const char *exec_path,
+                   const char *cpu_model);
+bool tb_cache_gen_code(CPUArchState *env, TranslationBlock *tb);
+void tb_cache_add(CPUArchState *env, TranslationBlock *tb);
+void tb_cache_save(void);
+
 /* main.c */
 extern unsigned long guest_stack_size;
 
@@ -0,0 +1,896 @@
+/*
+ *  Persistent translation cache
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <glib.h>
+
+#include "qemu.h"
+#include "qemu-common.h"
+#include "tcg.h"
+
+/* The optimized TCG ops of the TBs translated by a run are saved at exit
+ * in a file specific to the guest executable, and replayed instead of
+ * calling the front end when a later run translates the same TBs again.
+ * This skips decoding and optimization, which are most of the cost of a
+ * translation.
+ *
+ * Entries are looked up by pc, cs_base, flags and cflags and checked
+ * against a hash of the guest code, so that a library mapped elsewhere or
+ * modified code simply misses.  Ops hold absolute guest addresses, so
+ * nothing is shared between different load addresses.
+ *
+ * The only host addresses found in the ops of a TB are those of helpers
+ * and of the TB itself (in exit_tb); both are relocated on load.  Helpers
+ * are saved as an index in a table of the helpers sorted by name, which
+ * must be identical when the file is loaded.  TBs whose ops load other
+ * host pointers are not saved.  The file is only used by the very same
+ * QEMU binary, and only if it belongs to the user running it.
+ *
+ * Every entry of the file is checked against the running build before it
+ * is used, and the whole file is dropped if one does not match: ops and
+ * params must be consistent, temps, labels and helper indexes in range,
+ * and helpers may only be called through a relocated constant.
+ */
+
+//#define DEBUG_TB_CACHE
+
+#define TB_CACHE_MAGIC "QEMUTBC"
+#define TB_CACHE_VERSION 2
+
+/* stop recording translations past this size */
+#define TB_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+#define TB_CACHE_RELOC_HELPER 1
+#define TB_CACHE_RELOC_TB 2
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_entries;
+    uint64_t qemu_id;
+    uint32_t nb_helpers;
+    uint32_t padding;
+    uint64_t helpers_id;
+} TBCacheHeader;
+
+/* Followed by the params (as uint64_t), the relocations, the opcodes and
+   the types of the temps, and padded to a multiple of 8 bytes.  */
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t code_hash;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t size;
+    uint32_t icount;
+    uint32_t nb_ops;
+    uint32_t nb_params;
+    uint32_t nb_temps;
+    uint32_t nb_labels;
+    uint32_t nb_relocs;
+    uint32_t len;
+} TBCacheEntry;
+
+typedef struct TBCache {
+    char *path;
+    uint64_t qemu_id;
+    /* the helpers sorted by name, indexed by the relocations */
+    TCGHelperInfo *helpers;
+    uint32_t nb_helpers;
+    uint64_t helpers_id;
+    /* helper address -> index + 1 */
+    GHashTable *helper_index;
+    /* contents of the file read at startup */
+    gchar *file_data;
+    gsize file_size;
+    GHashTable *entries;
+    size_t size;
+    bool dirty;
+} TBCache;
+
+static TBCache *tb_cache;
+
+static uint64_t tb_cache_hash(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t i;
+
+    /* FNV-1a */
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define TB_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+static guint tb_cache_entry_hash(gconstpointer key)
+{
+    const TBCacheEntry *e = key;
+
+    return e->pc ^ (e->pc >> 32) ^ e->cs_base ^ e->flags ^ e->cflags;
+}
+
+static gboolean tb_cache_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheEntry *e1 = a;
+    const TBCacheEntry *e2 = b;
+
+    return e1->pc == e2->pc && e1->cs_base == e2->cs_base &&
+           e1->flags == e2->flags && e1->cflags == e2->cflags;
+}
+
+static inline uint64_t *tb_cache_entry_params(TBCacheEntry *e)
+{
+    return (uint64_t *)(e + 1);
+}
+
+static inline uint32_t *tb_cache_entry_relocs(TBCacheEntry *e)
+{
+    return (uint32_t *)(tb_cache_entry_params(e) + e->nb_params);
+}
+
+static inline uint16_t *tb_cache_entry_ops(TBCacheEntry *e)
+{
+    return (uint16_t *)(tb_cache_entry_relocs(e) + e->nb_relocs);
+}
+
+static inline uint8_t *tb_cache_entry_temps(TBCacheEntry *e)
+{
+    return (uint8_t *)(tb_cache_entry_ops(e) + e->nb_ops);
+}
+
+static size_t tb_cache_entry_len(uint32_t nb_params, uint32_t nb_relocs,
+                                 uint32_t nb_ops, uint32_t nb_temps)
+{
+    size_t len;
+
+    len = sizeof(TBCacheEntry) + nb_params * sizeof(uint64_t) +
+          nb_relocs * sizeof(uint32_t) + nb_ops * sizeof(uint16_t) +
+          nb_temps;
+    return (len + 7) & ~(size_t)7;
+}
+
+/* The identity of the helper table includes the offsets of the helpers
+   from this function, which only hold for the very same binary.  */
+static inline uintptr_t tb_cache_text_base(void)
+{
+    return (uintptr_t)&tb_cache_init;
+}
+
+static bool tb_cache_usable(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    /* breakpoints and single-stepping change the ops of a TB */
+    return tb_cache && !singlestep && !cpu->singlestep_enabled &&
+           QTAILQ_EMPTY(&env->breakpoints);
+}
+
+static uint64_t tb_cache_code_hash(target_ulong pc, uint32_t size)
+{
+    return tb_cache_hash(TB_CACHE_HASH_INIT, g2h(pc), size);
+}
+
+/* Called with tb_lock held.  */
+bool tb_cache_gen_code(CPUArchState *env, TranslationBlock *tb)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheEntry key, *e;
+    uint64_t *params;
+    uint32_t *relocs;
+    uint8_t *temps;
+    uint32_t i;
+
+    if (!tb_cache_usable(env)) {
+        return false;
+    }
+
+    key.pc = tb->pc;
+    key.cs_base = tb->cs_base;
+    key.flags = tb->flags;
+    key.cflags = tb->cflags;
+    e = g_hash_table_lookup(tb_cache->entries, &key);
+    if (!e) {
+        return false;
+    }
+    if (page_check_range(tb->pc, e->size, PAGE_READ) < 0 ||
+        tb_cache_code_hash(tb->pc, e->size) != e->code_hash) {
+        return false;
+    }
+
+    memcpy(s->gen_opc_buf, tb_cache_entry_ops(e),
+           e->nb_ops * sizeof(uint16_t));
+    s->gen_opc_ptr = s->gen_opc_buf + e->nb_ops;
+    *s->gen_opc_ptr = INDEX_op_end;
+
+    params = tb_cache_entry_params(e);
+    for (i = 0; i < e->nb_params; i++) {
+        s->gen_opparam_buf[i] = params[i];
+    }
+    s->gen_opparam_ptr = s->gen_opparam_buf + e->nb_params;
+
+    relocs = tb_cache_entry_relocs(e);
+    for (i = 0; i < e->nb_relocs; i++) {
+        TCGArg *arg = &s->gen_opparam_buf[relocs[i] >> 2];
+
+        if ((relocs[i] & 3) == TB_CACHE_RELOC_HELPER) {
+            *arg = tb_cache->helpers[*arg].func;
+        } else {
+            *arg += (uintptr_t)tb;
+        }
+    }
+
+    temps = tb_cache_entry_temps(e);
+    for (i = 0; i < e->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[s->nb_globals + i];
+
+        ts->type = temps[i] & 3;
+        ts->base_type = (temps[i] >> 2) & 3;
+        ts->temp_local = (temps[i] >> 4) & 1;
+        ts->temp_allocated = 1;
+        ts->name = NULL;
+    }
+    s->nb_temps = s->nb_globals + e->nb_temps;
+
+    for (i = 0; i < e->nb_labels; i++) {
+        s->labels[i].has_value = 0;
+        s->labels[i].u.first_reloc = NULL;
+    }
+    s->nb_labels = e->nb_labels;
+
+    tb->size = e->size;
+    tb->icount = e->icount;
+    s->ops_optimized = true;
+    return true;
+}
+
+/* Find the host addresses in the ops of TB and fill RELOCS with them.
+   Returns the number of relocations, or -1 if the ops cannot be saved.  */
+static int tb_cache_find_relocs(TCGContext *s, TranslationBlock *tb,
+                                uint32_t *relocs)
+{
+    /* index of the param holding the constant last moved to each temp */
+    int movi_param[TCG_MAX_TEMPS];
+    const uint16_t *opc_ptr;
+    const TCGArg *args;
+    int i, nb_relocs = 0;
+
+    for (i = 0; i < s->nb_temps; i++) {
+        movi_param[i] = -1;
+    }
+
+    args = s->gen_opparam_buf;
+    for (opc_ptr = s->gen_opc_buf; opc_ptr < s->gen_opc_ptr; opc_ptr++) {
+        TCGOpcode c = *opc_ptr;
+        const TCGOpDef *def = &tcg_op_defs[c];
+        int nb_oargs, nb_iargs, nb_cargs;
+
+        if (c == INDEX_op_call) {
+            TCGArg func;
+
+            nb_oargs = *args >> 16;
+            nb_iargs = *args & 0xffff;
+            nb_cargs = def->nb_cargs;
+            args++;
+
+            /* the function is the last input, loaded by a movi */
+            func = args[nb_oargs + nb_iargs - 1];
+            if (movi_param[func] < 0) {
+                return -1;
+            }
+            if (nb_relocs == 0 ||
+                relocs[nb_relocs - 1] >> 2 != movi_param[func]) {
+                relocs[nb_relocs++] = (movi_param[func] << 2) |
+                                      TB_CACHE_RELOC_HELPER;
+            }
+        } else if (c == INDEX_op_nopn) {
+            nb_oargs = 0;
+            nb_iargs = 0;
+            nb_cargs = *args;
+        } else {
+            nb_oargs = def->nb_oargs;
+            nb_iargs = def->nb_iargs;
+            nb_cargs = def->nb_cargs;
+        }
+
+        if (c == INDEX_op_exit_tb && args[0] != 0) {
+            if ((args[0] & ~(TCGArg)3) != (uintptr_t)tb) {
+                return -1;
+            }
+            relocs[nb_relocs++] = ((args - s->gen_opparam_buf) << 2) |
+                                  TB_CACHE_RELOC_TB;
+        }
+
+        for (i = 0; i < nb_oargs; i++) {
+            movi_param[args[i]] = -1;
+        }
+        if (c == INDEX_op_movi_i32 || c == INDEX_op_movi_i64) {
+            movi_param[args[0]] = args + 1 - s->gen_opparam_buf;
+        }
+        args += nb_oargs + nb_iargs + nb_cargs;
+    }
+    return nb_relocs;
+}
+
+/* Optimize the ops of TB, just generated by the front end, and record
+   them.  Called with tb_lock held.  */
+void tb_cache_add(CPUArchState *env, TranslationBlock *tb)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheEntry *e, *old;
+    uint32_t *relocs;
+    uint32_t nb_ops, nb_params, nb_temps;
+    uint8_t *temps;
+    uint64_t *params;
+    size_t len;
+    int nb_relocs;
+    uint32_t i;
+
+    if (!tb_cache_usable(env) || s->host_ptr_consts ||
+        tb_cache->size >= TB_CACHE_MAX_SIZE) {
+        return;
+    }
+
+    tcg_optimize_ops(s);
+
+    nb_ops = s->gen_opc_ptr - s->gen_opc_buf;
+    nb_params = s->gen_opparam_ptr - s->gen_opparam_buf;
+    nb_temps = s->nb_temps - s->nb_globals;
+
+    /* at most one relocation per param */
+    relocs = g_new(uint32_t, nb_params);
+    nb_relocs = tb_cache_find_relocs(s, tb, relocs);
+    if (nb_relocs < 0) {
+        g_free(relocs);
+        return;
+    }
+
+    len = tb_cache_entry_len(nb_params, nb_relocs, nb_ops, nb_temps);
+    e = g_malloc0(len);
+    e->pc = tb->pc;
+    e->cs_base = tb->cs_base;
+    e->flags = tb->flags;
+    e->cflags = tb->cflags;
+    e->size = tb->size;
+    e->icount = tb->icount;
+    e->code_hash = tb_cache_code_hash(tb->pc, tb->size);
+    e->nb_ops = nb_ops;
+    e->nb_params = nb_params;
+    e->nb_temps = nb_temps;
+    e->nb_labels = s->nb_labels;
+    e->nb_relocs = nb_relocs;
+    e->len = len;
+
+    params = tb_cache_entry_params(e);
+    for (i = 0; i < nb_params; i++) {
+        params[i] = s->gen_opparam_buf[i];
+    }
+    memcpy(tb_cache_entry_relocs(e), relocs, nb_relocs * sizeof(uint32_t));
+    for (i = 0; i < nb_relocs; i++) {
+        uint64_t *param = &params[relocs[i] >> 2];
+
+        if ((relocs[i] & 3) == TB_CACHE_RELOC_HELPER) {
+            gpointer idx = g_hash_table_lookup(tb_cache->helper_index,
+                                               (gpointer)(uintptr_t)*param);
+            if (!idx) {
+                /* not a registered helper */
+                g_free(relocs);
+                g_free(e);
+                return;
+            }
+            *param = GPOINTER_TO_UINT(idx) - 1;
+        } else {
+            *param = (uintptr_t)*param - (uintptr_t)tb;
+        }
+    }
+    g_free(relocs);
+
+    memcpy(tb_cache_entry_ops(e), s->gen_opc_buf, nb_ops * sizeof(uint16_t));
+    temps = tb_cache_entry_temps(e);
+    for (i = 0; i < nb_temps; i++) {
+        TCGTemp *ts = &s->temps[s->nb_globals + i];
+
+        temps[i] = ts->type | (ts->base_type << 2) | (ts->temp_local << 4);
+    }
+
+    old = g_hash_table_lookup(tb_cache->entries, e);
+    g_hash_table_replace(tb_cache->entries, e, e);
+    if (old) {
+        tb_cache->size -= old->len;
+        /* entries read from the file are not freed when replaced */
+        if ((gchar *)old < tb_cache->file_data ||
+            (gchar *)old >= tb_cache->file_data + tb_cache->file_size) {
+            g_free(old);
+        }
+    }
+    tb_cache->size += len;
+    tb_cache->dirty = true;
+}
+
+static inline bool tb_cache_cond_valid(uint64_t cond)
+{
+    /* see TCGCond */
+    return cond < 16 && (cond & 6) != 6;
+}
+
+/* Ops that only exist in the op stream, and that the back end handles.  */
+static inline bool tb_cache_op_internal(TCGOpcode c)
+{
+    switch (c) {
+    case INDEX_op_nop:
+    case INDEX_op_nop1:
+    case INDEX_op_nop2:
+    case INDEX_op_nop3:
+    case INDEX_op_nopn:
+    case INDEX_op_discard:
+    case INDEX_op_set_label:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Check that the ops of E, read from the file, only refer to params,
+   temps, labels and helpers of the running build, so that replaying them
+   cannot overflow the buffers of the TCG context or call arbitrary code.  */
+static bool tb_cache_entry_valid(TBCache *tbc, TBCacheEntry *e)
+{
+    TCGContext *s = &tcg_ctx;
+    const uint64_t *params = tb_cache_entry_params(e);
+    const uint32_t *relocs = tb_cache_entry_relocs(e);
+    const uint16_t *ops = tb_cache_entry_ops(e);
+    const uint8_t *temps = tb_cache_entry_temps(e);
+    uint32_t nb_temps = s->nb_globals + e->nb_temps;
+    /* whether each temp was last loaded with the address of a helper */
+    bool movi_helper[TCG_MAX_TEMPS];
+    bool label_set[TCG_MAX_LABELS], label_used[TCG_MAX_LABELS];
+    uint8_t *reloc_type;
+    uint32_t i, j, p;
+    bool ok = false;
+
+    for (i = 0; i < e->nb_temps; i++) {
+        if ((temps[i] & 3) >= TCG_TYPE_COUNT ||
+            ((temps[i] >> 2) & 3) >= TCG_TYPE_COUNT || temps[i] >> 5) {
+            return false;
+        }
+    }
+
+    reloc_type = g_malloc0(e->nb_params);
+    for (i = 0; i < e->nb_relocs; i++) {
+        uint32_t idx = relocs[i] >> 2;
+        uint32_t type = relocs[i] & 3;
+
+        if (idx >= e->nb_params || reloc_type[idx] ||
+            (type != TB_CACHE_RELOC_HELPER && type != TB_CACHE_RELOC_TB)) {
+            goto out;
+        }
+        reloc_type[idx] = type;
+    }
+
+    memset(movi_helper, 0, sizeof(movi_helper));
+    memset(label_set, 0, sizeof(label_set));
+    memset(label_used, 0, sizeof(label_used));
+
+    p = 0;
+    for (i = 0; i < e->nb_ops; i++) {
+        TCGOpcode c = ops[i];
+        const TCGOpDef *def;
+        const uint64_t *args, *cargs;
+        uint32_t nb_oargs, nb_iargs, nb_cargs, nb_args;
+
+        if (c >= NB_OPS || c == INDEX_op_end) {
+            goto out;
+        }
+        def = &tcg_op_defs[c];
+        if ((def->flags & TCG_OPF_NOT_PRESENT) && !tb_cache_op_internal(c)) {
+            goto out;
+        }
+        if (def->nb_oargs + def->nb_iargs + def->nb_cargs > 0 &&
+            p >= e->nb_params) {
+            goto out;
+        }
+
+        args = &params[p];
+        if (c == INDEX_op_call) {
+            if (args[0] > 0xffffffff) {
+                goto out;
+            }
+            nb_oargs = args[0] >> 16;
+            nb_iargs = args[0] & 0xffff;
+            nb_cargs = def->nb_cargs;
+            /* the liveness analysis tracks up to 16 args per op */
+            if (nb_oargs > 2 || nb_iargs == 0 || nb_oargs + nb_iargs > 16) {
+                goto out;
+            }
+            nb_args = 1 + nb_oargs + nb_iargs + nb_cargs;
+        } else if (c == INDEX_op_nopn) {
+            nb_oargs = 0;
+            nb_iargs = 0;
+            nb_cargs = args[0];
+            nb_args = args[0];
+            if (args[0] == 0 || args[0] > e->nb_params) {
+                goto out;
+            }
+        } else {
+            nb_oargs = def->nb_oargs;
+            nb_iargs = def->nb_iargs;
+            nb_cargs = def->nb_cargs;
+            nb_args = nb_oargs + nb_iargs + nb_cargs;
+        }
+        if (nb_args > e->nb_params - p) {
+            goto out;
+        }
+
+        /* relocated params must be the constant of a movi (helpers) or
+           the argument of exit_tb (the TB) */
+        for (j = 0; j < nb_args; j++) {
+            switch (reloc_type[p + j]) {
+            case 0:
+                break;
+            case TB_CACHE_RELOC_HELPER:
+                if ((c != INDEX_op_movi_i32 && c != INDEX_op_movi_i64) ||
+                    j != 1 || params[p + j] >= tbc->nb_helpers) {
+                    goto out;
+                }
+                break;
+            default:
+                if (c != INDEX_op_exit_tb || params[p + j] > 3) {
+                    goto out;
+                }
+                break;
+            }
+        }
+
+        if (c == INDEX_op_call) {
+            args++;
+        }
+        for (j = 0; j < nb_oargs; j++) {
+            if (args[j] >= nb_temps ||
+                (args[j] < s->nb_globals && s->temps[args[j]].fixed_reg)) {
+                goto out;
+            }
+        }
+        for (j = nb_oargs; j < nb_oargs + nb_iargs; j++) {
+            /* 64-bit call args may be padded on 32-bit hosts */
+            if (args[j] >= nb_temps &&
+                (c != INDEX_op_call || j == nb_oargs + nb_iargs - 1 ||
+                 args[j] != (TCGArg)TCG_CALL_DUMMY_ARG)) {
+                goto out;
+            }
+        }
+        cargs = &args[nb_oargs + nb_iargs];
+
+        switch (c) {
+        case INDEX_op_call:
+            /* only call helpers, and get the parameter count right, since
+               the liveness analysis uses it to walk the ops backwards */
+            if (!movi_helper[args[nb_oargs + nb_iargs - 1]] ||
+                cargs[1] != nb_args) {
+                goto out;
+            }
+            break;
+        case INDEX_op_nopn:
+            if (args[nb_args - 1] != nb_args) {
+                goto out;
+            }
+            break;
+        case INDEX_op_exit_tb:
+            if (args[0] != 0 && reloc_type[p] != TB_CACHE_RELOC_TB) {
+                goto out;
+            }
+            break;
+        case INDEX_op_goto_tb:
+            if (args[0] > 1) {
+                goto out;
+            }
+            break;
+        case INDEX_op_set_label:
+            if (args[0] >= e->nb_labels || label_set[args[0]]) {
+                goto out;
+            }
+            label_set[args[0]] = true;
+            break;
+        case INDEX_op_br:
+            if (args[0] >= e->nb_labels) {
+                goto out;
+            }
+            label_used[args[0]] = true;
+            break;
+        case INDEX_op_brcond_i32:
+        case INDEX_op_brcond_i64:
+        case INDEX_op_brcond2_i32:
+            if (!tb_cache_cond_valid(cargs[0]) || cargs[1] >= e->nb_labels) {
+                goto out;
+            }
+            label_used[cargs[1]] = true;
+            break;
+        case INDEX_op_setcond_i32:
+        case INDEX_op_setcond_i64:
+        case INDEX_op_setcond2_i32:
+        case INDEX_op_movcond_i32:
+        case INDEX_op_movcond_i64:
+            if (!tb_cache_cond_valid(cargs[0])) {
+                goto out;
+            }
+            break;
+        default:
+            break;
+        }
+
+        for (j = 0; j < nb_oargs; j++) {
+            movi_helper[args[j]] = false;
+        }
+        if (c == INDEX_op_movi_i32 || c == INDEX_op_movi_i64) {
+            movi_helper[args[0]] = reloc_type[p + 1] == TB_CACHE_RELOC_HELPER;
+        }
+        p += nb_args;
+    }
+    if (p != e->nb_params) {
+        goto out;
+    }
+    for (i = 0; i < e->nb_labels; i++) {
+        if (label_used[i] && !label_set[i]) {
+            goto out;
+        }
+    }
+    ok = true;
+
+out:
+    g_free(reloc_type);
+    return ok;
+}
+
+/* Read the file, if it belongs to the user and only they can write it.  */
+static bool tb_cache_read_file(const char *path, gchar **data, gsize *size)
+{
+    struct stat st;
+    gchar *buf;
+    ssize_t len;
+    gsize done;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+        st.st_size > 2 * TB_CACHE_MAX_SIZE /* never written by us */) {
+        close(fd);
+        return false;
+    }
+
+    buf = g_malloc(st.st_size + 1);
+    for (done = 0; done < st.st_size; done += len) {
+        len = read(fd, buf + done, st.st_size - done);
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                len = 0;
+                continue;
+            }
+            g_free(buf);
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    *data = buf;
+    *size = done;
+    return true;
+}
+
+static void tb_cache_load(TBCache *tbc)
+{
+    TBCacheHeader *hdr;
+    gsize file_size, offset;
+    uint32_t i;
+
+    if (!tb_cache_read_file(tbc->path, &tbc->file_data, &file_size)) {
+        return;
+    }
+    tbc->file_size = file_size;
+    hdr = (TBCacheHeader *)tbc->file_data;
+    if (file_size < sizeof(*hdr) || memcmp(hdr->magic, TB_CACHE_MAGIC, 8) ||
+        hdr->version != TB_CACHE_VERSION || hdr->qemu_id != tbc->qemu_id ||
+        hdr->nb_helpers != tbc->nb_helpers ||
+        hdr->helpers_id != tbc->helpers_id) {
+        goto fail;
+    }
+
+    offset = sizeof(*hdr);
+    for (i = 0; i < hdr->nb_entries; i++) {
+        TBCacheEntry *e = (TBCacheEntry *)(tbc->file_data + offset);
+
+        if (file_size - offset < sizeof(*e) || e->len > file_size - offset ||
+            e->nb_ops >= OPC_BUF_SIZE || e->nb_params > OPPARAM_BUF_SIZE ||
+            e->nb_relocs > e->nb_params || e->nb_labels > TCG_MAX_LABELS ||
+            e->nb_temps > TCG_MAX_TEMPS - tcg_ctx.nb_globals ||
+            e->len != tb_cache_entry_len(e->nb_params, e->nb_relocs,
+                                         e->nb_ops, e->nb_temps) ||
+            !tb_cache_entry_valid(tbc, e)) {
+            goto fail;
+        }
+        g_hash_table_replace(tbc->entries, e, e);
+        offset += e->len;
+    }
+    tbc->size = file_size;
+#ifdef DEBUG_TB_CACHE
+    fprintf(stderr, "tbcache: %u entries loaded from %s\n",
+            hdr->nb_entries, tbc->path);
+#endif
+    return;
+
+fail:
+    /* the file is rewritten at exit */
+    g_hash_table_remove_all(tbc->entries);
+    g_free(tbc->file_data);
+    tbc->file_data = NULL;
+    tbc->file_size = 0;
+}
+
+void tb_cache_save(void)
+{
+    TBCache *tbc = tb_cache;
+    TBCacheHeader hdr;
+    GHashTableIter iter;
+    gpointer value;
+    char *tmp_path;
+    FILE *f;
+    bool ok;
+
+    if (!tbc) {
+        return;
+    }
+
+    tb_lock();
+    if (!tbc->dirty) {
+        tb_unlock();
+        return;
+    }
+
+    /* another process may be saving the same file */
+    tmp_path = g_strdup_printf("%s.%d", tbc->path, (int)getpid());
+    f = fopen(tmp_path, "wb");
+    if (!f) {
+        goto out;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, 8);
+    hdr.version = TB_CACHE_VERSION;
+    hdr.nb_entries = g_hash_table_size(tbc->entries);
+    hdr.qemu_id = tbc->qemu_id;
+    hdr.nb_helpers = tbc->nb_helpers;
+    hdr.helpers_id = tbc->helpers_id;
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+    g_hash_table_iter_init(&iter, tbc->entries);
+    while (ok && g_hash_table_iter_next(&iter, NULL, &value)) {
+        TBCacheEntry *e = value;
+
+        ok = fwrite(e, e->len, 1, f) == 1;
+    }
+
+    if (fclose(f) != 0 || !ok || rename(tmp_path, tbc->path) < 0) {
+        unlink(tmp_path);
+    } else {
+        tbc->dirty = false;
+    }
+out:
+    g_free(tmp_path);
+    tb_unlock();
+}
+
+static int tb_cache_helper_cmp(const void *p1, const void *p2)
+{
+    const TCGHelperInfo *th1 = p1;
+    const TCGHelperInfo *th2 = p2;
+    int ret = strcmp(th1->name, th2->name);
+
+    if (ret) {
+        return ret;
+    }
+    return th1->func < th2->func ? -1 : th1->func > th2->func;
+}
+
+/* Build the table of the helpers that saved ops may call.  Its identity,
+   names and offsets in the binary, is checked when a file is loaded.  */
+static void tb_cache_init_helpers(TBCache *tbc)
+{
+    TCGContext *s = &tcg_ctx;
+    uint64_t h = TB_CACHE_HASH_INIT;
+    uint32_t i;
+
+    tbc->nb_helpers = s->nb_helpers;
+    tbc->helpers = g_new(TCGHelperInfo, s->nb_helpers);
+    memcpy(tbc->helpers, s->helpers, s->nb_helpers * sizeof(TCGHelperInfo));
+    qsort(tbc->helpers, tbc->nb_helpers, sizeof(TCGHelperInfo),
+          tb_cache_helper_cmp);
+
+    tbc->helper_index = g_hash_table_new(NULL, NULL);
+    for (i = 0; i < tbc->nb_helpers; i++) {
+        uint64_t offset = tbc->helpers[i].func - tb_cache_text_base();
+
+        h = tb_cache_hash(h, tbc->helpers[i].name,
+                          strlen(tbc->helpers[i].name) + 1);
+        h = tb_cache_hash(h, &offset, sizeof(offset));
+        g_hash_table_insert(tbc->helper_index,
+                            (gpointer)tbc->helpers[i].func,
+                            GUINT_TO_POINTER(i + 1));
+    }
+    tbc->helpers_id = h;
+}
+
+void tb_cache_init(const char *dir, const char *exec_path,
+                   const char *cpu_model)
+{
+    TBCache *tbc;
+    struct stat st;
+    char *real_path;
+    uint64_t h;
+    int nb_globals = tcg_ctx.nb_globals;
+    int arg_size = sizeof(TCGArg);
+
+    real_path = realpath(exec_path, NULL);
+    if (!real_path || stat(real_path, &st) < 0) {
+        free(real_path);
+        return;
+    }
+
+    tbc = g_new0(TBCache, 1);
+
+    /* one file for each guest executable and CPU model */
+    h = tb_cache_hash(TB_CACHE_HASH_INIT, real_path, strlen(real_path));
+    h = tb_cache_hash(h, &st.st_dev, sizeof(st.st_dev));
+    h = tb_cache_hash(h, &st.st_ino, sizeof(st.st_ino));
+    h = tb_cache_hash(h, &st.st_size, sizeof(st.st_size));
+    h = tb_cache_hash(h, &st.st_mtime, sizeof(st.st_mtime));
+    h = tb_cache_hash(h, TARGET_NAME, strlen(TARGET_NAME));
+    h = tb_cache_hash(h, cpu_model, strlen(cpu_model));
+    tbc->path = g_strdup_printf("%s/%016" PRIx64 ".tbc", dir, h);
+    free(real_path);
+
+    /* and only usable by this very binary */
+    if (stat("/proc/self/exe", &st) < 0) {
+        g_free(tbc->path);
+        g_free(tbc);
+        return;
+    }
+    h = tb_cache_hash(TB_CACHE_HASH_INIT, QEMU_VERSION, strlen(QEMU_VERSION));
+    h = tb_cache_hash(h, &st.st_dev, sizeof(st.st_dev));
+    h = tb_cache_hash(h, &st.st_ino, sizeof(st.st_ino));
+    h = tb_cache_hash(h, &st.st_size, sizeof(st.st_size));
+    h = tb_cache_hash(h, &st.st_mtime, sizeof(st.st_mtime));
+    h = tb_cache_hash(h, &arg_size, sizeof(arg_size));
+    h = tb_cache_hash(h, &nb_globals, sizeof(nb_globals));
+    tbc->qemu_id = h;
+
+    tb_cache_init_helpers(tbc);
+
+    tbc->entries = g_hash_table_new(tb_cache_entry_hash,
+                                    tb_cache_entry_equal);
+    tb_cache_load(tbc);
+    tb_cache = tbc;
+}
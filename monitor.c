@@ -2779,6 +2779,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = do_info_jit,
     },
+    {
+        .name       = "tb-profile",
+        .args_type  = "max:i?",
+        .params     = "[max]",
+        .help       = "show the most executed translated blocks",
+        .mhandler.cmd = hmp_info_tb_profile,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -64,6 +64,28 @@ ETEXI
 HXCOMM Deprecated by -machine
 DEF("M", HAS_ARG, QEMU_OPTION_M, "", QEMU_ARCH_ALL)
 
+DEF("accel", HAS_ARG, QEMU_OPTION_accel,
+    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "                select accelerator ('-machine accel=' for the list)\n"
+    "                thread=single|multi runs all TCG vCPUs in one host\n"
+    "                thread or each in its own (default: single)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -accel [accel=]@var{name}[,thread=single|multi]
+@findex -accel
+Select the accelerator, like @option{-machine accel=@var{name}}, and set
+accelerator specific properties:
+@table @option
+@item thread=single|multi
+Controls the number of TCG threads.  With @code{multi} each virtual CPU
+executes translated code in a host thread of its own, so that SMP guests
+can make use of several host cores.  This is only available for guests
+whose memory model the host can honour, and not together with
+@option{-icount}.  The default is @code{single}, where one host thread
+runs all virtual CPUs in turn.
+@end table
+ETEXI
+
 DEF("cpu", HAS_ARG, QEMU_OPTION_cpu,
     "-cpu cpu        select CPU ('-cpu help' for list)\n", QEMU_ARCH_ALL)
 STEXI
@@ -409,6 +431,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
@@ -450,6 +473,12 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
+@item detect-zeroes=@var{detect-zeroes}
+@var{detect-zeroes} is "off", "on" or "unmap" and enables the automatic
+conversion of plain zero writes by the OS to driver specific optimized
+zero write commands.  With "unmap", the space of the zeroed area may also
+be freed if the image format supports it; this requires @option{discard}
+to be set to "unmap".
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -2794,17 +2823,24 @@ re-inject them.
 ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [N|auto]\n" \
+    "-icount [shift=N|auto][,sleep=on|off]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
-    "                instruction\n", QEMU_ARCH_ALL)
+    "                instruction; with sleep=off, do not wait in real time\n" \
+    "                for virtual timers while the guest is idle\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [@var{N}|auto]
+@item -icount [shift=@var{N}|auto][,sleep=on|off]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
 then the virtual cpu speed will be automatically adjusted to keep virtual
 time within a few seconds of real time.
 
+When the virtual cpu is idle, QEMU normally waits in real time until the
+next virtual timer expires.  With @option{sleep=off}, virtual time is
+advanced to the next timer deadline right away instead, so that virtual
+time only depends on the instructions executed and idle guests run as fast
+as the host allows.  @option{sleep=off} cannot be used with @code{auto}.
+
 Note that while this option can give deterministic behavior, it does not
 provide cycle accurate emulation.  Modern CPUs contain superscalar out of
 order cores with complex cache hierarchies.  The number of instructions
@@ -1935,6 +1935,13 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+- "caches": the metadata caches of the image format, e.g. the L2 table and
+            refcount block caches of qcow2 (json-array, optional). Each
+            element contains:
+    - "name": cache name (json-string)
+    - "size": cache size in bytes (json-int)
+    - "hits": lookups that found the table in the cache (json-int)
+    - "misses": lookups that had to load the table (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -3151,4 +3158,87 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_tb_profile,
+    },
+
+SQMP
+tb-profile
+----------
+
+Start or stop profiling the code translated by TCG.  Starting the profiler
+resets its counts; stopping it keeps them for query-tb-profile.  Either
+retranslates all the guest code.
+
+Arguments:
+
+- "enable": true to start the profiler, false to stop it (json-bool)
+
+Example:
+
+-> { "execute": "tb-profile", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-tb-profile",
+        .args_type  = "max:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_tb_profile,
+    },
+
+SQMP
+query-tb-profile
+----------------
+
+Show the results of the translated code profiler.
+
+Arguments:
+
+- "max": maximum number of blocks and of helpers to return, 20 by default
+         (json-int, optional)
+
+Return a json-object with the following information:
+
+- "enabled": true if the profiler is running (json-bool)
+- "blocks": a json-array of the most executed blocks, by decreasing
+            execution count, each with:
+    - "pc": guest address of the block (json-int)
+    - "exec-count": number of executions (json-int)
+    - "guest-size": size of the guest code, in bytes (json-int)
+    - "host-size": size of the generated host code, in bytes (json-int)
+    - "translate-ns": time spent translating the block, in nanoseconds
+                      (json-int)
+- "helpers": a json-array of the most called helpers, by decreasing call
+             count, each with:
+    - "name": name of the helper (json-string)
+    - "call-count": number of calls (json-int)
+
+Example:
+
+-> { "execute": "query-tb-profile", "arguments": { "max": 1 } }
+<- { "return": {
+        "enabled": true,
+        "blocks": [
+            {
+                "pc": 3222281600,
+                "exec-count": 1843207,
+                "guest-size": 18,
+                "host-size": 164,
+                "translate-ns": 21040
+            }
+        ],
+        "helpers": [
+            {
+                "name": "inb",
+                "call-count": 50218
+            }
+        ]
+      }
+   }
+
 EQMP
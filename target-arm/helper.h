@@ -1,15 +1,25 @@
 #include "exec/def-helper.h"
 
+/* Classes of the TCG globals, see arm_translate_init().  The globals
+   not listed here are in class 0.  */
+#define ARM_GLOBALS_REGS    1
+#define ARM_GLOBALS_FLAGS   2
+
+#define ARM_CALL_ONLY_REGS  TCG_CALL_ONLY_CLASSES(1 << ARM_GLOBALS_REGS)
+#define ARM_CALL_ONLY_FLAGS TCG_CALL_ONLY_CLASSES(1 << ARM_GLOBALS_FLAGS)
+#define ARM_CALL_ONLY_REGS_FLAGS \
+    TCG_CALL_ONLY_CLASSES((1 << ARM_GLOBALS_REGS) | (1 << ARM_GLOBALS_FLAGS))
+
 DEF_HELPER_FLAGS_1(clz, TCG_CALL_NO_RWG_SE, i32, i32)
 DEF_HELPER_FLAGS_1(sxtb16, TCG_CALL_NO_RWG_SE, i32, i32)
 DEF_HELPER_FLAGS_1(uxtb16, TCG_CALL_NO_RWG_SE, i32, i32)
 
-DEF_HELPER_3(add_setq, i32, env, i32, i32)
-DEF_HELPER_3(add_saturate, i32, env, i32, i32)
-DEF_HELPER_3(sub_saturate, i32, env, i32, i32)
-DEF_HELPER_3(add_usaturate, i32, env, i32, i32)
-DEF_HELPER_3(sub_usaturate, i32, env, i32, i32)
-DEF_HELPER_2(double_saturate, i32, env, s32)
+DEF_HELPER_FLAGS_3(add_setq, TCG_CALL_NO_RWG, i32, env, i32, i32)
+DEF_HELPER_FLAGS_3(add_saturate, TCG_CALL_NO_RWG, i32, env, i32, i32)
+DEF_HELPER_FLAGS_3(sub_saturate, TCG_CALL_NO_RWG, i32, env, i32, i32)
+DEF_HELPER_FLAGS_3(add_usaturate, TCG_CALL_NO_RWG, i32, env, i32, i32)
+DEF_HELPER_FLAGS_3(sub_usaturate, TCG_CALL_NO_RWG, i32, env, i32, i32)
+DEF_HELPER_FLAGS_2(double_saturate, TCG_CALL_NO_RWG, i32, env, s32)
 DEF_HELPER_FLAGS_2(sdiv, TCG_CALL_NO_RWG_SE, s32, s32, s32)
 DEF_HELPER_FLAGS_2(udiv, TCG_CALL_NO_RWG_SE, i32, i32, i32)
 DEF_HELPER_FLAGS_1(rbit, TCG_CALL_NO_RWG_SE, i32, i32)
@@ -39,10 +49,10 @@ PAS_OP(uq)
 PAS_OP(uh)
 #undef PAS_OP
 
-DEF_HELPER_3(ssat, i32, env, i32, i32)
-DEF_HELPER_3(usat, i32, env, i32, i32)
-DEF_HELPER_3(ssat16, i32, env, i32, i32)
-DEF_HELPER_3(usat16, i32, env, i32, i32)
+DEF_HELPER_FLAGS_3(ssat, TCG_CALL_NO_RWG, i32, env, i32, i32)
+DEF_HELPER_FLAGS_3(usat, TCG_CALL_NO_RWG, i32, env, i32, i32)
+DEF_HELPER_FLAGS_3(ssat16, TCG_CALL_NO_RWG, i32, env, i32, i32)
+DEF_HELPER_FLAGS_3(usat16, TCG_CALL_NO_RWG, i32, env, i32, i32)
 
 DEF_HELPER_FLAGS_2(usad8, TCG_CALL_NO_RWG_SE, i32, i32, i32)
 
@@ -51,8 +61,8 @@ DEF_HELPER_FLAGS_3(sel_flags, TCG_CALL_NO_RWG_SE,
 DEF_HELPER_2(exception, void, env, i32)
 DEF_HELPER_1(wfi, void, env)
 
-DEF_HELPER_3(cpsr_write, void, env, i32, i32)
-DEF_HELPER_1(cpsr_read, i32, env)
+DEF_HELPER_FLAGS_3(cpsr_write, ARM_CALL_ONLY_REGS_FLAGS, void, env, i32, i32)
+DEF_HELPER_FLAGS_1(cpsr_read, ARM_CALL_ONLY_FLAGS | TCG_CALL_NO_WG, i32, env)
 
 DEF_HELPER_3(v7m_msr, void, env, i32, i32)
 DEF_HELPER_2(v7m_mrs, i32, env, i32)
@@ -62,14 +72,16 @@ DEF_HELPER_2(get_cp_reg, i32, env, ptr)
 DEF_HELPER_3(set_cp_reg64, void, env, ptr, i64)
 DEF_HELPER_2(get_cp_reg64, i64, env, ptr)
 
-DEF_HELPER_2(get_r13_banked, i32, env, i32)
-DEF_HELPER_3(set_r13_banked, void, env, i32, i32)
+DEF_HELPER_FLAGS_2(get_r13_banked, ARM_CALL_ONLY_REGS | TCG_CALL_NO_WG,
+                   i32, env, i32)
+DEF_HELPER_FLAGS_3(set_r13_banked, ARM_CALL_ONLY_REGS, void, env, i32, i32)
 
-DEF_HELPER_2(get_user_reg, i32, env, i32)
-DEF_HELPER_3(set_user_reg, void, env, i32, i32)
+DEF_HELPER_FLAGS_2(get_user_reg, ARM_CALL_ONLY_REGS | TCG_CALL_NO_WG,
+                   i32, env, i32)
+DEF_HELPER_FLAGS_3(set_user_reg, ARM_CALL_ONLY_REGS, void, env, i32, i32)
 
-DEF_HELPER_1(vfp_get_fpscr, i32, env)
-DEF_HELPER_2(vfp_set_fpscr, void, env, i32)
+DEF_HELPER_FLAGS_1(vfp_get_fpscr, TCG_CALL_NO_RWG, i32, env)
+DEF_HELPER_FLAGS_2(vfp_set_fpscr, TCG_CALL_NO_RWG, void, env, i32)
 
 DEF_HELPER_3(vfp_adds, f32, f32, f32, ptr)
 DEF_HELPER_3(vfp_addd, f64, f64, f64, ptr)
@@ -69,10 +69,6 @@ static TCGv_i32 cpu_CF, cpu_NF, cpu_VF, cpu_ZF;
 static TCGv_i32 cpu_exclusive_addr;
 static TCGv_i32 cpu_exclusive_val;
 static TCGv_i32 cpu_exclusive_high;
-#ifdef CONFIG_USER_ONLY
-static TCGv_i32 cpu_exclusive_test;
-static TCGv_i32 cpu_exclusive_info;
-#endif
 
 /* FIXME:  These should be removed.  */
 static TCGv_i32 cpu_F0s, cpu_F1s;
@@ -95,11 +91,16 @@ void arm_translate_init(void)
         cpu_R[i] = tcg_global_mem_new_i32(TCG_AREG0,
                                           offsetof(CPUARMState, regs[i]),
                                           regnames[i]);
+        tcg_global_set_class_i32(cpu_R[i], ARM_GLOBALS_REGS);
     }
     cpu_CF = tcg_global_mem_new_i32(TCG_AREG0, offsetof(CPUARMState, CF), "CF");
     cpu_NF = tcg_global_mem_new_i32(TCG_AREG0, offsetof(CPUARMState, NF), "NF");
     cpu_VF = tcg_global_mem_new_i32(TCG_AREG0, offsetof(CPUARMState, VF), "VF");
     cpu_ZF = tcg_global_mem_new_i32(TCG_AREG0, offsetof(CPUARMState, ZF), "ZF");
+    tcg_global_set_class_i32(cpu_CF, ARM_GLOBALS_FLAGS);
+    tcg_global_set_class_i32(cpu_NF, ARM_GLOBALS_FLAGS);
+    tcg_global_set_class_i32(cpu_VF, ARM_GLOBALS_FLAGS);
+    tcg_global_set_class_i32(cpu_ZF, ARM_GLOBALS_FLAGS);
 
     cpu_exclusive_addr = tcg_global_mem_new_i32(TCG_AREG0,
         offsetof(CPUARMState, exclusive_addr), "exclusive_addr");
@@ -107,12 +108,6 @@ void arm_translate_init(void)
         offsetof(CPUARMState, exclusive_val), "exclusive_val");
     cpu_exclusive_high = tcg_global_mem_new_i32(TCG_AREG0,
         offsetof(CPUARMState, exclusive_high), "exclusive_high");
-#ifdef CONFIG_USER_ONLY
-    cpu_exclusive_test = tcg_global_mem_new_i32(TCG_AREG0,
-        offsetof(CPUARMState, exclusive_test), "exclusive_test");
-    cpu_exclusive_info = tcg_global_mem_new_i32(TCG_AREG0,
-        offsetof(CPUARMState, exclusive_info), "exclusive_info");
-#endif
 
     a64_translate_init();
 
@@ -777,7 +772,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 {
     TCGv_i32 tmp;
 
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     if (s->thumb != (addr & 1)) {
         tmp = tcg_temp_new_i32();
         tcg_gen_movi_i32(tmp, addr & 1);
@@ -790,7 +785,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv_i32 var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -3430,7 +3425,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
         tcg_gen_exit_tb((uintptr_t)tb + n);
     } else {
         gen_set_pc_im(s, dest);
-        tcg_gen_exit_tb(0);
+        tcg_gen_lookup_and_goto_ptr(cpu_env);
     }
 }
 
@@ -4513,6 +4508,53 @@ static const uint8_t neon_2rm_sizes[] = {
    We process data in a mixture of 32-bit and 64-bit chunks.
    Mostly we use 32-bit chunks so we can use normal scalar instructions.  */
 
+/* Translate the three-registers-same-length insn OP on OPRSZ bytes with
+   the TCG vector ops, if it maps onto them.  Returns true if done.  */
+static bool gen_neon_3r_vec(int op, int u, int size, int oprsz,
+                            int rd, int rn, int rm)
+{
+    long dofs = vfp_reg_offset(1, rd);
+    long aofs = vfp_reg_offset(1, rn);
+    long bofs = vfp_reg_offset(1, rm);
+
+    switch (op) {
+    case NEON_3R_VADD_VSUB:
+        if (u) {
+            tcg_gen_vec_sub(size, oprsz, cpu_env, dofs, aofs, bofs);
+        } else {
+            tcg_gen_vec_add(size, oprsz, cpu_env, dofs, aofs, bofs);
+        }
+        return true;
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            tcg_gen_vec_and(oprsz, cpu_env, dofs, aofs, bofs);
+            return true;
+        case 2: /* VORR */
+            tcg_gen_vec_or(oprsz, cpu_env, dofs, aofs, bofs);
+            return true;
+        case 4: /* VEOR */
+            tcg_gen_vec_xor(oprsz, cpu_env, dofs, aofs, bofs);
+            return true;
+        }
+        return false;
+    case NEON_3R_VCGT:
+        if (u) {
+            return false;
+        }
+        tcg_gen_vec_cmpgt(size, oprsz, cpu_env, dofs, aofs, bofs);
+        return true;
+    case NEON_3R_VTST_VCEQ:
+        if (!u) {
+            return false;
+        }
+        tcg_gen_vec_cmpeq(size, oprsz, cpu_env, dofs, aofs, bofs);
+        return true;
+    default:
+        return false;
+    }
+}
+
 static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
 {
     int op;
@@ -4549,6 +4591,10 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
         if (q && ((rd | rn | rm) & 1)) {
             return 1;
         }
+        /* Operations that work on whole registers.  */
+        if (gen_neon_3r_vec(op, u, size, q ? 16 : 8, rd, rn, rm)) {
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -6524,9 +6570,10 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
    the architecturally mandated semantics, and avoids having to monitor
    regular stores.
 
-   In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   The store is an atomic compare-and-swap against the value that was
+   loaded, so it fails if another CPU changed the memory in between.  A
+   sequence of stores that restores the value goes unnoticed, but no
+   store can be lost.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
@@ -6565,25 +6612,15 @@ static void gen_clrex(DisasContext *s)
     tcg_gen_movi_i32(cpu_exclusive_addr, -1);
 }
 
-#ifdef CONFIG_USER_ONLY
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i32 addr, int size)
-{
-    tcg_gen_mov_i32(cpu_exclusive_test, addr);
-    tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | (rd << 4) | (rt << 8) | (rt2 << 12));
-    gen_exception_insn(s, 4, EXCP_STREX);
-}
-#else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
-    TCGv_i32 tmp;
+    TCGv_i32 tmp, old;
     int done_label;
     int fail_label;
 
-    /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
-         [addr] = {Rt};
+    /* if (env->exclusive_addr == addr
+           && cmpxchg([addr], env->exclusive_val, {Rt}) succeeds) {
          {Rd} = 0;
        } else {
          {Rd} = 1;
@@ -6591,62 +6628,45 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     fail_label = gen_new_label();
     done_label = gen_new_label();
     tcg_gen_brcond_i32(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
-    tmp = tcg_temp_new_i32();
-    switch (size) {
-    case 0:
-        gen_aa32_ld8u(tmp, addr, IS_USER(s));
-        break;
-    case 1:
-        gen_aa32_ld16u(tmp, addr, IS_USER(s));
-        break;
-    case 2:
-    case 3:
-        gen_aa32_ld32u(tmp, addr, IS_USER(s));
-        break;
-    default:
-        abort();
-    }
-    tcg_gen_brcond_i32(TCG_COND_NE, tmp, cpu_exclusive_val, fail_label);
-    tcg_temp_free_i32(tmp);
     if (size == 3) {
-        TCGv_i32 tmp2 = tcg_temp_new_i32();
-        tcg_gen_addi_i32(tmp2, addr, 4);
-        tmp = tcg_temp_new_i32();
-        gen_aa32_ld32u(tmp, tmp2, IS_USER(s));
-        tcg_temp_free_i32(tmp2);
-        tcg_gen_brcond_i32(TCG_COND_NE, tmp, cpu_exclusive_high, fail_label);
+        /* the two words are compared and stored together */
+        TCGv_i64 cmp = tcg_temp_new_i64();
+        TCGv_i64 val = tcg_temp_new_i64();
+        TCGv_i64 old64 = tcg_temp_new_i64();
+        TCGv_i32 tmp2 = load_reg(s, rt2);
+
+        tmp = load_reg(s, rt);
+#ifdef TARGET_WORDS_BIGENDIAN
+        tcg_gen_concat_i32_i64(cmp, cpu_exclusive_high, cpu_exclusive_val);
+        tcg_gen_concat_i32_i64(val, tmp2, tmp);
+#else
+        tcg_gen_concat_i32_i64(cmp, cpu_exclusive_val, cpu_exclusive_high);
+        tcg_gen_concat_i32_i64(val, tmp, tmp2);
+#endif
         tcg_temp_free_i32(tmp);
-    }
-    tmp = load_reg(s, rt);
-    switch (size) {
-    case 0:
-        gen_aa32_st8(tmp, addr, IS_USER(s));
-        break;
-    case 1:
-        gen_aa32_st16(tmp, addr, IS_USER(s));
-        break;
-    case 2:
-    case 3:
-        gen_aa32_st32(tmp, addr, IS_USER(s));
-        break;
-    default:
-        abort();
-    }
-    tcg_temp_free_i32(tmp);
-    if (size == 3) {
-        tcg_gen_addi_i32(addr, addr, 4);
-        tmp = load_reg(s, rt2);
-        gen_aa32_st32(tmp, addr, IS_USER(s));
+        tcg_temp_free_i32(tmp2);
+        tcg_gen_atomic_cmpxchg_i64(old64, cpu_env, addr, cmp, val,
+                                   IS_USER(s), 3);
+        tcg_gen_setcond_i64(TCG_COND_NE, old64, old64, cmp);
+        tcg_gen_trunc_i64_i32(cpu_R[rd], old64);
+        tcg_temp_free_i64(cmp);
+        tcg_temp_free_i64(val);
+        tcg_temp_free_i64(old64);
+    } else {
+        tmp = load_reg(s, rt);
+        old = tcg_temp_new_i32();
+        tcg_gen_atomic_cmpxchg_i32(old, cpu_env, addr, cpu_exclusive_val, tmp,
+                                   IS_USER(s), size);
+        tcg_gen_setcond_i32(TCG_COND_NE, cpu_R[rd], old, cpu_exclusive_val);
         tcg_temp_free_i32(tmp);
+        tcg_temp_free_i32(old);
     }
-    tcg_gen_movi_i32(cpu_R[rd], 0);
     tcg_gen_br(done_label);
     gen_set_label(fail_label);
     tcg_gen_movi_i32(cpu_R[rd], 1);
     gen_set_label(done_label);
     tcg_gen_movi_i32(cpu_exclusive_addr, -1);
 }
-#endif
 
 /* gen_srs:
  * @env: CPUARMState
@@ -10239,8 +10259,11 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* indirect branch: look the next TB up from the generated code */
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
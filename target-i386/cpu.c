@@ -2643,6 +2643,7 @@ static void x86_cpu_initfn(Object *obj)
         optimize_flags_init();
 #ifndef CONFIG_USER_ONLY
         cpu_set_debug_excp_handler(breakpoint_handler);
+        x86_cpu_lock_init();
 #endif
     }
 }
@@ -36,6 +36,12 @@
 
 #define TARGET_HAS_ICE 1
 
+/* guest code relies on TSO memory ordering, which multi-threaded TCG
+   only preserves on x86 hosts */
+#if defined(__i386__) || defined(__x86_64__)
+#define TARGET_SUPPORTS_MTTCG
+#endif
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE     EM_X86_64
 #else
@@ -1154,6 +1160,10 @@ static inline target_long lshift(target_long x, int n)
 /* translate.c */
 void optimize_flags_init(void);
 
+/* mem_helper.c */
+void x86_cpu_lock_init(void);
+void x86_cpu_lock_reset(void);
+
 #include "exec/cpu-all.h"
 #include "svm.h"
 
@@ -406,9 +406,12 @@ void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0)
 #if defined(DEBUG_MMU)
     printf("CR0 update: CR0=0x%08x\n", new_cr0);
 #endif
-    if ((new_cr0 & (CR0_PG_MASK | CR0_WP_MASK | CR0_PE_MASK)) !=
-        (env->cr[0] & (CR0_PG_MASK | CR0_WP_MASK | CR0_PE_MASK))) {
+    if ((new_cr0 & (CR0_PG_MASK | CR0_PE_MASK)) !=
+        (env->cr[0] & (CR0_PG_MASK | CR0_PE_MASK))) {
         tlb_flush(env, 1);
+    } else if ((new_cr0 ^ env->cr[0]) & CR0_WP_MASK) {
+        /* WP only applies to supervisor accesses */
+        tlb_flush_by_mmuidx(env, (1 << MMU_KERNEL_IDX) | (1 << MMU_KSMAP_IDX));
     }
 
 #ifdef TARGET_X86_64
@@ -449,6 +452,10 @@ void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3)
 #if defined(DEBUG_MMU)
         printf("CR3 update: CR3=" TARGET_FMT_lx "\n", new_cr3);
 #endif
+        /* Even with CR4.PGE set, the kernel MMU modes cannot be kept:
+           supervisor accesses to user pages (copy_to_user and friends)
+           fill them with non-global entries, and the TLB does not record
+           the G bit of the PTEs it was filled from.  */
         tlb_flush(env, 0);
     }
 }
@@ -459,9 +466,11 @@ void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4)
     printf("CR4 update: CR4=%08x\n", (uint32_t)env->cr[4]);
 #endif
     if ((new_cr4 ^ env->cr[4]) &
-        (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK |
-         CR4_SMEP_MASK | CR4_SMAP_MASK)) {
+        (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK)) {
         tlb_flush(env, 1);
+    } else if ((new_cr4 ^ env->cr[4]) & (CR4_SMEP_MASK | CR4_SMAP_MASK)) {
+        /* SMEP and SMAP only restrict supervisor accesses */
+        tlb_flush_by_mmuidx(env, (1 << MMU_KERNEL_IDX) | (1 << MMU_KSMAP_IDX));
     }
     /* SSE handling */
     if (!(env->features[FEAT_1_EDX] & CPUID_SSE)) {
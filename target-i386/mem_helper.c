@@ -22,10 +22,13 @@
 
 #if !defined(CONFIG_USER_ONLY)
 #include "exec/softmmu_exec.h"
+#include "sysemu/cpus.h"
+#include "qemu/thread.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
 
 /* broken thread support */
 
+#if defined(CONFIG_USER_ONLY)
 static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
 
 void helper_lock(void)
@@ -37,25 +40,50 @@ void helper_unlock(void)
 {
     spin_unlock(&global_cpu_lock);
 }
+#else
+/* With multi-threaded TCG, LOCK CMPXCHG16B instructions of different vCPUs
+   are serialized against each other.  An instruction that faults leaves
+   the lock held; cpu_exec drops it again with x86_cpu_lock_reset().  */
+static QemuMutex global_cpu_lock;
+static DEFINE_TLS(bool, have_global_cpu_lock);
+
+void x86_cpu_lock_init(void)
+{
+    qemu_mutex_init(&global_cpu_lock);
+}
 
-void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
+void helper_lock(void)
 {
-    uint64_t d;
-    int eflags;
+    if (qemu_tcg_mttcg_enabled()) {
+        qemu_mutex_lock(&global_cpu_lock);
+        tls_var(have_global_cpu_lock) = true;
+    }
+}
 
-    eflags = cpu_cc_compute_all(env, CC_OP);
-    d = cpu_ldq_data(env, a0);
-    if (d == (((uint64_t)env->regs[R_EDX] << 32) | (uint32_t)env->regs[R_EAX])) {
-        cpu_stq_data(env, a0, ((uint64_t)env->regs[R_ECX] << 32) | (uint32_t)env->regs[R_EBX]);
-        eflags |= CC_Z;
-    } else {
-        /* always do the store */
-        cpu_stq_data(env, a0, d);
-        env->regs[R_EDX] = (uint32_t)(d >> 32);
-        env->regs[R_EAX] = (uint32_t)d;
-        eflags &= ~CC_Z;
+void helper_unlock(void)
+{
+    if (tls_var(have_global_cpu_lock)) {
+        tls_var(have_global_cpu_lock) = false;
+        qemu_mutex_unlock(&global_cpu_lock);
+    }
+}
+
+void x86_cpu_lock_reset(void)
+{
+    helper_unlock();
+}
+#endif
+
+/* The compare-and-swap that ends a LOCK-prefixed read-modify-write found
+   SEEN in memory instead of the EXPECTED value the instruction had loaded:
+   execute it again.  */
+void helper_lock_retry(CPUX86State *env, target_ulong seen,
+                       target_ulong expected)
+{
+    if (seen != expected) {
+        cpu_restore_state(env, GETPC());
+        cpu_loop_exit(env);
     }
-    CC_SRC = eflags;
 }
 
 #ifdef TARGET_X86_64
@@ -23,6 +23,7 @@
 
 #if !defined(CONFIG_USER_ONLY)
 #include "exec/softmmu_exec.h"
+#include "sysemu/cpus.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
 
 /* check if Port I/O is allowed in TSS */
@@ -147,6 +148,7 @@ void helper_movl_drN_T0(CPUX86State *env, int reg, target_ulong t0)
 target_ulong helper_read_crN(CPUX86State *env, int reg)
 {
     target_ulong val;
+    bool locked;
 
     cpu_svm_check_intercept_param(env, SVM_EXIT_READ_CR0 + reg, 0);
     switch (reg) {
@@ -155,7 +157,9 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            locked = qemu_tcg_lock_iothread();
             val = cpu_get_apic_tpr(env->apic_state);
+            qemu_tcg_unlock_iothread(locked);
         } else {
             val = env->v_tpr;
         }
@@ -166,6 +170,8 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
 
 void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
 {
+    bool locked;
+
     cpu_svm_check_intercept_param(env, SVM_EXIT_WRITE_CR0 + reg, 0);
     switch (reg) {
     case 0:
@@ -179,7 +185,9 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            locked = qemu_tcg_lock_iothread();
             cpu_set_apic_tpr(env->apic_state, t0);
+            qemu_tcg_unlock_iothread(locked);
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -269,6 +277,7 @@ void helper_rdmsr(CPUX86State *env)
 void helper_wrmsr(CPUX86State *env)
 {
     uint64_t val;
+    bool locked;
 
     cpu_svm_check_intercept_param(env, SVM_EXIT_MSR, 1);
 
@@ -286,7 +295,9 @@ void helper_wrmsr(CPUX86State *env)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
+        locked = qemu_tcg_lock_iothread();
         cpu_set_apic_base(env->apic_state, val);
+        qemu_tcg_unlock_iothread(locked);
         break;
     case MSR_EFER:
         {
@@ -423,6 +434,7 @@ void helper_wrmsr(CPUX86State *env)
 void helper_rdmsr(CPUX86State *env)
 {
     uint64_t val;
+    bool locked;
 
     cpu_svm_check_intercept_param(env, SVM_EXIT_MSR, 0);
 
@@ -437,7 +449,9 @@ void helper_rdmsr(CPUX86State *env)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
+        locked = qemu_tcg_lock_iothread();
         val = cpu_get_apic_base(env->apic_state);
+        qemu_tcg_unlock_iothread(locked);
         break;
     case MSR_EFER:
         val = env->efer;
@@ -69,6 +69,7 @@ static TCGv cpu_regs[CPU_NB_REGS];
 static TCGv cpu_T[2];
 /* local register indexes (only used inside old micro ops) */
 static TCGv cpu_tmp0, cpu_tmp4;
+static TCGv cpu_lock_val;
 static TCGv_ptr cpu_ptr0, cpu_ptr1;
 static TCGv_i32 cpu_tmp2_i32, cpu_tmp3_i32;
 static TCGv_i64 cpu_tmp1_i64;
@@ -103,6 +104,10 @@ typedef struct DisasContext {
     int ss32;   /* 32 bit stack segment */
     CCOp cc_op;  /* current CC operation */
     bool cc_op_dirty;
+    bool next_in_tb; /* the next insn is translated in this TB, unless
+                        the current one ends it */
+    bool cc_dead; /* the flags set by the current insn are dead, see
+                     next_insn_kills_flags() */
     int addseg; /* non zero if either DS/ES/SS have a non zero base */
     int f_st;   /* currently unused */
     int vm86;   /* vm86 mode */
@@ -124,6 +129,7 @@ typedef struct DisasContext {
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
+static void gen_jr(DisasContext *s);
 static void gen_jmp(DisasContext *s, target_ulong eip);
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num);
 static void gen_op(DisasContext *s1, int op, int ot, int d);
@@ -668,6 +674,31 @@ static inline void gen_op_st_T0_A0(int idx)
     gen_op_st_v(idx, cpu_T[0], cpu_A0);
 }
 
+/* The read-modify-write instructions that can take a LOCK prefix load their
+   memory operand with gen_op_ld_lock_T0_A0 and store the result with
+   gen_op_st_lock_T0_A0.  With a LOCK prefix the store is a compare-and-swap
+   against the value loaded, and the instruction is restarted if another
+   CPU modified the operand in between.  Nothing but temporaries may be
+   written before the store.  */
+static inline void gen_op_ld_lock_T0_A0(DisasContext *s, int ot)
+{
+    gen_op_ld_T0_A0(ot + s->mem_index);
+    if (s->prefix & PREFIX_LOCK) {
+        tcg_gen_mov_tl(cpu_lock_val, cpu_T[0]);
+    }
+}
+
+static inline void gen_op_st_lock_T0_A0(DisasContext *s, int ot)
+{
+    if (s->prefix & PREFIX_LOCK) {
+        tcg_gen_atomic_cmpxchg_tl(cpu_tmp0, cpu_env, cpu_A0, cpu_lock_val,
+                                  cpu_T[0], (s->mem_index >> 2) - 1, ot);
+        gen_helper_lock_retry(cpu_env, cpu_tmp0, cpu_lock_val);
+    } else {
+        gen_op_st_T0_A0(ot + s->mem_index);
+    }
+}
+
 static inline void gen_op_st_T1_A0(int idx)
 {
     gen_op_st_v(idx, cpu_T[1], cpu_A0);
@@ -1473,7 +1504,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
     if (d != OR_TMP0) {
         gen_op_mov_TN_reg(ot, 0, d);
     } else {
-        gen_op_ld_T0_A0(ot + s1->mem_index);
+        gen_op_ld_lock_T0_A0(s1, ot);
     }
     switch(op) {
     case OP_ADCL:
@@ -1483,9 +1514,11 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
-        gen_op_update3_cc(cpu_tmp4);
-        set_cc_op(s1, CC_OP_ADCB + ot);
+            gen_op_st_lock_T0_A0(s1, ot);
+        if (!s1->cc_dead) {
+            gen_op_update3_cc(cpu_tmp4);
+            set_cc_op(s1, CC_OP_ADCB + ot);
+        }
         break;
     case OP_SBBL:
         gen_compute_eflags_c(s1, cpu_tmp4);
@@ -1494,28 +1527,36 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
-        gen_op_update3_cc(cpu_tmp4);
-        set_cc_op(s1, CC_OP_SBBB + ot);
+            gen_op_st_lock_T0_A0(s1, ot);
+        if (!s1->cc_dead) {
+            gen_op_update3_cc(cpu_tmp4);
+            set_cc_op(s1, CC_OP_SBBB + ot);
+        }
         break;
     case OP_ADDL:
         gen_op_addl_T0_T1();
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
-        gen_op_update2_cc();
-        set_cc_op(s1, CC_OP_ADDB + ot);
+            gen_op_st_lock_T0_A0(s1, ot);
+        if (!s1->cc_dead) {
+            gen_op_update2_cc();
+            set_cc_op(s1, CC_OP_ADDB + ot);
+        }
         break;
     case OP_SUBL:
-        tcg_gen_mov_tl(cpu_cc_srcT, cpu_T[0]);
+        if (!s1->cc_dead) {
+            tcg_gen_mov_tl(cpu_cc_srcT, cpu_T[0]);
+        }
         tcg_gen_sub_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
-        gen_op_update2_cc();
-        set_cc_op(s1, CC_OP_SUBB + ot);
+            gen_op_st_lock_T0_A0(s1, ot);
+        if (!s1->cc_dead) {
+            gen_op_update2_cc();
+            set_cc_op(s1, CC_OP_SUBB + ot);
+        }
         break;
     default:
     case OP_ANDL:
@@ -1523,33 +1564,41 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
-        gen_op_update1_cc();
-        set_cc_op(s1, CC_OP_LOGICB + ot);
+            gen_op_st_lock_T0_A0(s1, ot);
+        if (!s1->cc_dead) {
+            gen_op_update1_cc();
+            set_cc_op(s1, CC_OP_LOGICB + ot);
+        }
         break;
     case OP_ORL:
         tcg_gen_or_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
-        gen_op_update1_cc();
-        set_cc_op(s1, CC_OP_LOGICB + ot);
+            gen_op_st_lock_T0_A0(s1, ot);
+        if (!s1->cc_dead) {
+            gen_op_update1_cc();
+            set_cc_op(s1, CC_OP_LOGICB + ot);
+        }
         break;
     case OP_XORL:
         tcg_gen_xor_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
-        gen_op_update1_cc();
-        set_cc_op(s1, CC_OP_LOGICB + ot);
+            gen_op_st_lock_T0_A0(s1, ot);
+        if (!s1->cc_dead) {
+            gen_op_update1_cc();
+            set_cc_op(s1, CC_OP_LOGICB + ot);
+        }
         break;
     case OP_CMPL:
-        tcg_gen_mov_tl(cpu_cc_src, cpu_T[1]);
-        tcg_gen_mov_tl(cpu_cc_srcT, cpu_T[0]);
-        tcg_gen_sub_tl(cpu_cc_dst, cpu_T[0], cpu_T[1]);
-        set_cc_op(s1, CC_OP_SUBB + ot);
+        if (!s1->cc_dead) {
+            tcg_gen_mov_tl(cpu_cc_src, cpu_T[1]);
+            tcg_gen_mov_tl(cpu_cc_srcT, cpu_T[0]);
+            tcg_gen_sub_tl(cpu_cc_dst, cpu_T[0], cpu_T[1]);
+            set_cc_op(s1, CC_OP_SUBB + ot);
+        }
         break;
     }
 }
@@ -1560,20 +1609,22 @@ static void gen_inc(DisasContext *s1, int ot, int d, int c)
     if (d != OR_TMP0)
         gen_op_mov_TN_reg(ot, 0, d);
     else
-        gen_op_ld_T0_A0(ot + s1->mem_index);
-    gen_compute_eflags_c(s1, cpu_cc_src);
-    if (c > 0) {
-        tcg_gen_addi_tl(cpu_T[0], cpu_T[0], 1);
-        set_cc_op(s1, CC_OP_INCB + ot);
-    } else {
-        tcg_gen_addi_tl(cpu_T[0], cpu_T[0], -1);
-        set_cc_op(s1, CC_OP_DECB + ot);
+        gen_op_ld_lock_T0_A0(s1, ot);
+    /* inc and dec keep CF, which has to be computed first unless the
+       flags are dead anyway */
+    if (!s1->cc_dead) {
+        gen_compute_eflags_c(s1, cpu_tmp4);
     }
+    tcg_gen_addi_tl(cpu_T[0], cpu_T[0], c > 0 ? 1 : -1);
     if (d != OR_TMP0)
         gen_op_mov_reg_T0(ot, d);
     else
-        gen_op_st_T0_A0(ot + s1->mem_index);
-    tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
+        gen_op_st_lock_T0_A0(s1, ot);
+    if (!s1->cc_dead) {
+        set_cc_op(s1, (c > 0 ? CC_OP_INCB : CC_OP_DECB) + ot);
+        tcg_gen_mov_tl(cpu_cc_src, cpu_tmp4);
+        tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
+    }
 }
 
 static void gen_shift_flags(DisasContext *s, int ot, TCGv result, TCGv shm1,
@@ -1658,7 +1709,9 @@ static void gen_shift_rm_T1(DisasContext *s, int ot, int op1,
         gen_op_mov_reg_T0(ot, op1);
     }
 
-    gen_shift_flags(s, ot, cpu_T[0], cpu_tmp0, cpu_T[1], is_right);
+    if (!s->cc_dead) {
+        gen_shift_flags(s, ot, cpu_T[0], cpu_tmp0, cpu_T[1], is_right);
+    }
 }
 
 static void gen_shift_rm_im(DisasContext *s, int ot, int op1, int op2,
@@ -1697,7 +1750,7 @@ static void gen_shift_rm_im(DisasContext *s, int ot, int op1, int op2,
         gen_op_mov_reg_T0(ot, op1);
         
     /* update eflags if non zero shift */
-    if (op2 != 0) {
+    if (op2 != 0 && !s->cc_dead) {
         tcg_gen_mov_tl(cpu_cc_src, cpu_tmp4);
         tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
         set_cc_op(s, (is_right ? CC_OP_SARB : CC_OP_SHLB) + ot);
@@ -1765,6 +1818,12 @@ static void gen_rot_rm_T1(DisasContext *s, int ot, int op1, int is_right)
         gen_op_mov_reg_T0(ot, op1);
     }
 
+    /* Rotates only set CF and OF, so the other flags have to be computed
+       first, which is not worth it if they are all dead.  */
+    if (s->cc_dead) {
+        return;
+    }
+
     /* We'll need the flags computed into CC_SRC.  */
     gen_compute_eflags(s);
 
@@ -1860,7 +1919,7 @@ static void gen_rot_rm_im(DisasContext *s, int ot, int op1, int op2,
         gen_op_mov_reg_T0(ot, op1);
     }
 
-    if (op2 != 0) {
+    if (op2 != 0 && !s->cc_dead) {
         /* Compute the flags into CC_SRC.  */
         gen_compute_eflags(s);
 
@@ -2415,9 +2474,9 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
         gen_jmp_im(eip);
         tcg_gen_exit_tb((uintptr_t)tb + tb_num);
     } else {
-        /* jump to another page: currently not optimized */
+        /* jump to another page: look the TB up at run time */
         gen_jmp_im(eip);
-        gen_eob(s);
+        gen_jr(s);
     }
 }
 
@@ -2804,8 +2863,10 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 }
 
 /* generate a generic end of block. Trace exception is also generated
-   if needed */
-static void gen_eob(DisasContext *s)
+   if needed.  If JR, the next TB is looked up from the generated code;
+   not when interrupts were inhibited, since they have to be checked
+   before going on.  */
+static void gen_eob_worker(DisasContext *s, bool jr)
 {
     gen_update_cc_op(s);
     if (s->tb->flags & HF_INHIBIT_IRQ_MASK) {
@@ -2818,12 +2879,25 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug(cpu_env);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr && !(s->tb->flags & HF_INHIBIT_IRQ_MASK)) {
+        tcg_gen_lookup_and_goto_ptr(cpu_env);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    gen_eob_worker(s, false);
+}
+
+/* end of block after an indirect jump, EIP already updated */
+static void gen_jr(DisasContext *s)
+{
+    gen_eob_worker(s, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -4649,6 +4723,39 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt = (SSEFunc_0_eppt)sse_fn_epp;
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
+        /* integer ops that map onto the TCG vector ops */
+        case 0xd4: /* paddq */
+            tcg_gen_vec_add(3, is_xmm ? 16 : 8, cpu_env,
+                            op1_offset, op1_offset, op2_offset);
+            break;
+        case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+            tcg_gen_vec_add(b & 3, is_xmm ? 16 : 8, cpu_env,
+                            op1_offset, op1_offset, op2_offset);
+            break;
+        case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+            tcg_gen_vec_sub(b & 3, is_xmm ? 16 : 8, cpu_env,
+                            op1_offset, op1_offset, op2_offset);
+            break;
+        case 0xdb: /* pand */
+            tcg_gen_vec_and(is_xmm ? 16 : 8, cpu_env,
+                            op1_offset, op1_offset, op2_offset);
+            break;
+        case 0xeb: /* por */
+            tcg_gen_vec_or(is_xmm ? 16 : 8, cpu_env,
+                           op1_offset, op1_offset, op2_offset);
+            break;
+        case 0xef: /* pxor */
+            tcg_gen_vec_xor(is_xmm ? 16 : 8, cpu_env,
+                            op1_offset, op1_offset, op2_offset);
+            break;
+        case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeql */
+            tcg_gen_vec_cmpeq(b & 3, is_xmm ? 16 : 8, cpu_env,
+                              op1_offset, op1_offset, op2_offset);
+            break;
+        case 0x64 ... 0x66: /* pcmpgtb, pcmpgtw, pcmpgtl */
+            tcg_gen_vec_cmpgt(b & 3, is_xmm ? 16 : 8, cpu_env,
+                              op1_offset, op1_offset, op2_offset);
+            break;
         default:
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
@@ -4661,6 +4768,67 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
     }
 }
 
+/* Return true if the instruction following the current one is translated
+   in the same TB, and sets all the arithmetic flags without reading them
+   and without possibly raising an exception first.  The flags computed
+   by the current instruction are then dead and need not be computed.
+   Only the register and immediate forms of the ALU instructions other
+   than adc and sbb are recognized, which covers the usual compare
+   or test before a conditional jump.  */
+static bool next_insn_kills_flags(CPUX86State *env, DisasContext *s)
+{
+    target_ulong pc = s->pc;
+    CPUBreakpoint *bp;
+    int b, op;
+
+    if (!s->next_in_tb || s->is_jmp
+        || pc - s->tb->pc >= TARGET_PAGE_SIZE - 32
+        /* do not fetch from a page the current insn is not on */
+        || ((pc - 1) & TARGET_PAGE_MASK) != ((pc + 15) & TARGET_PAGE_MASK)) {
+        return false;
+    }
+    if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
+        QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
+            if (bp->pc == pc) {
+                return false;
+            }
+        }
+    }
+
+    b = cpu_ldub_code(env, pc++);
+    if (b == 0x66) {
+        b = cpu_ldub_code(env, pc++);
+    }
+#ifdef TARGET_X86_64
+    if (CODE64(s) && (b & 0xf0) == 0x40) {
+        b = cpu_ldub_code(env, pc++);
+    }
+#endif
+    switch (b) {
+    case 0x00 ... 0x3f:
+        op = (b >> 3) & 7;
+        if ((b & 7) > 5 || op == OP_ADCL || op == OP_SBBL) {
+            return false;
+        }
+        /* OP A, Iv or a register operand */
+        return (b & 7) >= 4 || (cpu_ldub_code(env, pc) >> 6) == 3;
+    case 0x80:
+    case 0x81:
+    case 0x83:
+        b = cpu_ldub_code(env, pc);
+        op = (b >> 3) & 7;
+        return (b >> 6) == 3 && op != OP_ADCL && op != OP_SBBL;
+    case 0x84: /* test Ev, Gv */
+    case 0x85:
+        return (cpu_ldub_code(env, pc) >> 6) == 3;
+    case 0xa8: /* test eAX, Iv */
+    case 0xa9:
+        return true;
+    default:
+        return false;
+    }
+}
+
 /* convert one instruction. s->is_jmp is set if the translation must
    be stopped. Return the next pc value */
 static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
@@ -4687,6 +4855,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
 #endif
     s->rip_offset = 0; /* for relative ip address */
     s->vex_l = 0;
+    s->cc_dead = false;
     s->vex_v = 0;
  next_byte:
     b = cpu_ldub_code(env, s->pc);
@@ -4823,10 +4992,6 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     s->aflag = aflag;
     s->dflag = dflag;
 
-    /* lock generation */
-    if (prefixes & PREFIX_LOCK)
-        gen_helper_lock();
-
     /* now check op code */
  reswitch:
     switch(b) {
@@ -4876,6 +5041,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                     opreg = rm;
                 }
                 gen_op_mov_TN_reg(ot, 1, reg);
+                s->cc_dead = next_insn_kills_flags(env, s);
                 gen_op(s, op, ot, opreg);
                 break;
             case 1: /* OP Gv, Ev */
@@ -4891,11 +5057,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 } else {
                     gen_op_mov_TN_reg(ot, 1, rm);
                 }
+                s->cc_dead = next_insn_kills_flags(env, s);
                 gen_op(s, op, ot, reg);
                 break;
             case 2: /* OP A, Iv */
                 val = insn_get(env, s, ot);
                 gen_op_movl_T1_im(val);
+                s->cc_dead = next_insn_kills_flags(env, s);
                 gen_op(s, op, ot, OR_EAX);
                 break;
             }
@@ -4944,6 +5112,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 break;
             }
             gen_op_movl_T1_im(val);
+            s->cc_dead = next_insn_kills_flags(env, s);
             gen_op(s, op, ot, opreg);
         }
         break;
@@ -4952,10 +5121,12 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         /* inc, dec, and other misc arith */
     case 0x40 ... 0x47: /* inc Gv */
         ot = dflag ? OT_LONG : OT_WORD;
+        s->cc_dead = next_insn_kills_flags(env, s);
         gen_inc(s, ot, OR_EAX + (b & 7), 1);
         break;
     case 0x48 ... 0x4f: /* dec Gv */
         ot = dflag ? OT_LONG : OT_WORD;
+        s->cc_dead = next_insn_kills_flags(env, s);
         gen_inc(s, ot, OR_EAX + (b & 7), -1);
         break;
     case 0xf6: /* GRP3 */
@@ -4973,7 +5144,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (op == 0)
                 s->rip_offset = insn_const_size(ot);
             gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
-            gen_op_ld_T0_A0(ot + s->mem_index);
+            gen_op_ld_lock_T0_A0(s, ot);
         } else {
             gen_op_mov_TN_reg(ot, 0, rm);
         }
@@ -4988,7 +5159,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         case 2: /* not */
             tcg_gen_not_tl(cpu_T[0], cpu_T[0]);
             if (mod != 3) {
-                gen_op_st_T0_A0(ot + s->mem_index);
+                gen_op_st_lock_T0_A0(s, ot);
             } else {
                 gen_op_mov_reg_T0(ot, rm);
             }
@@ -4996,7 +5167,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         case 3: /* neg */
             tcg_gen_neg_tl(cpu_T[0], cpu_T[0]);
             if (mod != 3) {
-                gen_op_st_T0_A0(ot + s->mem_index);
+                gen_op_st_lock_T0_A0(s, ot);
             } else {
                 gen_op_mov_reg_T0(ot, rm);
             }
@@ -5196,6 +5367,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 opreg = OR_TMP0;
             else
                 opreg = rm;
+            s->cc_dead = next_insn_kills_flags(env, s);
             gen_inc(s, ot, opreg, 1);
             break;
         case 1: /* dec Ev */
@@ -5203,6 +5375,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 opreg = OR_TMP0;
             else
                 opreg = rm;
+            s->cc_dead = next_insn_kills_flags(env, s);
             gen_inc(s, ot, opreg, -1);
             break;
         case 2: /* call Ev */
@@ -5213,7 +5386,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -5239,7 +5412,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -5407,9 +5580,16 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else {
             gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
             gen_op_mov_TN_reg(ot, 0, reg);
-            gen_op_ld_T1_A0(ot + s->mem_index);
-            gen_op_addl_T0_T1();
-            gen_op_st_T0_A0(ot + s->mem_index);
+            if (s->prefix & PREFIX_LOCK) {
+                tcg_gen_atomic_fetch_add_tl(cpu_T[1], cpu_env, cpu_A0,
+                                            cpu_T[0], (s->mem_index >> 2) - 1,
+                                            ot);
+                gen_op_addl_T0_T1();
+            } else {
+                gen_op_ld_T1_A0(ot + s->mem_index);
+                gen_op_addl_T0_T1();
+                gen_op_st_T0_A0(ot + s->mem_index);
+            }
             gen_op_mov_reg_T1(ot, reg);
         }
         gen_op_update2_cc();
@@ -5433,6 +5613,18 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             t2 = tcg_temp_local_new();
             a0 = tcg_temp_local_new();
             gen_op_mov_v_reg(ot, t1, reg);
+            if (mod != 3 && (s->prefix & PREFIX_LOCK)) {
+                gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
+                tcg_gen_mov_tl(t2, cpu_regs[R_EAX]);
+                gen_extu(ot, t2);
+                tcg_gen_atomic_cmpxchg_tl(t0, cpu_env, cpu_A0, t2, t1,
+                                          (s->mem_index >> 2) - 1, ot);
+                label1 = gen_new_label();
+                tcg_gen_brcond_tl(TCG_COND_EQ, t2, t0, label1);
+                gen_op_mov_reg_v(ot, R_EAX, t0);
+                gen_set_label(label1);
+                goto cmpxchg_flags;
+            }
             if (mod == 3) {
                 rm = (modrm & 7) | REX_B(s);
                 gen_op_mov_v_reg(ot, t0, rm);
@@ -5464,6 +5656,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 gen_op_st_v(ot + s->mem_index, t1, a0);
             }
             gen_set_label(label2);
+        cmpxchg_flags:
             tcg_gen_mov_tl(cpu_cc_src, t0);
             tcg_gen_mov_tl(cpu_cc_srcT, t2);
             tcg_gen_sub_tl(cpu_cc_dst, t2, t0);
@@ -5486,18 +5679,56 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_jmp_im(pc_start - s->cs_base);
             gen_update_cc_op(s);
             gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
+            /* there is no 16-byte atomic op: serialize the locked
+               instances against each other */
+            if (prefixes & PREFIX_LOCK) {
+                gen_helper_lock();
+            }
             gen_helper_cmpxchg16b(cpu_env, cpu_A0);
+            if (prefixes & PREFIX_LOCK) {
+                gen_helper_unlock();
+            }
+            set_cc_op(s, CC_OP_EFLAGS);
         } else
 #endif        
         {
+            TCGv_i64 cmpv, newv, oldv;
+            TCGv zero;
+
             if (!(s->cpuid_features & CPUID_CX8))
                 goto illegal_op;
-            gen_jmp_im(pc_start - s->cs_base);
-            gen_update_cc_op(s);
             gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
-            gen_helper_cmpxchg8b(cpu_env, cpu_A0);
+            cmpv = tcg_temp_new_i64();
+            newv = tcg_temp_new_i64();
+            oldv = tcg_temp_new_i64();
+            tcg_gen_concat_tl_i64(cmpv, cpu_regs[R_EAX], cpu_regs[R_EDX]);
+            tcg_gen_concat_tl_i64(newv, cpu_regs[R_EBX], cpu_regs[R_ECX]);
+            tcg_gen_atomic_cmpxchg_i64(oldv, cpu_env, cpu_A0, cmpv, newv,
+                                       (s->mem_index >> 2) - 1, 3);
+
+            /* ZF is set iff the comparison succeeded */
+            tcg_gen_setcond_i64(TCG_COND_EQ, cmpv, oldv, cmpv);
+            tcg_gen_trunc_i64_tl(cpu_tmp4, cmpv);
+            gen_compute_eflags(s);
+            tcg_gen_andi_tl(cpu_cc_src, cpu_cc_src, ~CC_Z);
+            tcg_gen_shli_tl(cpu_tmp0, cpu_tmp4, ctz32(CC_Z));
+            tcg_gen_or_tl(cpu_cc_src, cpu_cc_src, cpu_tmp0);
+
+            /* EDX:EAX is loaded with the memory operand only on failure */
+            zero = tcg_const_tl(0);
+            tcg_gen_trunc_i64_tl(cpu_T[0], oldv);
+            tcg_gen_ext32u_tl(cpu_T[0], cpu_T[0]);
+            tcg_gen_shri_i64(oldv, oldv, 32);
+            tcg_gen_trunc_i64_tl(cpu_T[1], oldv);
+            tcg_gen_movcond_tl(TCG_COND_EQ, cpu_regs[R_EAX], cpu_tmp4, zero,
+                               cpu_T[0], cpu_regs[R_EAX]);
+            tcg_gen_movcond_tl(TCG_COND_EQ, cpu_regs[R_EDX], cpu_tmp4, zero,
+                               cpu_T[1], cpu_regs[R_EDX]);
+            tcg_temp_free(zero);
+            tcg_temp_free_i64(cmpv);
+            tcg_temp_free_i64(newv);
+            tcg_temp_free_i64(oldv);
         }
-        set_cc_op(s, CC_OP_EFLAGS);
         break;
 
         /**************************/
@@ -5891,12 +6122,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
             gen_op_mov_TN_reg(ot, 0, reg);
             /* for xchg, lock is implicit */
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_lock();
-            gen_op_ld_T1_A0(ot + s->mem_index);
-            gen_op_st_T0_A0(ot + s->mem_index);
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_unlock();
+            tcg_gen_atomic_xchg_tl(cpu_T[1], cpu_env, cpu_A0, cpu_T[0],
+                                   (s->mem_index >> 2) - 1, ot);
             gen_op_mov_reg_T1(ot, reg);
         }
         break;
@@ -5966,11 +6193,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
 
             /* simpler op */
             if (shift == 0) {
+                s->cc_dead = next_insn_kills_flags(env, s);
                 gen_shift(s, op, ot, opreg, OR_ECX);
             } else {
                 if (shift == 2) {
                     shift = cpu_ldub_code(env, s->pc++);
                 }
+                s->cc_dead = next_insn_kills_flags(env, s);
                 gen_shifti(s, op, ot, opreg, shift);
             }
         }
@@ -6740,7 +6969,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6748,7 +6977,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
@@ -7014,7 +7243,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (mod != 3) {
             s->rip_offset = 1;
             gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
-            gen_op_ld_T0_A0(ot + s->mem_index);
+            gen_op_ld_lock_T0_A0(s, ot);
         } else {
             gen_op_mov_TN_reg(ot, 0, rm);
         }
@@ -7050,7 +7279,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_sari_tl(cpu_tmp0, cpu_T[1], 3 + ot);
             tcg_gen_shli_tl(cpu_tmp0, cpu_tmp0, ot);
             tcg_gen_add_tl(cpu_A0, cpu_A0, cpu_tmp0);
-            gen_op_ld_T0_A0(ot + s->mem_index);
+            gen_op_ld_lock_T0_A0(s, ot);
         } else {
             gen_op_mov_TN_reg(ot, 0, rm);
         }
@@ -7082,15 +7311,15 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_xor_tl(cpu_T[0], cpu_T[0], cpu_tmp0);
             break;
         }
-        set_cc_op(s, CC_OP_SARB + ot);
         if (op != 0) {
             if (mod != 3)
-                gen_op_st_T0_A0(ot + s->mem_index);
+                gen_op_st_lock_T0_A0(s, ot);
             else
                 gen_op_mov_reg_T0(ot, rm);
             tcg_gen_mov_tl(cpu_cc_src, cpu_tmp4);
             tcg_gen_movi_tl(cpu_cc_dst, 0);
         }
+        set_cc_op(s, CC_OP_SARB + ot);
         break;
     case 0x1bc: /* bsf / tzcnt */
     case 0x1bd: /* bsr / lzcnt */
@@ -8167,14 +8396,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     default:
         goto illegal_op;
     }
-    /* lock generation */
-    if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
     return s->pc;
  illegal_op:
-    if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
-    /* XXX: ensure that no lock was generated */
     gen_exception(s, EXCP06_ILLOP, pc_start - s->cs_base);
     return s->pc;
 }
@@ -8324,6 +8547,7 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     cpu_tmp2_i32 = tcg_temp_new_i32();
     cpu_tmp3_i32 = tcg_temp_new_i32();
     cpu_tmp4 = tcg_temp_new();
+    cpu_lock_val = tcg_temp_new();
     cpu_ptr0 = tcg_temp_new_ptr();
     cpu_ptr1 = tcg_temp_new_ptr();
     cpu_cc_srcT = tcg_temp_local_new();
@@ -8364,6 +8588,11 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
         if (num_insns + 1 == max_insns && (tb->cflags & CF_LAST_IO))
             gen_io_start();
 
+        /* same conditions as below, the page one excepted */
+        dc->next_in_tb = !(dc->tf || dc->singlestep_enabled ||
+                           (flags & HF_INHIBIT_IRQ_MASK) || singlestep) &&
+                         num_insns + 1 < max_insns &&
+                         tcg_ctx.gen_opc_ptr + MAX_OP_PER_INSTR < gen_opc_end;
         pc_ptr = disas_insn(env, dc, pc_ptr);
         num_insns++;
         /* stop translation if indicated */
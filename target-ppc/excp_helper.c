@@ -606,11 +606,6 @@ static inline void powerpc_excp(PowerPCCPU *cpu, int excp_model, int excp)
     if (asrr1 != -1) {
         env->spr[asrr1] = env->spr[srr1];
     }
-    /* If we disactivated any translation, flush TLBs */
-    if (msr & ((1 << MSR_IR) | (1 << MSR_DR))) {
-        tlb_flush(env, 1);
-    }
-
 #ifdef TARGET_PPC64
     if (excp_model == POWERPC_EXCP_POWER7) {
         if (env->spr[SPR_LPCR] & LPCR_ILE) {
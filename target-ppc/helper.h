@@ -1,5 +1,11 @@
 #include "exec/def-helper.h"
 
+/* Classes of the TCG globals, see ppc_translate_init().  The globals
+   not listed here are in class 0.  */
+#define PPC_GLOBALS_XER     1
+
+#define PPC_CALL_ONLY_XER   TCG_CALL_ONLY_CLASSES(1 << PPC_GLOBALS_XER)
+
 DEF_HELPER_3(raise_exception_err, void, env, i32, i32)
 DEF_HELPER_2(raise_exception, void, env, i32)
 DEF_HELPER_4(tw, void, env, tl, tl, i32)
@@ -30,18 +36,18 @@ DEF_HELPER_2(icbi, void, env, tl)
 DEF_HELPER_5(lscbx, tl, env, tl, i32, i32, i32)
 
 #if defined(TARGET_PPC64)
-DEF_HELPER_3(mulldo, i64, env, i64, i64)
+DEF_HELPER_FLAGS_3(mulldo, PPC_CALL_ONLY_XER, i64, env, i64, i64)
 #endif
 
 DEF_HELPER_FLAGS_1(cntlzw, TCG_CALL_NO_RWG_SE, tl, tl)
 DEF_HELPER_FLAGS_1(popcntb, TCG_CALL_NO_RWG_SE, tl, tl)
 DEF_HELPER_FLAGS_1(popcntw, TCG_CALL_NO_RWG_SE, tl, tl)
 DEF_HELPER_FLAGS_2(cmpb, TCG_CALL_NO_RWG_SE, tl, tl, tl)
-DEF_HELPER_3(sraw, tl, env, tl, tl)
+DEF_HELPER_FLAGS_3(sraw, PPC_CALL_ONLY_XER, tl, env, tl, tl)
 #if defined(TARGET_PPC64)
 DEF_HELPER_FLAGS_1(cntlzd, TCG_CALL_NO_RWG_SE, tl, tl)
 DEF_HELPER_FLAGS_1(popcntd, TCG_CALL_NO_RWG_SE, tl, tl)
-DEF_HELPER_3(srad, tl, env, tl, tl)
+DEF_HELPER_FLAGS_3(srad, PPC_CALL_ONLY_XER, tl, env, tl, tl)
 #endif
 
 DEF_HELPER_FLAGS_1(cntlsw32, TCG_CALL_NO_RWG_SE, i32, i32)
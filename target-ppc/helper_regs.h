@@ -49,6 +49,23 @@ static inline void hreg_compute_mem_idx(CPUPPCState *env)
     }
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* The MMU index does not tell whether translation is enabled, so the TLB
+ * of an MMU index must be flushed when it starts being used with another
+ * MSR_IR/MSR_DR setting.  Doing it lazily, for that index only, keeps the
+ * user mode mappings when taking and returning from real mode exceptions.
+ */
+static inline void hreg_check_tlb_irdr(CPUPPCState *env)
+{
+    target_ulong irdr = env->msr & ((1 << MSR_IR) | (1 << MSR_DR));
+
+    if (env->tlb_irdr[env->mmu_idx] != irdr) {
+        tlb_flush_by_mmuidx(env, 1 << env->mmu_idx);
+        env->tlb_irdr[env->mmu_idx] = irdr;
+    }
+}
+#endif
+
 static inline void hreg_compute_hflags(CPUPPCState *env)
 {
     target_ulong hflags_mask;
@@ -59,6 +76,9 @@ static inline void hreg_compute_hflags(CPUPPCState *env)
         (1 << MSR_LE);
     hflags_mask |= (1ULL << MSR_CM) | (1ULL << MSR_SF) | MSR_HVB;
     hreg_compute_mem_idx(env);
+#if !defined(CONFIG_USER_ONLY)
+    hreg_check_tlb_irdr(env);
+#endif
     env->hflags = env->msr & hflags_mask;
     /* Merge with hflags coming from other registers */
     env->hflags |= env->hflags_nmsr;
@@ -82,8 +102,7 @@ static inline int hreg_store_msr(CPUPPCState *env, target_ulong value,
     }
     if (((value >> MSR_IR) & 1) != msr_ir ||
         ((value >> MSR_DR) & 1) != msr_dr) {
-        /* Flush all tlb when changing translation mode */
-        tlb_flush(env, 1);
+        /* The TLB is flushed by hreg_compute_hflags() if needed */
         excp = POWERPC_EXCP_NONE;
         cs->interrupt_request |= CPU_INTERRUPT_EXITTB;
     }
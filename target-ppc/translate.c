@@ -164,6 +164,10 @@ void ppc_translate_init(void)
                                 offsetof(CPUPPCState, ov), "OV");
     cpu_ca = tcg_global_mem_new(TCG_AREG0,
                                 offsetof(CPUPPCState, ca), "CA");
+    tcg_global_set_class(cpu_xer, PPC_GLOBALS_XER);
+    tcg_global_set_class(cpu_so, PPC_GLOBALS_XER);
+    tcg_global_set_class(cpu_ov, PPC_GLOBALS_XER);
+    tcg_global_set_class(cpu_ca, PPC_GLOBALS_XER);
 
     cpu_reserve = tcg_global_mem_new(TCG_AREG0,
                                      offsetof(CPUPPCState, reserve_addr),
@@ -3121,23 +3125,52 @@ static void gen_lwarx(DisasContext *ctx)
     tcg_temp_free(t0);
 }
 
-#if defined(CONFIG_USER_ONLY)
-static void gen_conditional_store (DisasContext *ctx, TCGv EA,
-                                   int reg, int size)
+/* Store rS at EA if the reservation taken by lwarx/ldarx is still there and
+ * memory still holds the value it loaded.  The compare-and-swap makes this
+ * atomic with respect to the other CPUs.
+ */
+static void gen_conditional_store(DisasContext *ctx, TCGv EA,
+                                  int reg, int size)
 {
+    int l1 = gen_new_label();
     TCGv t0 = tcg_temp_new();
-    uint32_t save_exception = ctx->exception;
+    TCGv t1 = tcg_temp_new();
+    TCGv t2 = tcg_temp_new();
+    TCGv_i32 t3 = tcg_temp_new_i32();
 
-    tcg_gen_st_tl(EA, cpu_env, offsetof(CPUPPCState, reserve_ea));
-    tcg_gen_movi_tl(t0, (size << 5) | reg);
-    tcg_gen_st_tl(t0, cpu_env, offsetof(CPUPPCState, reserve_info));
+    tcg_gen_trunc_tl_i32(cpu_crf[0], cpu_so);
+    tcg_gen_brcond_tl(TCG_COND_NE, EA, cpu_reserve, l1);
+    tcg_gen_ld_tl(t0, cpu_env, offsetof(CPUPPCState, reserve_val));
+    if (size == 4) {
+        tcg_gen_ext32u_tl(t1, cpu_gpr[reg]);
+    } else {
+        tcg_gen_mov_tl(t1, cpu_gpr[reg]);
+    }
+    if (unlikely(ctx->le_mode)) {
+#if defined(TARGET_PPC64)
+        if (size == 8) {
+            tcg_gen_bswap64_tl(t0, t0);
+            tcg_gen_bswap64_tl(t1, t1);
+        } else
+#endif
+        {
+            tcg_gen_bswap32_tl(t0, t0);
+            tcg_gen_bswap32_tl(t1, t1);
+        }
+    }
+    tcg_gen_atomic_cmpxchg_tl(t2, cpu_env, EA, t0, t1, ctx->mem_idx,
+                              size == 8 ? 3 : 2);
+    tcg_gen_setcond_tl(TCG_COND_EQ, t2, t2, t0);
+    tcg_gen_trunc_tl_i32(t3, t2);
+    tcg_gen_shli_i32(t3, t3, CRF_EQ);
+    tcg_gen_or_i32(cpu_crf[0], cpu_crf[0], t3);
+    gen_set_label(l1);
+    tcg_gen_movi_tl(cpu_reserve, -1);
     tcg_temp_free(t0);
-    gen_update_nip(ctx, ctx->nip-4);
-    ctx->exception = POWERPC_EXCP_BRANCH;
-    gen_exception(ctx, POWERPC_EXCP_STCX);
-    ctx->exception = save_exception;
+    tcg_temp_free(t1);
+    tcg_temp_free(t2);
+    tcg_temp_free_i32(t3);
 }
-#endif
 
 /* stwcx. */
 static void gen_stwcx_(DisasContext *ctx)
@@ -3147,21 +3180,7 @@ static void gen_stwcx_(DisasContext *ctx)
     t0 = tcg_temp_local_new();
     gen_addr_reg_index(ctx, t0);
     gen_check_align(ctx, t0, 0x03);
-#if defined(CONFIG_USER_ONLY)
     gen_conditional_store(ctx, t0, rS(ctx->opcode), 4);
-#else
-    {
-        int l1;
-
-        tcg_gen_trunc_tl_i32(cpu_crf[0], cpu_so);
-        l1 = gen_new_label();
-        tcg_gen_brcond_tl(TCG_COND_NE, t0, cpu_reserve, l1);
-        tcg_gen_ori_i32(cpu_crf[0], cpu_crf[0], 1 << CRF_EQ);
-        gen_qemu_st32(ctx, cpu_gpr[rS(ctx->opcode)], t0);
-        gen_set_label(l1);
-        tcg_gen_movi_tl(cpu_reserve, -1);
-    }
-#endif
     tcg_temp_free(t0);
 }
 
@@ -3189,20 +3208,7 @@ static void gen_stdcx_(DisasContext *ctx)
     t0 = tcg_temp_local_new();
     gen_addr_reg_index(ctx, t0);
     gen_check_align(ctx, t0, 0x07);
-#if defined(CONFIG_USER_ONLY)
     gen_conditional_store(ctx, t0, rS(ctx->opcode), 8);
-#else
-    {
-        int l1;
-        tcg_gen_trunc_tl_i32(cpu_crf[0], cpu_so);
-        l1 = gen_new_label();
-        tcg_gen_brcond_tl(TCG_COND_NE, t0, cpu_reserve, l1);
-        tcg_gen_ori_i32(cpu_crf[0], cpu_crf[0], 1 << CRF_EQ);
-        gen_qemu_st64(ctx, cpu_gpr[rS(ctx->opcode)], t0);
-        gen_set_label(l1);
-        tcg_gen_movi_tl(cpu_reserve, -1);
-    }
-#endif
     tcg_temp_free(t0);
 }
 #endif /* defined(TARGET_PPC64) */
@@ -100,15 +100,26 @@ static const int tcg_target_call_oarg_regs[] = {
 /* For 32-bit, we are going to attempt to determine at runtime whether cmov
    is available.  However, the host compiler must supply <cpuid.h>, as we're
    not going to go so far as our own inline assembly.  */
+#ifdef CONFIG_CPUID_H
+#include <cpuid.h>
+#endif
 #if TCG_TARGET_REG_BITS == 64
 # define have_cmov 1
 #elif defined(CONFIG_CPUID_H)
-#include <cpuid.h>
 static bool have_cmov;
 #else
 # define have_cmov 0
 #endif
 
+/* Likewise for movbe, which loads or stores with a byte swap in a single
+   insn, for guests with the other byte order.  bit_MOVBE is only defined
+   by recent compilers (gcc 4.6).  */
+#if defined(CONFIG_CPUID_H) && defined(bit_MOVBE)
+static bool have_movbe;
+#else
+# define have_movbe 0
+#endif
+
 static uint8_t *tb_ret_addr;
 
 static void patch_reloc(uint8_t *code_ptr, int type,
@@ -239,6 +250,8 @@ static inline int tcg_target_const_match(tcg_target_long val,
 
 #define P_EXT		0x100		/* 0x0f opcode prefix */
 #define P_DATA16	0x200		/* 0x66 opcode prefix */
+#define P_SIMDF3	0x8000		/* 0xf3 opcode prefix */
+#define P_EXT38		0x10000		/* 0x0f 0x38 opcode prefix */
 #if TCG_TARGET_REG_BITS == 64
 # define P_ADDR32	0x400		/* 0x67 opcode prefix */
 # define P_REXW		0x800		/* Set REX.W = 1 */
@@ -261,6 +274,8 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_CALL_Jz	(0xe8)
 #define OPC_CMOVCC      (0x40 | P_EXT)  /* ... plus condition code */
 #define OPC_CMP_GvEv	(OPC_ARITH_GvEv | (ARITH_CMP << 3))
+#define OPC_CMPXCHG_EbGb (0xb0 | P_EXT)
+#define OPC_CMPXCHG_EvGv (0xb1 | P_EXT)
 #define OPC_DEC_r32	(0x48)
 #define OPC_IMUL_GvEv	(0xaf | P_EXT)
 #define OPC_IMUL_GvEvIb	(0x6b)
@@ -277,6 +292,8 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_MOVB_EvIz   (0xc6)
 #define OPC_MOVL_EvIz	(0xc7)
 #define OPC_MOVL_Iv     (0xb8)
+#define OPC_MOVBE_GyMy	(0xf0 | P_EXT38)
+#define OPC_MOVBE_MyGy	(0xf1 | P_EXT38)
 #define OPC_MOVSBL	(0xbe | P_EXT)
 #define OPC_MOVSWL	(0xbf | P_EXT)
 #define OPC_MOVSLQ	(0x63 | P_REXW)
@@ -292,9 +309,40 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_SHIFT_Ib	(0xc1)
 #define OPC_SHIFT_cl	(0xd3)
 #define OPC_TESTL	(0x85)
+#define OPC_XADD_EbGb	(0xc0 | P_EXT)
+#define OPC_XADD_EvGv	(0xc1 | P_EXT)
 #define OPC_XCHG_ax_r32	(0x90)
+#define OPC_XCHG_EbGb	(0x86)
+#define OPC_XCHG_EvGv	(0x87)
+
+/* SSE2 instructions, used by the vector ops.  */
+#define OPC_MOVDQU_VxWx	(0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx	(0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq	(0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq	(0xd6 | P_EXT | P_DATA16)
+#define OPC_PADDB	(0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW	(0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD	(0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ	(0xd4 | P_EXT | P_DATA16)
+#define OPC_PSUBB	(0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW	(0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD	(0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ	(0xfb | P_EXT | P_DATA16)
+#define OPC_PAND	(0xdb | P_EXT | P_DATA16)
+#define OPC_POR		(0xeb | P_EXT | P_DATA16)
+#define OPC_PXOR	(0xef | P_EXT | P_DATA16)
+#define OPC_PCMPEQB	(0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW	(0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD	(0x76 | P_EXT | P_DATA16)
+#define OPC_PCMPGTB	(0x64 | P_EXT | P_DATA16)
+#define OPC_PCMPGTW	(0x65 | P_EXT | P_DATA16)
+#define OPC_PCMPGTD	(0x66 | P_EXT | P_DATA16)
+#define OPC_PSHIFTW_Ib	(0x71 | P_EXT | P_DATA16) /* /2 /4 /6 */
+#define OPC_PSHIFTD_Ib	(0x72 | P_EXT | P_DATA16) /* /2 /4 /6 */
+#define OPC_PSHIFTQ_Ib	(0x73 | P_EXT | P_DATA16) /* /2 /6 */
 
 #define OPC_GRP3_Ev	(0xf7)
+#define OPC_LOCK	(0xf0)		/* emitted before the other prefixes */
 #define OPC_GRP5	(0xff)
 
 /* Group 1 opcode extensions for 0x80-0x83.
@@ -315,6 +363,11 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define SHIFT_SHR 5
 #define SHIFT_SAR 7
 
+/* Opcode extensions for the SSE2 shifts by immediate, 0x71-0x73.  */
+#define PSHIFT_SRL 2
+#define PSHIFT_SRA 4
+#define PSHIFT_SLL 6
+
 /* Group 3 opcode extensions for 0xf6, 0xf7.  To be used with OPC_GRP3.  */
 #define EXT3_NOT   2
 #define EXT3_NEG   3
@@ -374,6 +427,9 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         assert((opc & P_REXW) == 0);
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
@@ -396,8 +452,11 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         tcg_out8(s, (uint8_t)(rex | 0x40));
     }
 
-    if (opc & P_EXT) {
+    if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
+        if (opc & P_EXT38) {
+            tcg_out8(s, 0x38);
+        }
     }
     tcg_out8(s, opc);
 }
@@ -407,8 +466,14 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
-    if (opc & P_EXT) {
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
+    if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
+        if (opc & P_EXT38) {
+            tcg_out8(s, 0x38);
+        }
     }
     tcg_out8(s, opc);
 }
@@ -1105,15 +1170,18 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
 
     tgen_arithi(s, ARITH_AND + trexw, r1,
                 TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
-    tgen_arithi(s, ARITH_AND + hrexw, r0,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
 
-    tcg_out_modrm_sib_offset(s, OPC_LEA + hrexw, r0, TCG_AREG0, r0, 0,
-                             offsetof(CPUArchState, tlb_table[mem_index][0])
-                             + which);
+    /* and tlb_mask[mem_index](env), r0 */
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + hrexw, r0,
+                         TCG_AREG0,
+                         offsetof(CPUArchState, tlb_mask[mem_index]));
+
+    /* add tlb_table[mem_index](env), r0 */
+    tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_table[mem_index]));
 
-    /* cmp 0(r0), r1 */
-    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, 0);
+    /* cmp which(r0), r1 */
+    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, which);
 
     /* Prepare for both the fast path add of the tlb addend, and the slow
        path function argument setup.  There are two cases worth note:
@@ -1129,8 +1197,9 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
     s->code_ptr += 4;
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        /* cmp 4(r0), addrhi */
-        tcg_out_modrm_offset(s, OPC_CMP_GvEv, args[addrlo_idx+1], r0, 4);
+        /* cmp which+4(r0), addrhi */
+        tcg_out_modrm_offset(s, OPC_CMP_GvEv, args[addrlo_idx+1], r0,
+                             which + 4);
 
         /* jne slow_path */
         tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
@@ -1142,7 +1211,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
 
     /* add addend(r0), r1 */
     tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r1, r0,
-                         offsetof(CPUTLBEntry, addend) - which);
+                         offsetof(CPUTLBEntry, addend));
 }
 #elif defined(__x86_64__) && defined(__linux__)
 # include <asm/prctl.h>
@@ -1166,10 +1235,19 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
                                    int base, intptr_t ofs, int seg, int sizeop)
 {
 #ifdef TARGET_WORDS_BIGENDIAN
-    const int bswap = 1;
+    const int real_bswap = 1;
 #else
-    const int bswap = 0;
+    const int real_bswap = 0;
 #endif
+    int bswap = real_bswap;
+    int movop = OPC_MOVL_GvEv;
+
+    /* With movbe, the swap is part of the load.  */
+    if (have_movbe && real_bswap) {
+        bswap = 0;
+        movop = OPC_MOVBE_GyMy;
+    }
+
     switch (sizeop) {
     case 0:
         tcg_out_modrm_offset(s, OPC_MOVZBL + seg, datalo, base, ofs);
@@ -1178,15 +1256,21 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
         tcg_out_modrm_offset(s, OPC_MOVSBL + P_REXW + seg, datalo, base, ofs);
         break;
     case 1:
+        /* a 16-bit movbe does not zero-extend, the rotate is as cheap */
         tcg_out_modrm_offset(s, OPC_MOVZWL + seg, datalo, base, ofs);
-        if (bswap) {
+        if (real_bswap) {
             tcg_out_rolw_8(s, datalo);
         }
         break;
     case 1 | 4:
-        if (bswap) {
-            tcg_out_modrm_offset(s, OPC_MOVZWL + seg, datalo, base, ofs);
-            tcg_out_rolw_8(s, datalo);
+        if (real_bswap) {
+            if (have_movbe) {
+                tcg_out_modrm_offset(s, OPC_MOVBE_GyMy + P_DATA16 + seg,
+                                     datalo, base, ofs);
+            } else {
+                tcg_out_modrm_offset(s, OPC_MOVZWL + seg, datalo, base, ofs);
+                tcg_out_rolw_8(s, datalo);
+            }
             tcg_out_modrm(s, OPC_MOVSWL + P_REXW, datalo, datalo);
         } else {
             tcg_out_modrm_offset(s, OPC_MOVSWL + P_REXW + seg,
@@ -1194,16 +1278,18 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
         }
         break;
     case 2:
-        tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg, datalo, base, ofs);
+        tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
         if (bswap) {
             tcg_out_bswap32(s, datalo);
         }
         break;
 #if TCG_TARGET_REG_BITS == 64
     case 2 | 4:
-        if (bswap) {
-            tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg, datalo, base, ofs);
-            tcg_out_bswap32(s, datalo);
+        if (real_bswap) {
+            tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
+            if (bswap) {
+                tcg_out_bswap32(s, datalo);
+            }
             tcg_out_ext32s(s, datalo, datalo);
         } else {
             tcg_out_modrm_offset(s, OPC_MOVSLQ + seg, datalo, base, ofs);
@@ -1212,27 +1298,23 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
 #endif
     case 3:
         if (TCG_TARGET_REG_BITS == 64) {
-            tcg_out_modrm_offset(s, OPC_MOVL_GvEv + P_REXW + seg,
+            tcg_out_modrm_offset(s, movop + P_REXW + seg,
                                  datalo, base, ofs);
             if (bswap) {
                 tcg_out_bswap64(s, datalo);
             }
         } else {
-            if (bswap) {
+            if (real_bswap) {
                 int t = datalo;
                 datalo = datahi;
                 datahi = t;
             }
             if (base != datalo) {
-                tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg,
-                                     datalo, base, ofs);
-                tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg,
-                                     datahi, base, ofs + 4);
+                tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
+                tcg_out_modrm_offset(s, movop + seg, datahi, base, ofs + 4);
             } else {
-                tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg,
-                                     datahi, base, ofs + 4);
-                tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg,
-                                     datalo, base, ofs);
+                tcg_out_modrm_offset(s, movop + seg, datahi, base, ofs + 4);
+                tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
             }
             if (bswap) {
                 tcg_out_bswap32(s, datalo);
@@ -1317,15 +1399,23 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
                                    int sizeop)
 {
 #ifdef TARGET_WORDS_BIGENDIAN
-    const int bswap = 1;
+    const int real_bswap = 1;
 #else
-    const int bswap = 0;
+    const int real_bswap = 0;
 #endif
     /* ??? Ideally we wouldn't need a scratch register.  For user-only,
        we could perform the bswap twice to restore the original value
        instead of moving to the scratch.  But as it is, the L constraint
        means that TCG_REG_L0 is definitely free here.  */
     const int scratch = TCG_REG_L0;
+    int bswap = real_bswap;
+    int movop = OPC_MOVL_EvGv;
+
+    /* With movbe, the swap is part of the store and needs no scratch.  */
+    if (have_movbe && real_bswap) {
+        bswap = 0;
+        movop = OPC_MOVBE_MyGy;
+    }
 
     switch (sizeop) {
     case 0:
@@ -1338,8 +1428,7 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
             tcg_out_rolw_8(s, scratch);
             datalo = scratch;
         }
-        tcg_out_modrm_offset(s, OPC_MOVL_EvGv + P_DATA16 + seg,
-                             datalo, base, ofs);
+        tcg_out_modrm_offset(s, movop + P_DATA16 + seg, datalo, base, ofs);
         break;
     case 2:
         if (bswap) {
@@ -1347,7 +1436,7 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
             tcg_out_bswap32(s, scratch);
             datalo = scratch;
         }
-        tcg_out_modrm_offset(s, OPC_MOVL_EvGv + seg, datalo, base, ofs);
+        tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
         break;
     case 3:
         if (TCG_TARGET_REG_BITS == 64) {
@@ -1356,8 +1445,7 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
                 tcg_out_bswap64(s, scratch);
                 datalo = scratch;
             }
-            tcg_out_modrm_offset(s, OPC_MOVL_EvGv + P_REXW + seg,
-                                 datalo, base, ofs);
+            tcg_out_modrm_offset(s, movop + P_REXW + seg, datalo, base, ofs);
         } else if (bswap) {
             tcg_out_mov(s, TCG_TYPE_I32, scratch, datahi);
             tcg_out_bswap32(s, scratch);
@@ -1366,8 +1454,13 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
             tcg_out_bswap32(s, scratch);
             tcg_out_modrm_offset(s, OPC_MOVL_EvGv + seg, scratch, base, ofs+4);
         } else {
-            tcg_out_modrm_offset(s, OPC_MOVL_EvGv + seg, datalo, base, ofs);
-            tcg_out_modrm_offset(s, OPC_MOVL_EvGv + seg, datahi, base, ofs+4);
+            if (real_bswap) {
+                int t = datalo;
+                datalo = datahi;
+                datahi = t;
+            }
+            tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
+            tcg_out_modrm_offset(s, movop + seg, datahi, base, ofs+4);
         }
         break;
     default:
@@ -1439,6 +1532,80 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 #endif
 }
 
+#if TCG_TARGET_HAS_atomic
+/* Guest memory in host byte order at GUEST_BASE, as for the qemu_ld/st
+   of user-only emulation: a single lock-prefixed instruction does the
+   job.  A fault is handled by the signal handler like that of a store.  */
+static void tcg_out_atomic(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    int ret = args[0], base = args[1], data = args[2];
+    int size, insn, lock = 1;
+    int32_t offset = GUEST_BASE;
+
+    switch (opc) {
+    case INDEX_op_atomic_cmpxchg:
+        /* ret and the compare value are in %rax */
+        data = args[3];
+        size = args[4];
+        insn = size == 0 ? OPC_CMPXCHG_EbGb : OPC_CMPXCHG_EvGv;
+        break;
+    case INDEX_op_atomic_xchg:
+        /* xchg with memory is always locked; data is aliased to ret */
+        size = args[3];
+        insn = size == 0 ? OPC_XCHG_EbGb : OPC_XCHG_EvGv;
+        lock = 0;
+        break;
+    case INDEX_op_atomic_fetch_add:
+        size = args[3];
+        insn = size == 0 ? OPC_XADD_EbGb : OPC_XADD_EvGv;
+        break;
+    default:
+        tcg_abort();
+    }
+
+    switch (size) {
+    case 0:
+        insn |= P_REXB_R;
+        break;
+    case 1:
+        insn |= P_DATA16;
+        break;
+    case 3:
+        insn |= P_REXW;
+        break;
+    }
+
+    /* As in tcg_out_qemu_st, the address is assumed to be zero
+       extended.  */
+    if (GUEST_BASE && guest_base_flags) {
+        insn |= guest_base_flags;
+        offset = 0;
+    } else if (offset != GUEST_BASE) {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_L1, GUEST_BASE);
+        tgen_arithr(s, ARITH_ADD + P_REXW, TCG_REG_L1, base);
+        base = TCG_REG_L1;
+        offset = 0;
+    }
+
+    if (lock) {
+        tcg_out8(s, OPC_LOCK);
+    }
+    tcg_out_modrm_offset(s, insn, data, base, offset);
+
+    switch (size) {
+    case 0:
+        tcg_out_ext8u(s, ret, ret);
+        break;
+    case 1:
+        tcg_out_ext16u(s, ret, ret);
+        break;
+    case 2:
+        tcg_out_ext32u(s, ret, ret);
+        break;
+    }
+}
+#endif /* TCG_TARGET_HAS_atomic */
+
 #if defined(CONFIG_SOFTMMU)
 /*
  * Record the context of a call to the out of line helper code for the slow path
@@ -1649,6 +1816,54 @@ void tcg_out_tb_finalize(TCGContext *s)
 }
 #endif  /* CONFIG_SOFTMMU */
 
+#if TCG_TARGET_REG_BITS == 64
+static const int tcg_out_vec_insn[][4] = {
+    [INDEX_op_vec_add] = { OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ },
+    [INDEX_op_vec_sub] = { OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ },
+    [INDEX_op_vec_and] = { OPC_PAND, OPC_PAND, OPC_PAND, OPC_PAND },
+    [INDEX_op_vec_or] = { OPC_POR, OPC_POR, OPC_POR, OPC_POR },
+    [INDEX_op_vec_xor] = { OPC_PXOR, OPC_PXOR, OPC_PXOR, OPC_PXOR },
+    [INDEX_op_vec_cmpeq] = { OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD },
+    [INDEX_op_vec_cmpgt] = { OPC_PCMPGTB, OPC_PCMPGTW, OPC_PCMPGTD },
+    [INDEX_op_vec_shli] = { 0, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib, OPC_PSHIFTQ_Ib },
+    [INDEX_op_vec_shri] = { 0, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib, OPC_PSHIFTQ_Ib },
+    [INDEX_op_vec_sari] = { 0, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib },
+};
+
+/* The vector ops work on memory: load the operands in %xmm0 and %xmm1,
+   which are never allocated and are call-clobbered on all hosts, and
+   store the result from %xmm0.  */
+static void tcg_out_vec_op(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    int base = args[0], oprsz = TCG_VEC_OPRSZ(args[4]);
+    int insn = tcg_out_vec_insn[opc][TCG_VEC_VECE(args[4])];
+    int ld = oprsz == 16 ? OPC_MOVDQU_VxWx : OPC_MOVQ_VqWq;
+    int st = oprsz == 16 ? OPC_MOVDQU_WxVx : OPC_MOVQ_WqVq;
+
+    assert(insn != 0);
+    tcg_out_modrm_offset(s, ld, 0, base, args[2]);
+    switch (opc) {
+    case INDEX_op_vec_shli:
+        tcg_out_modrm(s, insn, PSHIFT_SLL, 0);
+        tcg_out8(s, args[3]);
+        break;
+    case INDEX_op_vec_shri:
+        tcg_out_modrm(s, insn, PSHIFT_SRL, 0);
+        tcg_out8(s, args[3]);
+        break;
+    case INDEX_op_vec_sari:
+        tcg_out_modrm(s, insn, PSHIFT_SRA, 0);
+        tcg_out8(s, args[3]);
+        break;
+    default:
+        tcg_out_modrm_offset(s, ld, 1, base, args[3]);
+        tcg_out_modrm(s, insn, 0, 1);
+        break;
+    }
+    tcg_out_modrm_offset(s, st, 0, base, args[1]);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1672,6 +1887,11 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* Keep the displacement naturally aligned so that it can be
+               patched atomically while other threads execute the TB.  */
+            while (((uintptr_t)s->code_ptr + 1) & 3) {
+                tcg_out8(s, OPC_XCHG_ax_r32); /* nop */
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
@@ -1682,6 +1902,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -1992,6 +2216,26 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_ext32s_i64:
         tcg_out_ext32s(s, args[0], args[1]);
         break;
+
+    case INDEX_op_vec_add:
+    case INDEX_op_vec_sub:
+    case INDEX_op_vec_and:
+    case INDEX_op_vec_or:
+    case INDEX_op_vec_xor:
+    case INDEX_op_vec_cmpeq:
+    case INDEX_op_vec_cmpgt:
+    case INDEX_op_vec_shli:
+    case INDEX_op_vec_shri:
+    case INDEX_op_vec_sari:
+        tcg_out_vec_op(s, opc, args);
+        break;
+#endif
+#if TCG_TARGET_HAS_atomic
+    case INDEX_op_atomic_cmpxchg:
+    case INDEX_op_atomic_xchg:
+    case INDEX_op_atomic_fetch_add:
+        tcg_out_atomic(s, opc, args);
+        break;
 #endif
 
     OP_32_64(deposit):
@@ -2020,6 +2264,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_br, { } },
     { INDEX_op_mov_i32, { "r", "r" } },
@@ -2130,6 +2375,22 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_muls2_i64, { "a", "d", "a", "r" } },
     { INDEX_op_add2_i64, { "r", "r", "0", "1", "re", "re" } },
     { INDEX_op_sub2_i64, { "r", "r", "0", "1", "re", "re" } },
+
+    { INDEX_op_vec_add, { "r" } },
+    { INDEX_op_vec_sub, { "r" } },
+    { INDEX_op_vec_and, { "r" } },
+    { INDEX_op_vec_or, { "r" } },
+    { INDEX_op_vec_xor, { "r" } },
+    { INDEX_op_vec_cmpeq, { "r" } },
+    { INDEX_op_vec_cmpgt, { "r" } },
+    { INDEX_op_vec_shli, { "r" } },
+    { INDEX_op_vec_shri, { "r" } },
+    { INDEX_op_vec_sari, { "r" } },
+#endif
+#if TCG_TARGET_HAS_atomic
+    { INDEX_op_atomic_cmpxchg, { "a", "L", "0", "L" } },
+    { INDEX_op_atomic_xchg, { "L", "L", "0" } },
+    { INDEX_op_atomic_fetch_add, { "L", "L", "0" } },
 #endif
 
 #if TCG_TARGET_REG_BITS == 64
@@ -2240,6 +2501,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* goto_ptr to here returns 0, as exit_tb(0) does */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -2263,10 +2528,20 @@ static void tcg_target_init(TCGContext *s)
     /* For 32-bit, 99% certainty that we're running on hardware that supports
        cmov, but we still need to check.  In case cmov is not available, we'll
        use a small forward branch.  */
-#ifndef have_cmov
+#if !defined(have_cmov) || !defined(have_movbe)
     {
         unsigned a, b, c, d;
-        have_cmov = (__get_cpuid(1, &a, &b, &c, &d) && (d & bit_CMOV));
+        int max = __get_cpuid_max(0, 0);
+
+        if (max >= 1) {
+            __cpuid(1, a, b, c, d);
+#ifndef have_cmov
+            have_cmov = (d & bit_CMOV) != 0;
+#endif
+#ifndef have_movbe
+            have_movbe = (c & bit_MOVBE) != 0;
+#endif
+        }
     }
 #endif
 
@@ -100,6 +100,7 @@ typedef enum {
 #define TCG_TARGET_HAS_muls2_i32        1
 #define TCG_TARGET_HAS_muluh_i32        0
 #define TCG_TARGET_HAS_mulsh_i32        0
+#define TCG_TARGET_HAS_goto_ptr         1
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
@@ -128,6 +129,13 @@ typedef enum {
 #define TCG_TARGET_HAS_muls2_i64        1
 #define TCG_TARGET_HAS_muluh_i64        0
 #define TCG_TARGET_HAS_mulsh_i64        0
+/* The vector ops use SSE2, which all x86_64 hosts have.  */
+#define TCG_TARGET_HAS_vec              1
+/* In user mode, guest memory is directly addressable, and the atomic ops
+   are lock-prefixed instructions when it is in host byte order.  */
+#if !defined(CONFIG_SOFTMMU) && !defined(TARGET_WORDS_BIGENDIAN)
+#define TCG_TARGET_HAS_atomic           1
+#endif
 #endif
 
 #define TCG_TARGET_deposit_i32_valid(ofs, len) \
@@ -135,6 +143,19 @@ typedef enum {
      ((ofs) == 0 && (len) == 16))
 #define TCG_TARGET_deposit_i64_valid    TCG_TARGET_deposit_i32_valid
 
+/* SSE2 has no byte shifts, no 64-bit arithmetic right shift and no 64-bit
+   compares.  */
+#define TCG_TARGET_vec_valid(opc, vece) \
+    ((vece) == 3 ? (opc) != INDEX_op_vec_sari && \
+                   (opc) != INDEX_op_vec_cmpeq && \
+                   (opc) != INDEX_op_vec_cmpgt \
+     : (vece) != 0 || ((opc) != INDEX_op_vec_shli && \
+                       (opc) != INDEX_op_vec_shri && \
+                       (opc) != INDEX_op_vec_sari))
+
+/* The softmmu TLB lookup loads the index mask from env.  */
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB   1
+
 #if TCG_TARGET_REG_BITS == 64
 # define TCG_AREG0 TCG_REG_R14
 #else
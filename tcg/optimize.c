@@ -51,10 +51,45 @@ struct tcg_temp_info {
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
+/* Memory known to hold the value of a temp in the current basic block:
+   the SIZE bytes at OFFSET from the fixed register BASE (env) were loaded
+   into TEMP with LD_OP, or stored from it.  */
+struct tcg_mem_info {
+    TCGArg base;
+    tcg_target_long offset;
+    int size;
+    TCGOpcode ld_op;
+    TCGArg temp;
+};
+
+#define TCG_MAX_MEM_INFO 16
+
+static struct tcg_mem_info mems[TCG_MAX_MEM_INFO];
+static int nb_mems;
+
+/* The last setcond of the basic block, as long as neither its output nor
+   its inputs have changed, or INDEX_op_end.  */
+static TCGOpcode last_setcond_op;
+static TCGArg last_setcond_args[4];
+
 /* Reset TEMP's state to TCG_TEMP_UNDEF.  If TEMP only had one copy, remove
    the copy flag from the left temp.  */
 static void reset_temp(TCGArg temp)
 {
+    int i;
+
+    for (i = 0; i < nb_mems; ) {
+        if (mems[i].temp == temp) {
+            mems[i] = mems[--nb_mems];
+        } else {
+            i++;
+        }
+    }
+    if (last_setcond_op != INDEX_op_end
+        && (last_setcond_args[0] == temp || last_setcond_args[1] == temp
+            || last_setcond_args[2] == temp)) {
+        last_setcond_op = INDEX_op_end;
+    }
     if (temps[temp].state == TCG_TEMP_COPY) {
         if (temps[temp].prev_copy == temps[temp].next_copy) {
             temps[temps[temp].next_copy].state = TCG_TEMP_UNDEF;
@@ -75,6 +110,8 @@ static void reset_all_temps(int nb_temps)
         temps[i].state = TCG_TEMP_UNDEF;
         temps[i].mask = -1;
     }
+    nb_mems = 0;
+    last_setcond_op = INDEX_op_end;
 }
 
 static int op_bits(TCGOpcode op)
@@ -148,6 +185,96 @@ static bool temps_are_copies(TCGArg arg1, TCGArg arg2)
     return false;
 }
 
+/* Number of bytes of memory accessed by the host load or store OP.  */
+static int ldst_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        tcg_abort();
+    }
+}
+
+/* Return the temp that holds what LD_OP would load from OFFSET(BASE),
+   or -1.  */
+static TCGArg find_mem(TCGOpcode ld_op, TCGArg base, tcg_target_long offset)
+{
+    int i;
+
+    for (i = 0; i < nb_mems; i++) {
+        if (mems[i].base == base && mems[i].offset == offset
+            && mems[i].ld_op == ld_op) {
+            return mems[i].temp;
+        }
+    }
+    return -1;
+}
+
+/* Return true if the SIZE bytes at OFFSET(BASE) are known to hold the low
+   bytes of TEMP, so that storing them again is useless.  */
+static bool mem_holds_temp(TCGArg base, tcg_target_long offset, int size,
+                           TCGArg temp)
+{
+    int i;
+
+    for (i = 0; i < nb_mems; i++) {
+        if (mems[i].base == base && mems[i].offset == offset
+            && mems[i].size == size && temps_are_copies(mems[i].temp, temp)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Forget what is known of the memory overlapping the SIZE bytes at
+   OFFSET(BASE).  */
+static void reset_mem(TCGArg base, tcg_target_long offset, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_mems; ) {
+        if (mems[i].base == base && mems[i].offset < offset + size
+            && offset < mems[i].offset + mems[i].size) {
+            mems[i] = mems[--nb_mems];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void record_mem(TCGOpcode ld_op, TCGArg base, tcg_target_long offset,
+                       TCGArg temp)
+{
+    struct tcg_mem_info *m;
+
+    if (nb_mems == TCG_MAX_MEM_INFO) {
+        /* make room by forgetting the first one */
+        mems[0] = mems[--nb_mems];
+    }
+    m = &mems[nb_mems++];
+    m->base = base;
+    m->offset = offset;
+    m->size = ldst_size(ld_op);
+    m->ld_op = ld_op;
+    m->temp = temp;
+}
+
 static void tcg_opt_gen_mov(TCGContext *s, TCGArg *gen_args,
                             TCGArg dst, TCGArg src)
 {
@@ -479,6 +606,16 @@ static TCGArg do_constant_folding_cond2(TCGArg *p1, TCGArg *p2, TCGCond c)
     return 2;
 }
 
+/* Return true if the 32-bit temps X and Y are known to hold the same
+   value.  */
+static bool temps_are_equal_i32(TCGArg x, TCGArg y)
+{
+    if (temps[x].state == TCG_TEMP_CONST && temps[y].state == TCG_TEMP_CONST) {
+        return (uint32_t)temps[x].val == (uint32_t)temps[y].val;
+    }
+    return temps_are_copies(x, y);
+}
+
 static bool swap_commutative(TCGArg dest, TCGArg *p1, TCGArg *p2)
 {
     TCGArg a1 = *p1, a2 = *p2;
@@ -611,6 +748,37 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
         }
 
+        /* Test the inputs of a setcond directly instead of comparing its
+           result with zero: "setcond t, a, b, c; brcond t, 0, ne" =>
+           "brcond a, b, c", and likewise for eq and for setcond.  */
+        switch (op) {
+        CASE_OP_32_64(brcond):
+            i = 0;
+            goto setcond_chain;
+        CASE_OP_32_64(setcond):
+            i = 1;
+        setcond_chain:
+            if (last_setcond_op == (op_bits(op) == 32 ? INDEX_op_setcond_i32
+                                                      : INDEX_op_setcond_i64)
+                && temps_are_copies(args[i], last_setcond_args[0])
+                && temps[args[i + 1]].state == TCG_TEMP_CONST
+                && temps[args[i + 1]].val == 0
+                && (args[i + 2] == TCG_COND_EQ
+                    || args[i + 2] == TCG_COND_NE)) {
+                TCGCond cond = last_setcond_args[3];
+
+                if (args[i + 2] == TCG_COND_EQ) {
+                    cond = tcg_invert_cond(cond);
+                }
+                args[i] = last_setcond_args[1];
+                args[i + 1] = last_setcond_args[2];
+                args[i + 2] = cond;
+            }
+            break;
+        default:
+            break;
+        }
+
         /* Simplify expressions for "shift/rot r, 0, a => movi r, 0",
            and "sub r, 0, a => neg r, a" case.  */
         switch (op) {
@@ -718,6 +886,11 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 break;
             }
         case INDEX_op_ext32u_i64:
+            /* the mask of a 32-bit temp says nothing of the high half of
+               its register, which these ops read */
+            if (s->temps[args[1]].type == TCG_TYPE_I32) {
+                break;
+            }
             mask = 0xffffffffU;
             goto and_const;
 
@@ -730,22 +903,43 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             mask = temps[args[1]].mask & mask;
             break;
 
-        CASE_OP_32_64(sar):
+        CASE_OP_32_64(andc):
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = ((tcg_target_long)temps[args[1]].mask
-                        >> temps[args[2]].val);
+                mask = ~temps[args[2]].val;
+                goto and_const;
             }
             break;
 
-        CASE_OP_32_64(shr):
+        case INDEX_op_sar_i32:
+            if (temps[args[2]].state == TCG_TEMP_CONST) {
+                tmp = temps[args[2]].val & 31;
+                mask = (int32_t)temps[args[1]].mask >> tmp;
+            }
+            break;
+        case INDEX_op_sar_i64:
+            if (temps[args[2]].state == TCG_TEMP_CONST) {
+                tmp = temps[args[2]].val & 63;
+                mask = (tcg_target_long)temps[args[1]].mask >> tmp;
+            }
+            break;
+
+        case INDEX_op_shr_i32:
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = temps[args[1]].mask >> temps[args[2]].val;
+                tmp = temps[args[2]].val & 31;
+                mask = (uint32_t)temps[args[1]].mask >> tmp;
+            }
+            break;
+        case INDEX_op_shr_i64:
+            if (temps[args[2]].state == TCG_TEMP_CONST) {
+                tmp = temps[args[2]].val & 63;
+                mask = (uint64_t)temps[args[1]].mask >> tmp;
             }
             break;
 
         CASE_OP_32_64(shl):
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = temps[args[1]].mask << temps[args[2]].val;
+                tmp = temps[args[2]].val & (op_bits(op) - 1);
+                mask = temps[args[1]].mask << tmp;
             }
             break;
 
@@ -766,6 +960,7 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
 
         CASE_OP_32_64(setcond):
+        case INDEX_op_setcond2_i32:
             mask = 1;
             break;
 
@@ -773,6 +968,13 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             mask = temps[args[3]].mask | temps[args[4]].mask;
             break;
 
+        case INDEX_op_qemu_ld8u:
+            mask = 0xff;
+            break;
+        case INDEX_op_qemu_ld16u:
+            mask = 0xffff;
+            break;
+
         default:
             break;
         }
@@ -841,6 +1043,30 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
         }
 
+        /* Simplify expression for "setcond r, a, 0, ne => mov r, a" when
+           a is known to be 0 or 1 */
+        switch (op) {
+        CASE_OP_32_64(setcond):
+            if (args[3] == TCG_COND_NE
+                && temps[args[1]].state != TCG_TEMP_CONST
+                && temps[args[2]].state == TCG_TEMP_CONST
+                && temps[args[2]].val == 0
+                && (temps[args[1]].mask & ~(tcg_target_ulong)1) == 0) {
+                if (temps_are_copies(args[0], args[1])) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                } else {
+                    s->gen_opc_buf[op_index] = op_to_mov(op);
+                    tcg_opt_gen_mov(s, gen_args, args[0], args[1]);
+                    gen_args += 2;
+                }
+                args += 4;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
         /* Simplify expression for "op r, a, a => movi r, 0" cases */
         switch (op) {
         CASE_OP_32_64(sub):
@@ -960,7 +1186,93 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 args += 4;
                 break;
             }
-            goto do_default;
+            reset_temp(args[0]);
+            temps[args[0]].mask = 1;
+            if (args[0] != args[1] && args[0] != args[2]) {
+                last_setcond_op = op;
+                memcpy(last_setcond_args, args, 4 * sizeof(TCGArg));
+            }
+            memcpy(gen_args, args, 4 * sizeof(TCGArg));
+            gen_args += 4;
+            args += 4;
+            break;
+
+        CASE_OP_32_64(ld8u):
+        CASE_OP_32_64(ld8s):
+        CASE_OP_32_64(ld16u):
+        CASE_OP_32_64(ld16s):
+        case INDEX_op_ld_i32:
+        case INDEX_op_ld32u_i64:
+        case INDEX_op_ld32s_i64:
+        case INDEX_op_ld_i64:
+            /* Loads from env: reuse the temp that already holds the
+               value, or remember which one does from now on */
+            if (!s->temps[args[1]].fixed_reg) {
+                goto do_default;
+            }
+            tmp = find_mem(op, args[1], args[2]);
+            if (tmp != (TCGArg)-1) {
+                if (temps_are_copies(args[0], tmp)) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                } else if (temps[tmp].state == TCG_TEMP_CONST) {
+                    s->gen_opc_buf[op_index] = op_to_movi(op);
+                    tcg_opt_gen_movi(gen_args, args[0], temps[tmp].val);
+                    gen_args += 2;
+                } else {
+                    s->gen_opc_buf[op_index] = op_to_mov(op);
+                    tcg_opt_gen_mov(s, gen_args, args[0], tmp);
+                    gen_args += 2;
+                }
+                args += 3;
+                break;
+            }
+            reset_temp(args[0]);
+            switch (op) {
+            CASE_OP_32_64(ld8u):
+                temps[args[0]].mask = 0xff;
+                break;
+            CASE_OP_32_64(ld16u):
+                temps[args[0]].mask = 0xffff;
+                break;
+            case INDEX_op_ld32u_i64:
+                temps[args[0]].mask = 0xffffffffU;
+                break;
+            default:
+                break;
+            }
+            record_mem(op, args[1], args[2], args[0]);
+            memcpy(gen_args, args, 3 * sizeof(TCGArg));
+            gen_args += 3;
+            args += 3;
+            break;
+
+        CASE_OP_32_64(st8):
+        CASE_OP_32_64(st16):
+        case INDEX_op_st_i32:
+        case INDEX_op_st32_i64:
+        case INDEX_op_st_i64:
+            /* Stores to env: drop those of the value the memory already
+               holds, and forward the others to later loads.  Stores
+               through other pointers may go anywhere.  */
+            if (!s->temps[args[1]].fixed_reg) {
+                nb_mems = 0;
+                goto do_default;
+            }
+            if (mem_holds_temp(args[1], args[2], ldst_size(op), args[0])) {
+                s->gen_opc_buf[op_index] = INDEX_op_nop;
+                args += 3;
+                break;
+            }
+            reset_mem(args[1], args[2], ldst_size(op));
+            if (op == INDEX_op_st_i32) {
+                record_mem(INDEX_op_ld_i32, args[1], args[2], args[0]);
+            } else if (op == INDEX_op_st_i64) {
+                record_mem(INDEX_op_ld_i64, args[1], args[2], args[0]);
+            }
+            memcpy(gen_args, args, 3 * sizeof(TCGArg));
+            gen_args += 3;
+            args += 3;
+            break;
 
         CASE_OP_32_64(brcond):
             tmp = do_constant_folding_cond(op, args[0], args[1], args[2]);
@@ -1080,6 +1392,25 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 gen_args[2] = args[4];
                 gen_args[3] = args[5];
                 gen_args += 4;
+            } else if (temps_are_equal_i32(args[1], args[3])) {
+                /* With equal high words, the low words decide, as
+                   unsigned numbers.  */
+                reset_all_temps(nb_temps);
+                s->gen_opc_buf[op_index] = INDEX_op_brcond_i32;
+                gen_args[0] = args[0];
+                gen_args[1] = args[2];
+                gen_args[2] = tcg_unsigned_cond(args[4]);
+                gen_args[3] = args[5];
+                gen_args += 4;
+            } else if ((args[4] == TCG_COND_EQ || args[4] == TCG_COND_NE)
+                       && temps_are_equal_i32(args[0], args[2])) {
+                reset_all_temps(nb_temps);
+                s->gen_opc_buf[op_index] = INDEX_op_brcond_i32;
+                gen_args[0] = args[1];
+                gen_args[1] = args[3];
+                gen_args[2] = args[4];
+                gen_args[3] = args[5];
+                gen_args += 4;
             } else {
                 goto do_default;
             }
@@ -1101,6 +1432,28 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                    vs the high word of the input.  */
                 s->gen_opc_buf[op_index] = INDEX_op_setcond_i32;
                 reset_temp(args[0]);
+                temps[args[0]].mask = 1;
+                gen_args[0] = args[0];
+                gen_args[1] = args[2];
+                gen_args[2] = args[4];
+                gen_args[3] = args[5];
+                gen_args += 4;
+            } else if (temps_are_equal_i32(args[2], args[4])) {
+                /* With equal high words, the low words decide, as
+                   unsigned numbers.  */
+                s->gen_opc_buf[op_index] = INDEX_op_setcond_i32;
+                reset_temp(args[0]);
+                temps[args[0]].mask = 1;
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+                gen_args[2] = args[3];
+                gen_args[3] = tcg_unsigned_cond(args[5]);
+                gen_args += 4;
+            } else if ((args[5] == TCG_COND_EQ || args[5] == TCG_COND_NE)
+                       && temps_are_equal_i32(args[1], args[3])) {
+                s->gen_opc_buf[op_index] = INDEX_op_setcond_i32;
+                reset_temp(args[0]);
+                temps[args[0]].mask = 1;
                 gen_args[0] = args[0];
                 gen_args[1] = args[2];
                 gen_args[2] = args[4];
@@ -1114,9 +1467,12 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
 
         case INDEX_op_call:
             nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
-            if (!(args[nb_call_args + 1] & (TCG_CALL_NO_READ_GLOBALS |
-                                            TCG_CALL_NO_WRITE_GLOBALS))) {
-                for (i = 0; i < nb_globals; i++) {
+            if (!(args[nb_call_args + 1] & TCG_CALL_NO_SIDE_EFFECTS)) {
+                nb_mems = 0;
+            }
+            for (i = 0; i < nb_globals; i++) {
+                if (tcg_call_writes_global(args[nb_call_args + 1],
+                                           &s->temps[i])) {
                     reset_temp(i);
                 }
             }
@@ -1145,6 +1501,16 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 for (i = 0; i < def->nb_oargs; i++) {
                     reset_temp(args[i]);
                 }
+                if (def->nb_oargs > 0) {
+                    temps[args[0]].mask = mask;
+                }
+                /* ops that may write env: the loads and stores of guest
+                   memory, which may fault, and the vector ops */
+                if ((def->flags & (TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS))
+                    || (def->nb_oargs == 0
+                        && !(def->flags & TCG_OPF_NOT_PRESENT))) {
+                    nb_mems = 0;
+                }
             }
             for (i = 0; i < def->nb_args; i++) {
                 gen_args[i] = args[i];
@@ -394,7 +394,10 @@ static inline void tcg_gen_helperN(void *func, int flags, int sizemask,
                                    TCGArg ret, int nargs, TCGArg *args)
 {
     TCGv_ptr fn;
-    fn = tcg_const_ptr(func);
+    if (unlikely(tcg_ctx.prof_helpers)) {
+        tcg_gen_count_helper(func);
+    }
+    fn = tcg_const_func_ptr(func);
     tcg_gen_callN(&tcg_ctx, fn, flags, sizemask, ret,
                   nargs, args);
     tcg_temp_free_ptr(fn);
@@ -410,7 +413,7 @@ static inline void tcg_gen_helper32(void *func, int sizemask, TCGv_i32 ret,
 {
     TCGv_ptr fn;
     TCGArg args[2];
-    fn = tcg_const_ptr(func);
+    fn = tcg_const_func_ptr(func);
     args[0] = GET_TCGV_I32(a);
     args[1] = GET_TCGV_I32(b);
     tcg_gen_callN(&tcg_ctx, fn,
@@ -424,7 +427,7 @@ static inline void tcg_gen_helper64(void *func, int sizemask, TCGv_i64 ret,
 {
     TCGv_ptr fn;
     TCGArg args[2];
-    fn = tcg_const_ptr(func);
+    fn = tcg_const_func_ptr(func);
     args[0] = GET_TCGV_I64(a);
     args[1] = GET_TCGV_I64(b);
     tcg_gen_callN(&tcg_ctx, fn,
@@ -2586,6 +2589,329 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
     }
 }
 
+/***************************************/
+/* Vector operations on OPRSZ (8 or 16) bytes of memory at BASE + DOFS,
+   AOFS and BOFS, made of elements of 1 << VECE bytes in host order.
+   The operands must either be the same or not overlap.  Hosts without
+   the vector ops, or without the given element size, get an expansion
+   into 64-bit or per-element integer ops.  */
+
+/* Returns 64 bits with bit 0 of each element set.  */
+static inline uint64_t tcg_vec_lsb_mask(unsigned vece)
+{
+    return vece == 3 ? 1 : -1ull / ((1ull << (8 << vece)) - 1);
+}
+
+static inline void tcg_gen_vec_op_internal(TCGOpcode opc, unsigned vece,
+                                           unsigned oprsz, TCGv_ptr base,
+                                           tcg_target_long dofs,
+                                           tcg_target_long aofs,
+                                           tcg_target_long bofs)
+{
+    *tcg_ctx.gen_opc_ptr++ = opc;
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_PTR(base);
+    *tcg_ctx.gen_opparam_ptr++ = dofs;
+    *tcg_ctx.gen_opparam_ptr++ = aofs;
+    *tcg_ctx.gen_opparam_ptr++ = bofs;
+    *tcg_ctx.gen_opparam_ptr++ = TCG_VEC_DESC(oprsz, vece);
+}
+
+/* Expand OPC on the 64-bit chunk A (and B), working on all the elements
+   at once.  */
+static inline void tcg_gen_vec_chunk_i64(TCGOpcode opc, unsigned vece,
+                                         TCGv_i64 d, TCGv_i64 a, TCGv_i64 b,
+                                         int64_t shift)
+{
+    TCGv_i64 t1, t2, t3;
+    uint64_t m;
+
+    switch (opc) {
+    case INDEX_op_vec_and:
+        tcg_gen_and_i64(d, a, b);
+        return;
+    case INDEX_op_vec_or:
+        tcg_gen_or_i64(d, a, b);
+        return;
+    case INDEX_op_vec_xor:
+        tcg_gen_xor_i64(d, a, b);
+        return;
+    case INDEX_op_vec_shli:
+        /* clear the bits shifted in from the lower element */
+        tcg_gen_shli_i64(d, a, shift);
+        if (vece < 3) {
+            m = tcg_vec_lsb_mask(vece) *
+                (((1ull << (8 << vece)) - 1) & ~((1ull << shift) - 1));
+            tcg_gen_andi_i64(d, d, m);
+        }
+        return;
+    case INDEX_op_vec_shri:
+        tcg_gen_shri_i64(d, a, shift);
+        if (vece < 3) {
+            m = tcg_vec_lsb_mask(vece) *
+                (((1ull << (8 << vece)) - 1) >> shift);
+            tcg_gen_andi_i64(d, d, m);
+        }
+        return;
+    default:
+        break;
+    }
+
+    if (vece == 3) {
+        if (opc == INDEX_op_vec_add) {
+            tcg_gen_add_i64(d, a, b);
+        } else {
+            tcg_gen_sub_i64(d, a, b);
+        }
+        return;
+    }
+
+    /* Add or subtract the elements without their sign bit, so that no
+       carry or borrow crosses them, and then fix up the sign bits.  */
+    m = tcg_vec_lsb_mask(vece) << ((8 << vece) - 1);
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    if (opc == INDEX_op_vec_add) {
+        tcg_gen_andi_i64(t1, a, ~m);
+        tcg_gen_andi_i64(t2, b, ~m);
+        tcg_gen_xor_i64(t3, a, b);
+        tcg_gen_add_i64(d, t1, t2);
+    } else {
+        tcg_gen_ori_i64(t1, a, m);
+        tcg_gen_andi_i64(t2, b, ~m);
+        tcg_gen_eqv_i64(t3, a, b);
+        tcg_gen_sub_i64(d, t1, t2);
+    }
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+/* Expand OPC on an element of at most 32 bits, loaded sign-extended.  */
+static inline void tcg_gen_vec_elem_i32(TCGOpcode opc, TCGv_i32 d,
+                                        TCGv_i32 a, TCGv_i32 b,
+                                        int64_t shift)
+{
+    switch (opc) {
+    case INDEX_op_vec_cmpeq:
+        tcg_gen_setcond_i32(TCG_COND_EQ, d, a, b);
+        tcg_gen_neg_i32(d, d);
+        break;
+    case INDEX_op_vec_cmpgt:
+        tcg_gen_setcond_i32(TCG_COND_GT, d, a, b);
+        tcg_gen_neg_i32(d, d);
+        break;
+    case INDEX_op_vec_sari:
+        tcg_gen_sari_i32(d, a, shift);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+static inline void tcg_gen_vec_elem_i64(TCGOpcode opc, TCGv_i64 d,
+                                        TCGv_i64 a, TCGv_i64 b,
+                                        int64_t shift)
+{
+    switch (opc) {
+    case INDEX_op_vec_cmpeq:
+        tcg_gen_setcond_i64(TCG_COND_EQ, d, a, b);
+        tcg_gen_neg_i64(d, d);
+        break;
+    case INDEX_op_vec_cmpgt:
+        tcg_gen_setcond_i64(TCG_COND_GT, d, a, b);
+        tcg_gen_neg_i64(d, d);
+        break;
+    case INDEX_op_vec_sari:
+        tcg_gen_sari_i64(d, a, shift);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+static inline void tcg_gen_vec_expand(TCGOpcode opc, unsigned vece,
+                                      unsigned oprsz, TCGv_ptr base,
+                                      tcg_target_long dofs,
+                                      tcg_target_long aofs,
+                                      tcg_target_long bofs)
+{
+    bool shift = (opc == INDEX_op_vec_shli || opc == INDEX_op_vec_shri ||
+                  opc == INDEX_op_vec_sari);
+    unsigned i;
+
+    if (opc != INDEX_op_vec_cmpeq && opc != INDEX_op_vec_cmpgt &&
+        opc != INDEX_op_vec_sari) {
+        TCGv_i64 d = tcg_temp_new_i64();
+        TCGv_i64 a = tcg_temp_new_i64();
+        TCGv_i64 b = tcg_temp_new_i64();
+
+        for (i = 0; i < oprsz; i += 8) {
+            tcg_gen_ld_i64(a, base, aofs + i);
+            if (!shift) {
+                tcg_gen_ld_i64(b, base, bofs + i);
+            }
+            tcg_gen_vec_chunk_i64(opc, vece, d, a, b, bofs);
+            tcg_gen_st_i64(d, base, dofs + i);
+        }
+        tcg_temp_free_i64(d);
+        tcg_temp_free_i64(a);
+        tcg_temp_free_i64(b);
+    } else if (vece == 3) {
+        TCGv_i64 d = tcg_temp_new_i64();
+        TCGv_i64 a = tcg_temp_new_i64();
+        TCGv_i64 b = tcg_temp_new_i64();
+
+        for (i = 0; i < oprsz; i += 8) {
+            tcg_gen_ld_i64(a, base, aofs + i);
+            if (!shift) {
+                tcg_gen_ld_i64(b, base, bofs + i);
+            }
+            tcg_gen_vec_elem_i64(opc, d, a, b, bofs);
+            tcg_gen_st_i64(d, base, dofs + i);
+        }
+        tcg_temp_free_i64(d);
+        tcg_temp_free_i64(a);
+        tcg_temp_free_i64(b);
+    } else {
+        TCGv_i32 d = tcg_temp_new_i32();
+        TCGv_i32 a = tcg_temp_new_i32();
+        TCGv_i32 b = tcg_temp_new_i32();
+
+        for (i = 0; i < oprsz; i += 1 << vece) {
+            switch (vece) {
+            case 0:
+                tcg_gen_ld8s_i32(a, base, aofs + i);
+                if (!shift) {
+                    tcg_gen_ld8s_i32(b, base, bofs + i);
+                }
+                break;
+            case 1:
+                tcg_gen_ld16s_i32(a, base, aofs + i);
+                if (!shift) {
+                    tcg_gen_ld16s_i32(b, base, bofs + i);
+                }
+                break;
+            default:
+                tcg_gen_ld_i32(a, base, aofs + i);
+                if (!shift) {
+                    tcg_gen_ld_i32(b, base, bofs + i);
+                }
+                break;
+            }
+            tcg_gen_vec_elem_i32(opc, d, a, b, bofs);
+            switch (vece) {
+            case 0:
+                tcg_gen_st8_i32(d, base, dofs + i);
+                break;
+            case 1:
+                tcg_gen_st16_i32(d, base, dofs + i);
+                break;
+            default:
+                tcg_gen_st_i32(d, base, dofs + i);
+                break;
+            }
+        }
+        tcg_temp_free_i32(d);
+        tcg_temp_free_i32(a);
+        tcg_temp_free_i32(b);
+    }
+}
+
+static inline void tcg_gen_vec_op(TCGOpcode opc, unsigned vece,
+                                  unsigned oprsz, TCGv_ptr base,
+                                  tcg_target_long dofs, tcg_target_long aofs,
+                                  tcg_target_long bofs)
+{
+    tcg_debug_assert(oprsz == 8 || oprsz == 16);
+    tcg_debug_assert(vece <= 3);
+    if (TCG_TARGET_HAS_vec && TCG_TARGET_vec_valid(opc, vece)) {
+        tcg_gen_vec_op_internal(opc, vece, oprsz, base, dofs, aofs, bofs);
+    } else {
+        tcg_gen_vec_expand(opc, vece, oprsz, base, dofs, aofs, bofs);
+    }
+}
+
+static inline void tcg_gen_vec_add(unsigned vece, unsigned oprsz,
+                                   TCGv_ptr base, tcg_target_long dofs,
+                                   tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op(INDEX_op_vec_add, vece, oprsz, base, dofs, aofs, bofs);
+}
+
+static inline void tcg_gen_vec_sub(unsigned vece, unsigned oprsz,
+                                   TCGv_ptr base, tcg_target_long dofs,
+                                   tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op(INDEX_op_vec_sub, vece, oprsz, base, dofs, aofs, bofs);
+}
+
+static inline void tcg_gen_vec_and(unsigned oprsz, TCGv_ptr base,
+                                   tcg_target_long dofs,
+                                   tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op(INDEX_op_vec_and, 3, oprsz, base, dofs, aofs, bofs);
+}
+
+static inline void tcg_gen_vec_or(unsigned oprsz, TCGv_ptr base,
+                                  tcg_target_long dofs,
+                                  tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op(INDEX_op_vec_or, 3, oprsz, base, dofs, aofs, bofs);
+}
+
+static inline void tcg_gen_vec_xor(unsigned oprsz, TCGv_ptr base,
+                                   tcg_target_long dofs,
+                                   tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op(INDEX_op_vec_xor, 3, oprsz, base, dofs, aofs, bofs);
+}
+
+/* Set the elements of D to all ones where A == B, to zero elsewhere.  */
+static inline void tcg_gen_vec_cmpeq(unsigned vece, unsigned oprsz,
+                                     TCGv_ptr base, tcg_target_long dofs,
+                                     tcg_target_long aofs,
+                                     tcg_target_long bofs)
+{
+    tcg_gen_vec_op(INDEX_op_vec_cmpeq, vece, oprsz, base, dofs, aofs, bofs);
+}
+
+/* Same, where A > B as signed integers.  */
+static inline void tcg_gen_vec_cmpgt(unsigned vece, unsigned oprsz,
+                                     TCGv_ptr base, tcg_target_long dofs,
+                                     tcg_target_long aofs,
+                                     tcg_target_long bofs)
+{
+    tcg_gen_vec_op(INDEX_op_vec_cmpgt, vece, oprsz, base, dofs, aofs, bofs);
+}
+
+/* The shift count must be less than the element width.  */
+static inline void tcg_gen_vec_shli(unsigned vece, unsigned oprsz,
+                                    TCGv_ptr base, tcg_target_long dofs,
+                                    tcg_target_long aofs, int64_t shift)
+{
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+    tcg_gen_vec_op(INDEX_op_vec_shli, vece, oprsz, base, dofs, aofs, shift);
+}
+
+static inline void tcg_gen_vec_shri(unsigned vece, unsigned oprsz,
+                                    TCGv_ptr base, tcg_target_long dofs,
+                                    tcg_target_long aofs, int64_t shift)
+{
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+    tcg_gen_vec_op(INDEX_op_vec_shri, vece, oprsz, base, dofs, aofs, shift);
+}
+
+static inline void tcg_gen_vec_sari(unsigned vece, unsigned oprsz,
+                                    TCGv_ptr base, tcg_target_long dofs,
+                                    tcg_target_long aofs, int64_t shift)
+{
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+    tcg_gen_vec_op(INDEX_op_vec_sari, vece, oprsz, base, dofs, aofs, shift);
+}
+
 /***************************************/
 /* QEMU specific operations. Their type depend on the QEMU CPU
    type. */
@@ -2598,6 +2924,7 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
 #define tcg_temp_new() tcg_temp_new_i32()
 #define tcg_global_reg_new tcg_global_reg_new_i32
 #define tcg_global_mem_new tcg_global_mem_new_i32
+#define tcg_global_set_class tcg_global_set_class_i32
 #define tcg_temp_local_new() tcg_temp_local_new_i32()
 #define tcg_temp_free tcg_temp_free_i32
 #define tcg_gen_qemu_ldst_op tcg_gen_op3i_i32
@@ -2610,6 +2937,7 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
 #define tcg_temp_new() tcg_temp_new_i64()
 #define tcg_global_reg_new tcg_global_reg_new_i64
 #define tcg_global_mem_new tcg_global_mem_new_i64
+#define tcg_global_set_class tcg_global_set_class_i64
 #define tcg_temp_local_new() tcg_temp_local_new_i64()
 #define tcg_temp_free tcg_temp_free_i64
 #define tcg_gen_qemu_ldst_op tcg_gen_op3i_i64
@@ -2648,6 +2976,29 @@ static inline void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* End the TB for an indirect branch: jump straight to the TB the guest
+   state in ENV continues at if it is in the jump cache, else return to
+   the main loop like exit_tb(0).  The guest PC and the other state that
+   cpu_get_tb_cpu_state reads must be up to date in ENV.  */
+static inline void tcg_gen_lookup_and_goto_ptr(TCGv_ptr env)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        TCGArg args[1];
+        int sizemask;
+
+        sizemask = tcg_gen_sizemask(0, TCG_TARGET_REG_BITS == 64, 0)
+                 | tcg_gen_sizemask(1, TCG_TARGET_REG_BITS == 64, 0);
+        args[0] = GET_TCGV_PTR(env);
+        tcg_gen_helperN(helper_lookup_tb_ptr, TCG_CALL_NO_WG, sizemask,
+                        GET_TCGV_PTR(ptr), 1, args);
+        tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -2839,9 +3190,225 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 
 #endif /* TCG_TARGET_REG_BITS != 32 */
 
+/* Atomic read-modify-write of guest memory, for the atomic instructions
+   of the guest.  SIZE is log2 of the access size in bytes; the operands
+   are truncated to it, and RET gets the old value of the memory,
+   zero-extended.  The memory is in the byte order of the target, as with
+   qemu_ld/st.  Hosts that have TCG_TARGET_HAS_atomic do them inline;
+   otherwise they call helpers using the host atomic instructions, which
+   need ENV.  */
+
+/* Emit one of the inline ops, which work on 64-bit values.  */
+static inline void tcg_gen_atomic_op(TCGOpcode opc, TCGv_i64 ret, TCGv addr,
+                                     TCGv_i64 val1, TCGv_i64 val2, int nvals,
+                                     int size)
+{
+    *tcg_ctx.gen_opc_ptr++ = opc;
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_I64(ret);
+#if TARGET_LONG_BITS == 32
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_I32(addr);
+#else
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_I64(addr);
+#endif
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_I64(val1);
+    if (nvals > 1) {
+        *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_I64(val2);
+    }
+    *tcg_ctx.gen_opparam_ptr++ = size;
+}
+
+/* Call one of the helpers; IS_64 tells whether the values are 64-bit.
+   Raising a guest fault, they read the globals but do not write them.  */
+static inline void tcg_gen_atomic_call(void *func, int is_64, TCGArg ret,
+                                       TCGv_ptr env, TCGv addr, TCGArg val1,
+                                       TCGArg val2, int nvals, int mem_index)
+{
+    TCGv_i32 idx = tcg_const_i32(mem_index);
+    TCGArg args[5];
+    int sizemask, nargs = 0;
+
+    sizemask = tcg_gen_sizemask(0, is_64, 0)
+             | tcg_gen_sizemask(1, TCG_TARGET_REG_BITS == 64, 0)
+             | tcg_gen_sizemask(2, TARGET_LONG_BITS == 64, 0)
+             | tcg_gen_sizemask(3, is_64, 0);
+    args[nargs++] = GET_TCGV_PTR(env);
+#if TARGET_LONG_BITS == 32
+    args[nargs++] = GET_TCGV_I32(addr);
+#else
+    args[nargs++] = GET_TCGV_I64(addr);
+#endif
+    args[nargs++] = val1;
+    if (nvals > 1) {
+        sizemask |= tcg_gen_sizemask(4, is_64, 0);
+        args[nargs++] = val2;
+    }
+    args[nargs++] = GET_TCGV_I32(idx);
+    tcg_gen_helperN(func, TCG_CALL_NO_WG, sizemask, ret, nargs, args);
+    tcg_temp_free_i32(idx);
+}
+
+/* The inline op or helper call for the 32-bit flavours.  */
+static inline void tcg_gen_atomic_i32(TCGOpcode opc, void *func,
+                                      TCGv_i32 ret, TCGv_ptr env, TCGv addr,
+                                      TCGv_i32 val1, TCGv_i32 val2, int nvals,
+                                      int mem_index, int size)
+{
+    tcg_debug_assert(size <= 2);
+    if (TCG_TARGET_HAS_atomic) {
+        TCGv_i64 r64 = tcg_temp_new_i64();
+        TCGv_i64 v1 = tcg_temp_new_i64();
+        TCGv_i64 v2 = tcg_temp_new_i64();
+
+        tcg_gen_extu_i32_i64(v1, val1);
+        if (nvals > 1) {
+            tcg_gen_extu_i32_i64(v2, val2);
+        }
+        tcg_gen_atomic_op(opc, r64, addr, v1, v2, nvals, size);
+        tcg_gen_trunc_i64_i32(ret, r64);
+        tcg_temp_free_i64(r64);
+        tcg_temp_free_i64(v1);
+        tcg_temp_free_i64(v2);
+    } else {
+        tcg_gen_atomic_call(func, 0, GET_TCGV_I32(ret), env, addr,
+                            GET_TCGV_I32(val1), GET_TCGV_I32(val2), nvals,
+                            mem_index);
+    }
+}
+
+/* Likewise for the 64-bit flavours, which accept any SIZE.  */
+static inline void tcg_gen_atomic_i64(TCGOpcode opc, void *func,
+                                      TCGv_i64 ret, TCGv_ptr env, TCGv addr,
+                                      TCGv_i64 val1, TCGv_i64 val2, int nvals,
+                                      int mem_index, int size)
+{
+    if (TCG_TARGET_HAS_atomic) {
+        tcg_gen_atomic_op(opc, ret, addr, val1, val2, nvals, size);
+    } else if (size == 3) {
+        tcg_gen_atomic_call(func, 1, GET_TCGV_I64(ret), env, addr,
+                            GET_TCGV_I64(val1), GET_TCGV_I64(val2), nvals,
+                            mem_index);
+    } else {
+        TCGv_i32 r32 = tcg_temp_new_i32();
+        TCGv_i32 v1 = tcg_temp_new_i32();
+        TCGv_i32 v2 = tcg_temp_new_i32();
+
+        tcg_gen_trunc_i64_i32(v1, val1);
+        if (nvals > 1) {
+            tcg_gen_trunc_i64_i32(v2, val2);
+        }
+        tcg_gen_atomic_call(func, 0, GET_TCGV_I32(r32), env, addr,
+                            GET_TCGV_I32(v1), GET_TCGV_I32(v2), nvals,
+                            mem_index);
+        tcg_gen_extu_i32_i64(ret, r32);
+        tcg_temp_free_i32(r32);
+        tcg_temp_free_i32(v1);
+        tcg_temp_free_i32(v2);
+    }
+}
+
+static inline void *tcg_atomic_cmpxchg_helper(int size)
+{
+    switch (size) {
+    case 0:
+        return helper_atomic_cmpxchgb;
+    case 1:
+        return helper_atomic_cmpxchgw;
+    case 2:
+        return helper_atomic_cmpxchgl;
+    default:
+        return helper_atomic_cmpxchgq;
+    }
+}
+
+static inline void *tcg_atomic_xchg_helper(int size)
+{
+    switch (size) {
+    case 0:
+        return helper_atomic_xchgb;
+    case 1:
+        return helper_atomic_xchgw;
+    case 2:
+        return helper_atomic_xchgl;
+    default:
+        return helper_atomic_xchgq;
+    }
+}
+
+static inline void *tcg_atomic_fetch_add_helper(int size)
+{
+    switch (size) {
+    case 0:
+        return helper_atomic_fetch_addb;
+    case 1:
+        return helper_atomic_fetch_addw;
+    case 2:
+        return helper_atomic_fetch_addl;
+    default:
+        return helper_atomic_fetch_addq;
+    }
+}
+
+/* ret = *addr; if (ret == cmpv) *addr = newv */
+static inline void tcg_gen_atomic_cmpxchg_i32(TCGv_i32 ret, TCGv_ptr env,
+                                              TCGv addr, TCGv_i32 cmpv,
+                                              TCGv_i32 newv, int mem_index,
+                                              int size)
+{
+    tcg_gen_atomic_i32(INDEX_op_atomic_cmpxchg, tcg_atomic_cmpxchg_helper(size),
+                       ret, env, addr, cmpv, newv, 2, mem_index, size);
+}
+
+static inline void tcg_gen_atomic_cmpxchg_i64(TCGv_i64 ret, TCGv_ptr env,
+                                              TCGv addr, TCGv_i64 cmpv,
+                                              TCGv_i64 newv, int mem_index,
+                                              int size)
+{
+    tcg_gen_atomic_i64(INDEX_op_atomic_cmpxchg, tcg_atomic_cmpxchg_helper(size),
+                       ret, env, addr, cmpv, newv, 2, mem_index, size);
+}
+
+/* ret = *addr; *addr = val */
+static inline void tcg_gen_atomic_xchg_i32(TCGv_i32 ret, TCGv_ptr env,
+                                           TCGv addr, TCGv_i32 val,
+                                           int mem_index, int size)
+{
+    tcg_gen_atomic_i32(INDEX_op_atomic_xchg, tcg_atomic_xchg_helper(size),
+                       ret, env, addr, val, val, 1, mem_index, size);
+}
+
+static inline void tcg_gen_atomic_xchg_i64(TCGv_i64 ret, TCGv_ptr env,
+                                           TCGv addr, TCGv_i64 val,
+                                           int mem_index, int size)
+{
+    tcg_gen_atomic_i64(INDEX_op_atomic_xchg, tcg_atomic_xchg_helper(size),
+                       ret, env, addr, val, val, 1, mem_index, size);
+}
+
+/* ret = *addr; *addr += val */
+static inline void tcg_gen_atomic_fetch_add_i32(TCGv_i32 ret, TCGv_ptr env,
+                                                TCGv addr, TCGv_i32 val,
+                                                int mem_index, int size)
+{
+    tcg_gen_atomic_i32(INDEX_op_atomic_fetch_add,
+                       tcg_atomic_fetch_add_helper(size),
+                       ret, env, addr, val, val, 1, mem_index, size);
+}
+
+static inline void tcg_gen_atomic_fetch_add_i64(TCGv_i64 ret, TCGv_ptr env,
+                                                TCGv addr, TCGv_i64 val,
+                                                int mem_index, int size)
+{
+    tcg_gen_atomic_i64(INDEX_op_atomic_fetch_add,
+                       tcg_atomic_fetch_add_helper(size),
+                       ret, env, addr, val, val, 1, mem_index, size);
+}
+
 #if TARGET_LONG_BITS == 64
 #define tcg_gen_movi_tl tcg_gen_movi_i64
 #define tcg_gen_mov_tl tcg_gen_mov_i64
+#define tcg_gen_atomic_cmpxchg_tl tcg_gen_atomic_cmpxchg_i64
+#define tcg_gen_atomic_xchg_tl tcg_gen_atomic_xchg_i64
+#define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i64
 #define tcg_gen_ld8u_tl tcg_gen_ld8u_i64
 #define tcg_gen_ld8s_tl tcg_gen_ld8s_i64
 #define tcg_gen_ld16u_tl tcg_gen_ld16u_i64
@@ -2920,6 +3487,9 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #else
 #define tcg_gen_movi_tl tcg_gen_movi_i32
 #define tcg_gen_mov_tl tcg_gen_mov_i32
+#define tcg_gen_atomic_cmpxchg_tl tcg_gen_atomic_cmpxchg_i32
+#define tcg_gen_atomic_xchg_tl tcg_gen_atomic_xchg_i32
+#define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i32
 #define tcg_gen_ld8u_tl tcg_gen_ld8u_i32
 #define tcg_gen_ld8s_tl tcg_gen_ld8s_i32
 #define tcg_gen_ld16u_tl tcg_gen_ld16u_i32
@@ -3011,3 +3581,17 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
                                                  TCGV_PTR_TO_NAT(A), (B))
 #define tcg_gen_ext_i32_ptr(R, A) tcg_gen_ext_i32_i64(TCGV_PTR_TO_NAT(R), (A))
 #endif /* TCG_TARGET_REG_BITS != 32 */
+
+/* Increment the 64-bit COUNTER, for the TB profiler.  The increment is
+   not atomic, so with several vCPU threads a few counts may be lost.  */
+static inline void tcg_gen_count(uint64_t *counter)
+{
+    TCGv_ptr ptr = tcg_const_ptr(counter);
+    TCGv_i64 val = tcg_temp_new_i64();
+
+    tcg_gen_ld_i64(val, ptr, 0);
+    tcg_gen_addi_i64(val, val, 1);
+    tcg_gen_st_i64(val, ptr, 0);
+    tcg_temp_free_i64(val);
+    tcg_temp_free_ptr(ptr);
+}
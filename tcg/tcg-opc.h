@@ -172,6 +172,18 @@ DEF(muls2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_muls2_i64))
 DEF(muluh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_muluh_i64))
 DEF(mulsh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_mulsh_i64))
 
+/* vector ops on memory: base, dofs, aofs, bofs (or shift), desc */
+DEF(vec_add, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_sub, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_and, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_or, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_xor, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_cmpeq, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_cmpgt, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_shli, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_shri, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_sari, 0, 1, 4, IMPL(TCG_TARGET_HAS_vec))
+
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
 DEF(debug_insn_start, 0, 0, 2, TCG_OPF_NOT_PRESENT)
@@ -180,6 +192,7 @@ DEF(debug_insn_start, 0, 0, 1, TCG_OPF_NOT_PRESENT)
 #endif
 DEF(exit_tb, 0, 0, 1, TCG_OPF_BB_END)
 DEF(goto_tb, 0, 0, 1, TCG_OPF_BB_END)
+DEF(goto_ptr, 0, 1, 0, TCG_OPF_BB_END | IMPL(TCG_TARGET_HAS_goto_ptr))
 /* Note: even if TARGET_LONG_BITS is not defined, the INDEX_op
    constants must be defined */
 #if TCG_TARGET_REG_BITS == 32
@@ -253,6 +266,15 @@ DEF(qemu_st64, 0, 2, 1, TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS)
 
 #endif /* TCG_TARGET_REG_BITS != 32 */
 
+/* atomic read-modify-write of guest memory, on 64-bit values whatever
+   the access size, which is the constant argument (see tcg_gen_atomic_*) */
+DEF(atomic_cmpxchg, 1, 3, 1, TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS
+    | TCG_OPF_64BIT | IMPL(TCG_TARGET_HAS_atomic))
+DEF(atomic_xchg, 1, 2, 1, TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS
+    | TCG_OPF_64BIT | IMPL(TCG_TARGET_HAS_atomic))
+DEF(atomic_fetch_add, 1, 2, 1, TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS
+    | TCG_OPF_64BIT | IMPL(TCG_TARGET_HAS_atomic))
+
 #undef IMPL
 #undef IMPL64
 #undef DEF
@@ -40,6 +40,7 @@
 #include "qemu/cache-utils.h"
 #include "qemu/host-utils.h"
 #include "qemu/timer.h"
+#include "qemu/qht.h"
 
 /* Note: the long term plan is to reduce the dependancies on the QEMU
    CPU definitions. Currently they are used for qemu_ld/st
@@ -254,6 +255,27 @@ void tcg_pool_reset(TCGContext *s)
     s->pool_current = NULL;
 }
 
+/* TB profiler: the number of calls to each helper, by address.  The
+   counters are never freed, since generated code may still use them.  */
+typedef struct TCGHelperCount {
+    void *func;
+    uint64_t count;
+} TCGHelperCount;
+
+static QHT helper_profile;
+
+static inline uint32_t tcg_helper_profile_hash(void *func)
+{
+    uint64_t h = (uintptr_t)func;
+
+    return (h >> 4) ^ (h >> 32);
+}
+
+static bool tcg_helper_count_cmp(const void *p, const void *userp)
+{
+    return ((const TCGHelperCount *)p)->func == userp;
+}
+
 void tcg_context_init(TCGContext *s)
 {
     int op, total_args, n;
@@ -285,6 +307,7 @@ void tcg_context_init(TCGContext *s)
         args_ct += n;
     }
     
+    qht_init(&helper_profile, 64, QHT_MODE_AUTO_RESIZE);
     tcg_target_init(s);
 }
 
@@ -331,6 +354,8 @@ void tcg_func_start(TCGContext *s)
 
     s->gen_opc_ptr = s->gen_opc_buf;
     s->gen_opparam_ptr = s->gen_opparam_buf;
+    s->ops_optimized = false;
+    s->host_ptr_consts = false;
 
 #if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
     /* Initialize qemu_ld/st labels to assist code generation at the end of TB
@@ -462,6 +487,29 @@ TCGv_i64 tcg_global_mem_new_i64(int reg, intptr_t offset, const char *name)
     return MAKE_TCGV_I64(idx);
 }
 
+/* Put a global in one of the classes that the helper flags refer to.
+   Globals are in class 0 until then.  */
+void tcg_global_set_class_i32(TCGv_i32 arg, int global_class)
+{
+    TCGContext *s = &tcg_ctx;
+    int idx = GET_TCGV_I32(arg);
+
+    assert(idx < s->nb_globals && global_class < TCG_MAX_GLOBAL_CLASSES);
+    s->temps[idx].global_class = global_class;
+}
+
+void tcg_global_set_class_i64(TCGv_i64 arg, int global_class)
+{
+    TCGContext *s = &tcg_ctx;
+    int idx = GET_TCGV_I64(arg);
+
+    assert(idx < s->nb_globals && global_class < TCG_MAX_GLOBAL_CLASSES);
+    s->temps[idx].global_class = global_class;
+#if TCG_TARGET_REG_BITS == 32
+    s->temps[idx + 1].global_class = global_class;
+#endif
+}
+
 static inline int tcg_temp_new_internal(TCGType type, int temp_local)
 {
     TCGContext *s = &tcg_ctx;
@@ -894,6 +942,66 @@ static TCGHelperInfo *tcg_find_helper(TCGContext *s, uintptr_t val)
     return NULL;
 }
 
+/* Count the executions of the call to FUNC being generated.  The
+   retranslation done by cpu_restore_state runs without tb_lock and must
+   emit the same counter, which helper_profile lets it find.  */
+void tcg_gen_count_helper(void *func)
+{
+    uint32_t hash = tcg_helper_profile_hash(func);
+    TCGHelperCount *hc;
+
+    hc = qht_lookup(&helper_profile, tcg_helper_count_cmp, func, hash);
+    if (!hc) {
+        /* only the first translation of a call gets here, with tb_lock */
+        hc = g_new0(TCGHelperCount, 1);
+        hc->func = func;
+        qht_insert(&helper_profile, hc, hash);
+    }
+    tcg_gen_count(&hc->count);
+}
+
+typedef struct TCGHelperProfileIter {
+    void (*fn)(const char *name, uint64_t count, void *opaque);
+    void *opaque;
+} TCGHelperProfileIter;
+
+static void tcg_helper_profile_report(void *p, uint32_t hash, void *userp)
+{
+    TCGHelperCount *hc = p;
+    TCGHelperProfileIter *it = userp;
+    TCGHelperInfo *th;
+    char buf[32];
+
+    if (hc->count == 0) {
+        return;
+    }
+    th = tcg_find_helper(&tcg_ctx, (uintptr_t)hc->func);
+    if (th) {
+        it->fn(th->name, hc->count, it->opaque);
+    } else {
+        snprintf(buf, sizeof(buf), "%p", hc->func);
+        it->fn(buf, hc->count, it->opaque);
+    }
+}
+
+void tcg_helper_profile_foreach(void (*fn)(const char *name, uint64_t count,
+                                           void *opaque), void *opaque)
+{
+    TCGHelperProfileIter it = { .fn = fn, .opaque = opaque };
+
+    qht_iter(&helper_profile, tcg_helper_profile_report, &it);
+}
+
+static void tcg_helper_count_reset(void *p, uint32_t hash, void *userp)
+{
+    ((TCGHelperCount *)p)->count = 0;
+}
+
+void tcg_helper_profile_reset(void)
+{
+    qht_iter(&helper_profile, tcg_helper_count_reset, NULL);
+}
+
 static const char * const cond_name[] =
 {
     [TCG_COND_NEVER] = "never",
@@ -1310,14 +1418,17 @@ static void tcg_liveness_analysis(TCGContext *s)
                         mem_temps[arg] = 0;
                     }
 
-                    if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
-                        /* globals should be synced to memory */
-                        memset(mem_temps, 1, s->nb_globals);
-                    }
-                    if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
-                                        TCG_CALL_NO_READ_GLOBALS))) {
-                        /* globals should go back to memory */
-                        memset(dead_temps, 1, s->nb_globals);
+                    /* globals the helper may read should be synced to
+                       memory, and those it may write should go back to
+                       memory; the others can stay in registers */
+                    for (i = 0; i < s->nb_globals; i++) {
+                        if (tcg_call_reads_global(call_flags, &s->temps[i])) {
+                            mem_temps[i] = 1;
+                            if (tcg_call_writes_global(call_flags,
+                                                       &s->temps[i])) {
+                                dead_temps[i] = 1;
+                            }
+                        }
                     }
 
                     /* input args are live */
@@ -1758,6 +1869,30 @@ static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
+/* save the globals that a helper called with 'flags' might write to
+   their canonical location, and sync the ones it might only read.
+   'allocated_regs' is used in case a temporary registers needs to be
+   allocated to store a constant. */
+static void call_globals(TCGContext *s, TCGRegSet allocated_regs, int flags)
+{
+    TCGTemp *ts;
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (tcg_call_writes_global(flags, ts)) {
+            temp_save(s, i, allocated_regs);
+        } else if (tcg_call_reads_global(flags, ts)) {
+#ifdef USE_LIVENESS_ANALYSIS
+            assert(ts->val_type != TEMP_VAL_REG || ts->fixed_reg ||
+                   ts->mem_coherent);
+#else
+            temp_sync(s, i, allocated_regs);
+#endif
+        }
+    }
+}
+
 /* at the end of a basic block, we assume all temporaries are dead and
    all globals are stored at their canonical location. */
 static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
@@ -2205,13 +2340,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
 
     /* Save globals if they might be written by the helper, sync them if
        they might be read. */
-    if (flags & TCG_CALL_NO_READ_GLOBALS) {
-        /* Nothing to do */
-    } else if (flags & TCG_CALL_NO_WRITE_GLOBALS) {
-        sync_globals(s, allocated_regs);
-    } else {
-        save_globals(s, allocated_regs);
-    }
+    call_globals(s, allocated_regs, flags);
 
     tcg_out_op(s, opc, &func_arg, &const_func_arg);
 
@@ -2262,6 +2391,15 @@ static void dump_op_count(void)
 #endif
 
 
+void tcg_optimize_ops(TCGContext *s)
+{
+#ifdef USE_TCG_OPTIMIZATIONS
+    s->gen_opparam_ptr =
+        tcg_optimize(s, s->gen_opc_ptr, s->gen_opparam_buf, tcg_op_defs);
+#endif
+    s->ops_optimized = true;
+}
+
 static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
                                       long search_pc)
 {
@@ -2282,10 +2420,9 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     s->opt_time -= profile_getclock();
 #endif
 
-#ifdef USE_TCG_OPTIMIZATIONS
-    s->gen_opparam_ptr =
-        tcg_optimize(s, s->gen_opc_ptr, s->gen_opparam_buf, tcg_op_defs);
-#endif
+    if (!s->ops_optimized) {
+        tcg_optimize_ops(s);
+    }
 
 #ifdef CONFIG_PROFILER
     s->opt_time += profile_getclock();
@@ -40,6 +40,14 @@
 # endif
 #endif
 
+/* Guest registers wider than the host's, which also means that guest
+   words in the TLB can't be updated atomically.  */
+#if TCG_TARGET_REG_BITS < TARGET_LONG_BITS
+#define TCG_OVERSIZED_GUEST 1
+#else
+#define TCG_OVERSIZED_GUEST 0
+#endif
+
 #if TCG_TARGET_REG_BITS == 32
 typedef int32_t tcg_target_long;
 typedef uint32_t tcg_target_ulong;
@@ -106,6 +114,18 @@ typedef uint64_t TCGRegSet;
 #ifndef TCG_TARGET_deposit_i64_valid
 #define TCG_TARGET_deposit_i64_valid(ofs, len) 1
 #endif
+#ifndef TCG_TARGET_HAS_vec
+#define TCG_TARGET_HAS_vec 0
+#endif
+#ifndef TCG_TARGET_vec_valid
+#define TCG_TARGET_vec_valid(opc, vece) 1
+#endif
+#ifndef TCG_TARGET_HAS_atomic
+#define TCG_TARGET_HAS_atomic 0
+#endif
+#ifndef TCG_TARGET_HAS_goto_ptr
+#define TCG_TARGET_HAS_goto_ptr 0
+#endif
 
 /* Only one of DIV or DIV2 should be defined.  */
 #if defined(TCG_TARGET_HAS_div_i32)
@@ -304,6 +324,13 @@ typedef int TCGv_i64;
 #define TCG_CALL_NO_WRITE_GLOBALS   0x0020
 /* Helper can be safely suppressed if the return value is not used. */
 #define TCG_CALL_NO_SIDE_EFFECTS    0x0040
+/* Helper does not read (nor write) the globals of the classes in the
+   mask M, see tcg_global_set_class.  */
+#define TCG_CALL_NO_READ_CLASSES(M)  (((M) & 0xff) << 8)
+/* Helper does not write the globals of the classes in the mask M. */
+#define TCG_CALL_NO_WRITE_CLASSES(M) (((M) & 0xff) << 16)
+
+#define TCG_MAX_GLOBAL_CLASSES 8
 
 /* convenience version of most used call flags */
 #define TCG_CALL_NO_RWG         TCG_CALL_NO_READ_GLOBALS
@@ -311,6 +338,14 @@ typedef int TCGv_i64;
 #define TCG_CALL_NO_SE          TCG_CALL_NO_SIDE_EFFECTS
 #define TCG_CALL_NO_RWG_SE      (TCG_CALL_NO_RWG | TCG_CALL_NO_SE)
 #define TCG_CALL_NO_WG_SE       (TCG_CALL_NO_WG | TCG_CALL_NO_SE)
+/* Helper only accesses the globals of the classes in the mask M. */
+#define TCG_CALL_ONLY_CLASSES(M) TCG_CALL_NO_READ_CLASSES(~(M))
+
+/* Descriptor of a vector op: OPRSZ (8 or 16) bytes made of elements of
+   1 << VECE bytes.  */
+#define TCG_VEC_DESC(oprsz, vece) ((((oprsz) >> 3) << 2) | (vece))
+#define TCG_VEC_OPRSZ(desc)       ((((desc) >> 2) & 3) << 3)
+#define TCG_VEC_VECE(desc)        ((desc) & 3)
 
 /* used to align parameters */
 #define TCG_CALL_DUMMY_TCGV     MAKE_TCGV_I32(-1)
@@ -400,6 +435,7 @@ typedef struct TCGTemp {
                                   basic blocks. Otherwise, it is not
                                   preserved across basic blocks. */
     unsigned int temp_allocated:1; /* never used for code gen */
+    unsigned int global_class:3; /* for globals, see TCG_CALL_*_CLASSES */
     /* index of next free temp of same base type, -1 if end */
     int next_free_temp;
     const char *name;
@@ -485,17 +521,29 @@ struct TCGContext {
     uint16_t gen_opc_icount[OPC_BUF_SIZE];
     uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
 
-    /* Code generation */
-    int code_gen_max_blocks;
+    /* Code generation; the buffer is split into the regions of
+       tb_ctx.regions */
     uint8_t *code_gen_prologue;
+    /* where goto_ptr goes to return 0 to cpu_exec, as exit_tb(0) would */
+    uint8_t *code_gen_epilogue;
     uint8_t *code_gen_buffer;
     size_t code_gen_buffer_size;
-    /* threshold to flush the translated code buffer */
-    size_t code_gen_buffer_max_size;
-    uint8_t *code_gen_ptr;
 
     TBContext tb_ctx;
 
+    /* set when the ops of the current TB were already optimized, so that
+       tcg_gen_code does not do it again */
+    bool ops_optimized;
+    /* set when the ops of the current TB load host pointers other than
+       helper addresses (see tcg_const_ptr) */
+    bool host_ptr_consts;
+
+    /* TB profiler: where the executions of the TB being translated are
+       counted, and whether its helper calls are counted, see
+       tcg_gen_count() */
+    uint64_t *prof_exec_count;
+    bool prof_helpers;
+
 #if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
     /* labels info for qemu_ld/st IRs
        The labels help to generate TLB miss case codes at the end of TB */
@@ -506,6 +554,21 @@ struct TCGContext {
 
 extern TCGContext tcg_ctx;
 
+/* Returns true if a helper called with FLAGS may read the global TS. */
+static inline bool tcg_call_reads_global(int flags, const TCGTemp *ts)
+{
+    return !(flags & (TCG_CALL_NO_READ_GLOBALS |
+                      TCG_CALL_NO_READ_CLASSES(1 << ts->global_class)));
+}
+
+/* Returns true if a helper called with FLAGS may write the global TS. */
+static inline bool tcg_call_writes_global(int flags, const TCGTemp *ts)
+{
+    return tcg_call_reads_global(flags, ts) &&
+           !(flags & (TCG_CALL_NO_WRITE_GLOBALS |
+                      TCG_CALL_NO_WRITE_CLASSES(1 << ts->global_class)));
+}
+
 /* pool based memory allocation */
 
 void *tcg_malloc_internal(TCGContext *s, int size);
@@ -552,6 +615,8 @@ char *tcg_get_arg_str_i32(TCGContext *s, char *buf, int buf_size, TCGv_i32 arg);
 
 TCGv_i64 tcg_global_reg_new_i64(int reg, const char *name);
 TCGv_i64 tcg_global_mem_new_i64(int reg, intptr_t offset, const char *name);
+void tcg_global_set_class_i32(TCGv_i32 arg, int global_class);
+void tcg_global_set_class_i64(TCGv_i64 arg, int global_class);
 TCGv_i64 tcg_temp_new_internal_i64(int temp_local);
 static inline TCGv_i64 tcg_temp_new_i64(void)
 {
@@ -650,7 +715,7 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I32(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I32(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V)))
+#define tcg_const_func_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V)))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i32((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -661,7 +726,7 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V)))
+#define tcg_const_func_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V)))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -670,6 +735,12 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define tcg_temp_free_ptr(T) tcg_temp_free_i64(TCGV_PTR_TO_NAT(T))
 #endif
 
+/* Helper addresses are loaded with tcg_const_func_ptr.  Other host
+   pointers tie the ops to the running process, which is noted so that
+   they are not saved in the linux-user translation cache.  */
+#define tcg_const_ptr(V) \
+    (tcg_ctx.host_ptr_consts = true, tcg_const_func_ptr(V))
+
 void tcg_gen_callN(TCGContext *s, TCGv_ptr func, unsigned int flags,
                    int sizemask, TCGArg ret, int nargs, TCGArg *args);
 
@@ -678,10 +749,17 @@ void tcg_gen_shifti_i64(TCGv_i64 ret, TCGv_i64 arg1,
 
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
                      TCGOpDef *tcg_op_def);
+void tcg_optimize_ops(TCGContext *s);
 
 /* only used for debugging purposes */
 void tcg_register_helper(void *func, const char *name);
 const char *tcg_helper_get_name(TCGContext *s, void *func);
+
+/* TB profiler */
+void tcg_gen_count_helper(void *func);
+void tcg_helper_profile_foreach(void (*fn)(const char *name, uint64_t count,
+                                           void *opaque), void *opaque);
+void tcg_helper_profile_reset(void);
 void tcg_dump_ops(TCGContext *s);
 
 void dump_ops(const uint16_t *opc_buf, const TCGArg *opparam_buf);
@@ -796,4 +874,40 @@ void helper_stq_mmu(CPUArchState *env, target_ulong addr,
                     uint64_t val, int mmu_idx);
 #endif /* CONFIG_SOFTMMU */
 
+/* Atomic operations behind tcg_gen_atomic_*.  They return the old
+   value, zero-extended.  */
+uint32_t helper_atomic_cmpxchgb(CPUArchState *env, target_ulong addr,
+                                uint32_t cmpv, uint32_t newv,
+                                uint32_t mmu_idx);
+uint32_t helper_atomic_cmpxchgw(CPUArchState *env, target_ulong addr,
+                                uint32_t cmpv, uint32_t newv,
+                                uint32_t mmu_idx);
+uint32_t helper_atomic_cmpxchgl(CPUArchState *env, target_ulong addr,
+                                uint32_t cmpv, uint32_t newv,
+                                uint32_t mmu_idx);
+uint64_t helper_atomic_cmpxchgq(CPUArchState *env, target_ulong addr,
+                                uint64_t cmpv, uint64_t newv,
+                                uint32_t mmu_idx);
+
+uint32_t helper_atomic_xchgb(CPUArchState *env, target_ulong addr,
+                             uint32_t val, uint32_t mmu_idx);
+uint32_t helper_atomic_xchgw(CPUArchState *env, target_ulong addr,
+                             uint32_t val, uint32_t mmu_idx);
+uint32_t helper_atomic_xchgl(CPUArchState *env, target_ulong addr,
+                             uint32_t val, uint32_t mmu_idx);
+uint64_t helper_atomic_xchgq(CPUArchState *env, target_ulong addr,
+                             uint64_t val, uint32_t mmu_idx);
+
+uint32_t helper_atomic_fetch_addb(CPUArchState *env, target_ulong addr,
+                                  uint32_t val, uint32_t mmu_idx);
+uint32_t helper_atomic_fetch_addw(CPUArchState *env, target_ulong addr,
+                                  uint32_t val, uint32_t mmu_idx);
+uint32_t helper_atomic_fetch_addl(CPUArchState *env, target_ulong addr,
+                                  uint32_t val, uint32_t mmu_idx);
+uint64_t helper_atomic_fetch_addq(CPUArchState *env, target_ulong addr,
+                                  uint64_t val, uint32_t mmu_idx);
+
+/* Host code to continue at, behind tcg_gen_lookup_and_goto_ptr.  */
+void *helper_lookup_tb_ptr(CPUArchState *env);
+
 #endif /* TCG_H */
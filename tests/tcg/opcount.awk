@@ -0,0 +1,14 @@
+# Count the TCG ops in a log written with -d op,op_opt, before and after
+# the optimizer, leaving out instruction markers and removed ops.
+
+/^OP:/ { sect = "before"; tbs++; next }
+/^OP after/ { sect = "after"; next }
+/^[^ ]/ { sect = ""; next }
+
+sect != "" && NF > 0 && $1 != "----" && $1 != "nop" && $1 != "nopn" &&
+$1 != "discard" { ops[sect]++ }
+
+END {
+    printf "%s: %d TBs, %d ops, %d after optimization\n",
+           FILENAME, tbs, ops["before"], ops["after"]
+}
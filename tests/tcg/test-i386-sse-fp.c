@@ -0,0 +1,203 @@
+/*
+ *  x86 SSE floating-point test - executes the scalar SSE/SSE2 arithmetic
+ *  instructions on pseudo-random operands, in all rounding modes, and prints
+ *  the operands and results.
+ *
+ *  Run this on real hardware, then under QEMU, and diff the outputs, to check
+ *  that QEMU's results are bit-exact.  The operands are mostly normal numbers,
+ *  which is what the host FPU fast path in fpu/softfloat.c handles, with
+ *  zeroes, denormals, infinities and values close to the overflow and
+ *  underflow thresholds mixed in to exercise the fallback to softfloat.
+ *  NaN operands are left out, since QEMU does not pick the same NaN as
+ *  the hardware when both operands are NaNs.
+ *
+ *  With "bench" as its argument, the program instead times a loop of
+ *  additions, multiplications and divisions; the 'speed-sse-fp' make target
+ *  runs it natively and under QEMU.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define N_OPERANDS 4000
+#define BENCH_ITERATIONS 20000000
+
+static uint32_t seed = 0x12345678;
+
+static uint32_t rand32(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static uint64_t rand64(void)
+{
+    return ((uint64_t)rand32() << 32) | rand32();
+}
+
+static int is_nan32(uint32_t a)
+{
+    return (a & 0x7fffffff) > 0x7f800000;
+}
+
+static int is_nan64(uint64_t a)
+{
+    return (a & ~(1ULL << 63)) > 0x7ff0000000000000ULL;
+}
+
+/* Mostly normal numbers around 1.0, plus a few special classes.  */
+static uint32_t pick32(void)
+{
+    uint32_t r = rand32();
+
+    switch (r % 16) {
+    case 0:
+        return r & 0x80000000;                          /* zero */
+    case 1:
+        return r & 0x807fffff;                          /* denormal */
+    case 2:
+        return (r & 0x80000000) | 0x7f800000;           /* infinity */
+    case 3:
+        return (r & 0x807fffff) | 0x7f000000;           /* huge */
+    case 4:
+        return (r & 0x807fffff) | 0x00800000;           /* tiny */
+    case 5:
+    case 6:
+        return r;
+    default:
+        return (r & 0x807fffff) | ((0x78 + (r >> 23) % 16) << 23);
+    }
+}
+
+static uint64_t pick64(void)
+{
+    uint64_t r = rand64();
+
+    switch (r % 16) {
+    case 0:
+        return r & (1ULL << 63);
+    case 1:
+        return r & 0x800fffffffffffffULL;
+    case 2:
+        return (r & (1ULL << 63)) | 0x7ff0000000000000ULL;
+    case 3:
+        return (r & 0x800fffffffffffffULL) | 0x7fe0000000000000ULL;
+    case 4:
+        return (r & 0x800fffffffffffffULL) | 0x0010000000000000ULL;
+    case 5:
+    case 6:
+        return r;
+    default:
+        return (r & 0x800fffffffffffffULL) |
+               ((0x3f8ULL + (r >> 52) % 16) << 52);
+    }
+}
+
+static void set_mxcsr(uint32_t mxcsr)
+{
+    asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+}
+
+#define SS_OP(insn, a, b) ({                                \
+    float fa, fb;                                           \
+    uint32_t r;                                             \
+    memcpy(&fa, &(a), 4);                                   \
+    memcpy(&fb, &(b), 4);                                   \
+    asm volatile(insn " %1, %0" : "+x" (fa) : "x" (fb));    \
+    memcpy(&r, &fa, 4);                                     \
+    r;                                                      \
+})
+
+#define SD_OP(insn, a, b) ({                                \
+    double fa, fb;                                          \
+    uint64_t r;                                             \
+    memcpy(&fa, &(a), 8);                                   \
+    memcpy(&fb, &(b), 8);                                   \
+    asm volatile(insn " %1, %0" : "+x" (fa) : "x" (fb));    \
+    memcpy(&r, &fa, 8);                                     \
+    r;                                                      \
+})
+
+static void test_ss(uint32_t a, uint32_t b)
+{
+    printf("ss %08x %08x: add %08x sub %08x mul %08x div %08x sqrt %08x\n",
+           a, b, SS_OP("addss", a, b), SS_OP("subss", a, b),
+           SS_OP("mulss", a, b), SS_OP("divss", a, b),
+           SS_OP("sqrtss", a, a));
+}
+
+static void test_sd(uint64_t a, uint64_t b)
+{
+    printf("sd %016" PRIx64 " %016" PRIx64 ": add %016" PRIx64
+           " sub %016" PRIx64 " mul %016" PRIx64 " div %016" PRIx64
+           " sqrt %016" PRIx64 "\n",
+           a, b, SD_OP("addsd", a, b), SD_OP("subsd", a, b),
+           SD_OP("mulsd", a, b), SD_OP("divsd", a, b),
+           SD_OP("sqrtsd", a, a));
+}
+
+static void test_operands(void)
+{
+    int rc, i;
+
+    for (rc = 0; rc < 4; rc++) {
+        /* all exceptions masked, DAZ and FZ clear */
+        set_mxcsr(0x1f80 | (rc << 13));
+        printf("rounding mode %d\n", rc);
+        seed = 0x12345678;
+        for (i = 0; i < N_OPERANDS; i++) {
+            uint32_t a32 = pick32(), b32 = pick32();
+            uint64_t a64 = pick64(), b64 = pick64();
+
+            if (!is_nan32(a32) && !is_nan32(b32)) {
+                test_ss(a32, b32);
+            }
+            if (!is_nan64(a64) && !is_nan64(b64)) {
+                test_sd(a64, b64);
+            }
+        }
+    }
+    set_mxcsr(0x1f80);
+}
+
+static void bench(void)
+{
+    volatile double out;
+    double x = 1.0, y = 0.0;
+    float fx = 1.0f, fy = 0.0f;
+    int i;
+
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        y = y + x * 1.0000001;
+        x = x / 1.0000001 + 1e-9;
+        fy = fy + fx * 1.0001f;
+        fx = fx / 1.0001f + 1e-6f;
+    }
+    out = x + y + fx + fy;
+    (void)out;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        bench();
+    } else {
+        test_operands();
+    }
+    return 0;
+}
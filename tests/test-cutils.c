@@ -226,6 +226,17 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static void test_pow2ceil(void)
+{
+    g_assert_cmpint(pow2ceil(0), ==, 0);
+    g_assert_cmpint(pow2ceil(1), ==, 1);
+    g_assert_cmpint(pow2ceil(2), ==, 2);
+    g_assert_cmpint(pow2ceil(3), ==, 4);
+    g_assert_cmpint(pow2ceil(64), ==, 64);
+    g_assert_cmpint(pow2ceil(65), ==, 128);
+    g_assert_cmpint(pow2ceil(0x3fffffffffffffffLL), ==, 0x4000000000000000LL);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +257,7 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/pow2ceil", test_pow2ceil);
 
     return g_test_run();
 }
@@ -0,0 +1,137 @@
+/*
+ * Resizable hash table unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/qht.h"
+
+#define N 5000
+
+static int32_t arr[N];
+
+/* A poor hash function, so that chains get exercised too.  */
+static uint32_t hash_func(int32_t v)
+{
+    return v & 0xff;
+}
+
+static bool is_equal(const void *p, const void *userp)
+{
+    const int32_t *a = p;
+    const int32_t *b = userp;
+
+    return *a == *b;
+}
+
+static void check(QHT *ht, int first, int last, bool present)
+{
+    int i;
+
+    for (i = first; i < last; i++) {
+        int32_t *p = qht_lookup(ht, is_equal, &arr[i], hash_func(arr[i]));
+
+        if (present) {
+            g_assert(p == &arr[i]);
+        } else {
+            g_assert(p == NULL);
+        }
+    }
+}
+
+static void count_func(void *p, uint32_t hash, void *userp)
+{
+    size_t *count = userp;
+
+    g_assert_cmpint(hash, ==, hash_func(*(int32_t *)p));
+    (*count)++;
+}
+
+static void check_count(QHT *ht, size_t expected)
+{
+    QHTStats stats;
+    size_t count = 0;
+
+    qht_iter(ht, count_func, &count);
+    g_assert_cmpint(count, ==, expected);
+
+    qht_statistics(ht, &stats);
+    g_assert_cmpint(stats.entries, ==, expected);
+}
+
+static void test_qht_basic(unsigned int mode)
+{
+    QHT ht;
+    int i;
+
+    for (i = 0; i < N; i++) {
+        arr[i] = i;
+    }
+
+    qht_init(&ht, 0, mode);
+    check(&ht, 0, N, false);
+
+    for (i = 0; i < N; i++) {
+        g_assert(qht_insert(&ht, &arr[i], hash_func(arr[i])));
+    }
+    g_assert(!qht_insert(&ht, &arr[10], hash_func(arr[10])));
+    check(&ht, 0, N, true);
+    check_count(&ht, N);
+
+    for (i = 0; i < N; i += 2) {
+        g_assert(qht_remove(&ht, &arr[i], hash_func(arr[i])));
+    }
+    g_assert(!qht_remove(&ht, &arr[0], hash_func(arr[0])));
+    for (i = 0; i < N; i++) {
+        int32_t *p = qht_lookup(&ht, is_equal, &arr[i], hash_func(arr[i]));
+
+        g_assert(p == (i & 1 ? &arr[i] : NULL));
+    }
+    check_count(&ht, N / 2);
+
+    qht_reset(&ht);
+    check(&ht, 0, N, false);
+    check_count(&ht, 0);
+
+    /* the table must still be usable after a reset */
+    g_assert(qht_insert(&ht, &arr[3], hash_func(arr[3])));
+    check(&ht, 3, 4, true);
+
+    qht_destroy(&ht);
+}
+
+static void test_qht_fixed(void)
+{
+    test_qht_basic(0);
+}
+
+static void test_qht_resize(void)
+{
+    QHT ht;
+    QHTStats stats;
+    int i;
+
+    test_qht_basic(QHT_MODE_AUTO_RESIZE);
+
+    qht_init(&ht, 16, QHT_MODE_AUTO_RESIZE);
+    for (i = 0; i < N; i++) {
+        arr[i] = i;
+        qht_insert(&ht, &arr[i], hash_func(arr[i]));
+    }
+    qht_statistics(&ht, &stats);
+    g_assert_cmpint(stats.resizes, >, 0);
+    g_assert_cmpint(stats.head_buckets, >=, N / 2);
+    check(&ht, 0, N, true);
+    qht_destroy(&ht);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/fixed", test_qht_fixed);
+    g_test_add_func("/qht/resize", test_qht_resize);
+    return g_test_run();
+}
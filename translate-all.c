@@ -54,11 +54,15 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "sysemu/cpus.h"
+#include "qmp-commands.h"
 #endif
 
 #include "exec/cputlb.h"
 #include "translate-all.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/tls.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -124,14 +128,254 @@ TCGContext tcg_ctx;
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
+static void tb_invalidate_phys_page_range_locked(tb_page_addr_t start,
+                                                 tb_page_addr_t end,
+                                                 int is_cpu_write_access);
 
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
 }
 
+/* TB profiler.  The records are kept across flushes, so that blocks that
+   are translated again go on being counted in the same record, and are
+   never freed, since generated code may still count into them.  Protected
+   by tb_lock.  */
+static bool tb_profile_enabled;
+static GHashTable *tb_profiles;
+
+static guint tb_profile_hash(gconstpointer key)
+{
+    const TBProfile *p = key;
+
+    return tb_hash_func(p->cs_base, p->pc, p->flags);
+}
+
+static gboolean tb_profile_equal(gconstpointer a, gconstpointer b)
+{
+    const TBProfile *pa = a, *pb = b;
+
+    return pa->pc == pb->pc && pa->cs_base == pb->cs_base &&
+           pa->flags == pb->flags;
+}
+
+/* Set the profile record of the new TB, if the profiler is running, and
+   return when its translation started.  */
+static int64_t tb_profile_start(TranslationBlock *tb)
+{
+    TBProfile key, *p;
+
+    if (!tb_profile_enabled) {
+        return 0;
+    }
+    if (!tb_profiles) {
+        tb_profiles = g_hash_table_new(tb_profile_hash, tb_profile_equal);
+    }
+    key.pc = tb->pc;
+    key.cs_base = tb->cs_base;
+    key.flags = tb->flags;
+    p = g_hash_table_lookup(tb_profiles, &key);
+    if (!p) {
+        p = g_new0(TBProfile, 1);
+        p->pc = tb->pc;
+        p->cs_base = tb->cs_base;
+        p->flags = tb->flags;
+        g_hash_table_insert(tb_profiles, p, p);
+    }
+    tb->prof = p;
+    return get_clock();
+}
+
+static void tb_profile_end(TranslationBlock *tb, int64_t start,
+                           int code_gen_size)
+{
+    TBProfile *p = tb->prof;
+
+    if (p) {
+        p->translate_ns += get_clock() - start;
+        p->guest_size = tb->size;
+        p->host_size = code_gen_size;
+    }
+}
+
+/* Have the ops of TB count its executions and helper calls if it has
+   a profile record.  Done before each translation of TB, so that
+   cpu_restore_state sees the same ops as cpu_gen_code.  */
+static void tb_profile_gen_start(TCGContext *s, TranslationBlock *tb)
+{
+    s->prof_exec_count = tb->prof ? &tb->prof->exec_count : NULL;
+    s->prof_helpers = tb->prof != NULL;
+}
+
+/* Number of params of the op C whose params start at ARGS.  */
+static inline int tcg_op_nb_params(TCGOpcode c, const TCGArg *args)
+{
+    const TCGOpDef *def = &tcg_op_defs[c];
+
+    if (c == INDEX_op_call) {
+        return 1 + (args[0] >> 16) + (args[0] & 0xffff) + def->nb_cargs;
+    }
+    return def->nb_args;
+}
+
+/* Generate the ops of the trace TB.  Each block is translated in place of
+   the jump of the previous one to it, so that the optimizer and the
+   liveness analysis work across blocks; what the previous block had after
+   that jump (its other exits) is moved after the last block.  Only the
+   exits of the last block are chained, the others go back to the main
+   loop.  The blocks are always translated as for cpu_restore_state, so
+   that the instruction boundaries can be checked, and so that both
+   produce the same ops.  Returns false if the blocks do not translate
+   the way they did when the trace was formed.  */
+static bool gen_trace_ops(CPUArchState *env, TranslationBlock *tb)
+{
+    TCGContext *s = &tcg_ctx;
+    TBTrace *trace = tb->trace;
+    TranslationBlock bt;
+    uint8_t instr_start[OPC_BUF_SIZE];
+    uint16_t *tail_opc[TB_TRACE_MAX_BLOCKS];
+    TCGArg *tail_args[TB_TRACE_MAX_BLOCKS];
+    int tail_nb_ops[TB_TRACE_MAX_BLOCKS];
+    int tail_nb_args[TB_TRACE_MAX_BLOCKS];
+    target_ulong end = tb->pc;
+    int i, j;
+
+    /* the front end is given a TB of its own, whose exits are then
+       redirected to the trace */
+    memset(&bt, 0, sizeof(bt));
+    bt.cs_base = tb->cs_base;
+    bt.flags = tb->flags;
+    tb->icount = 0;
+
+    for (i = 0; i < trace->nb_blocks; i++) {
+        bool last = i == trace->nb_blocks - 1;
+        int start = s->gen_opc_ptr - s->gen_opc_buf;
+        TCGArg *start_args = s->gen_opparam_ptr;
+        TCGArg *args, *jmp_args = NULL;
+        int nb_ops, jmp = -1;
+        int exitreq_label = -1, prev_label = -1;
+
+        /* the front end clears the instruction starts before its ops */
+        memcpy(instr_start, s->gen_opc_instr_start, start);
+        bt.pc = trace->pc[i];
+        if (i > 0) {
+            /* the trace is executed as many times as its first block */
+            s->prof_exec_count = NULL;
+        }
+        gen_intermediate_code_pc(env, &bt);
+        memcpy(s->gen_opc_instr_start, instr_start, start);
+        if (bt.size != trace->size[i]) {
+            return false;
+        }
+        end = MAX(end, bt.pc + bt.size);
+        tb->icount += bt.icount;
+
+        nb_ops = s->gen_opc_ptr - s->gen_opc_buf;
+        args = start_args;
+        for (j = start; j < nb_ops; j++) {
+            TCGOpcode c = s->gen_opc_buf[j];
+
+            if (c == INDEX_op_goto_tb && !last) {
+                if (args[0] == trace->exit[i] && jmp < 0) {
+                    jmp = j;
+                    jmp_args = args;
+                }
+                s->gen_opc_buf[j] = INDEX_op_nop1;
+            } else if (c == INDEX_op_exit_tb && args[0] != 0) {
+                switch (args[0] - (uintptr_t)&bt) {
+                case TB_EXIT_IDX0:
+                case TB_EXIT_IDX1:
+                    if (last) {
+                        args[0] = (uintptr_t)tb + (args[0] - (uintptr_t)&bt);
+                    } else {
+                        args[0] = 0;
+                    }
+                    break;
+                case TB_EXIT_REQUESTED:
+                    /* only the first block may exit before executing
+                       anything; the check of the others is removed
+                       below */
+                    if (i == 0) {
+                        args[0] = (uintptr_t)tb + TB_EXIT_REQUESTED;
+                    } else {
+                        exitreq_label = prev_label;
+                        args[0] = 0;
+                    }
+                    break;
+                default:
+                    return false;
+                }
+            }
+            prev_label = c == INDEX_op_set_label ? args[0] : -1;
+            args += tcg_op_nb_params(c, args);
+        }
+
+        if (exitreq_label >= 0) {
+            /* turn the branch to the exit into a setcond of the flag
+               temp, which has as many params and is dead */
+            args = start_args;
+            for (j = start; j < nb_ops; j++) {
+                TCGOpcode c = s->gen_opc_buf[j];
+
+                if (c == INDEX_op_brcond_i32 && args[3] == exitreq_label) {
+                    s->gen_opc_buf[j] = INDEX_op_setcond_i32;
+                    args[3] = args[2];
+                    args[2] = args[1];
+                    args[1] = args[0];
+                }
+                args += tcg_op_nb_params(c, args);
+            }
+        }
+
+        if (last) {
+            break;
+        }
+        if (jmp < 0) {
+            return false;
+        }
+        /* put aside the ops from the jump on, which must not hold
+           instruction starts since they move */
+        for (j = jmp; j < nb_ops; j++) {
+            if (s->gen_opc_instr_start[j]) {
+                return false;
+            }
+        }
+        tail_nb_ops[i] = nb_ops - jmp;
+        tail_nb_args[i] = s->gen_opparam_ptr - jmp_args;
+        tail_opc[i] = tcg_malloc(tail_nb_ops[i] * sizeof(uint16_t));
+        tail_args[i] = tcg_malloc(tail_nb_args[i] * sizeof(TCGArg));
+        memcpy(tail_opc[i], s->gen_opc_buf + jmp,
+               tail_nb_ops[i] * sizeof(uint16_t));
+        memcpy(tail_args[i], jmp_args, tail_nb_args[i] * sizeof(TCGArg));
+        s->gen_opc_ptr = s->gen_opc_buf + jmp;
+        s->gen_opparam_ptr = jmp_args;
+    }
+
+    for (i = trace->nb_blocks - 2; i >= 0; i--) {
+        if (s->gen_opc_ptr + tail_nb_ops[i] >=
+            s->gen_opc_buf + OPC_BUF_SIZE ||
+            s->gen_opparam_ptr + tail_nb_args[i] >
+            s->gen_opparam_buf + OPPARAM_BUF_SIZE) {
+            return false;
+        }
+        memset(s->gen_opc_instr_start + (s->gen_opc_ptr - s->gen_opc_buf),
+               0, tail_nb_ops[i]);
+        memcpy(s->gen_opc_ptr, tail_opc[i],
+               tail_nb_ops[i] * sizeof(uint16_t));
+        memcpy(s->gen_opparam_ptr, tail_args[i],
+               tail_nb_args[i] * sizeof(TCGArg));
+        s->gen_opc_ptr += tail_nb_ops[i];
+        s->gen_opparam_ptr += tail_nb_args[i];
+    }
+    *s->gen_opc_ptr = INDEX_op_end;
+
+    tb->size = end - tb->pc;
+    return true;
+}
+
 /* return non zero if the very first instruction is invalid so that
-   the virtual CPU can trigger an exception.
+   the virtual CPU can trigger an exception, or negative if the blocks
+   of a trace could not be translated again.
 
    '*gen_code_size_ptr' contains the size of the generated code (host
    code).
@@ -151,8 +395,22 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    tb_profile_gen_start(s, tb);
 
-    gen_intermediate_code(env, tb);
+    if (tb->trace) {
+        if (!gen_trace_ops(env, tb)) {
+            return -1;
+        }
+    } else {
+#ifdef CONFIG_LINUX_USER
+        if (!tb_cache_gen_code(env, tb)) {
+            gen_intermediate_code(env, tb);
+            tb_cache_add(env, tb);
+        }
+#else
+        gen_intermediate_code(env, tb);
+#endif
+    }
 
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
@@ -207,8 +465,15 @@ static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    tb_profile_gen_start(s, tb);
 
-    gen_intermediate_code_pc(env, tb);
+    if (tb->trace) {
+        if (!gen_trace_ops(env, tb)) {
+            return -1;
+        }
+    } else {
+        gen_intermediate_code_pc(env, tb);
+    }
 
     if (use_icount) {
         /* Reset the cycle counter to the start of the block.  */
@@ -248,14 +513,27 @@ static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
     return 0;
 }
 
+/* For callers that cannot go on without the state: a trace whose guest
+   code no longer translates to the same blocks has none.  */
+static void cpu_restore_state_from_tb_nofail(TranslationBlock *tb,
+                                             CPUArchState *env,
+                                             uintptr_t searched_pc)
+{
+    if (cpu_restore_state_from_tb(tb, env, searched_pc) < 0) {
+        cpu_abort(env, "could not restore the state of TB %p for pc=%p",
+                  tb, (void *)searched_pc);
+    }
+}
+
+/* Returns false if retaddr is not in translated code, or if the state
+   there could not be restored.  */
 bool cpu_restore_state(CPUArchState *env, uintptr_t retaddr)
 {
     TranslationBlock *tb;
 
     tb = tb_find_pc(retaddr);
     if (tb) {
-        cpu_restore_state_from_tb(tb, env, retaddr);
-        return true;
+        return cpu_restore_state_from_tb(tb, env, retaddr) == 0;
     }
     return false;
 }
@@ -555,6 +833,39 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+/* Split the code buffer into regions.  Each region must leave room for
+   the largest possible TB past its threshold, and recycling a region is
+   only worthwhile if it holds a good share of the buffer, so small
+   buffers get fewer regions.  */
+static void code_gen_alloc_regions(void)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    size_t max_tb_size = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    int max_tbs, i;
+
+    tb_ctx->n_regions = MIN(CODE_GEN_MAX_REGIONS,
+                            tcg_ctx.code_gen_buffer_size / (4 * max_tb_size));
+    tb_ctx->n_regions = MAX(tb_ctx->n_regions, 1);
+    tb_ctx->region_size = (tcg_ctx.code_gen_buffer_size / tb_ctx->n_regions) &
+                          ~(size_t)(CODE_GEN_ALIGN - 1);
+
+    max_tbs = tb_ctx->region_size / CODE_GEN_AVG_BLOCK_SIZE;
+    tb_ctx->tbs = g_malloc(tb_ctx->n_regions * max_tbs *
+                           sizeof(TranslationBlock));
+
+    for (i = 0; i < tb_ctx->n_regions; i++) {
+        TBRegion *r = &tb_ctx->regions[i];
+
+        r->start = tcg_ctx.code_gen_buffer + i * tb_ctx->region_size;
+        r->end = r->start + tb_ctx->region_size - max_tb_size;
+        r->ptr = r->start;
+        r->tbs = &tb_ctx->tbs[i * max_tbs];
+        r->nb_tbs = 0;
+        r->max_tbs = max_tbs;
+    }
+    tb_ctx->cur_region = 0;
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -576,12 +887,53 @@ static inline void code_gen_alloc(size_t tb_size)
             tcg_ctx.code_gen_buffer_size - 1024;
     tcg_ctx.code_gen_buffer_size -= 1024;
 
-    tcg_ctx.code_gen_buffer_max_size = tcg_ctx.code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
-    tcg_ctx.code_gen_max_blocks = tcg_ctx.code_gen_buffer_size /
-            CODE_GEN_AVG_BLOCK_SIZE;
-    tcg_ctx.tb_ctx.tbs =
-            g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    code_gen_alloc_regions();
+}
+
+#if !defined(CONFIG_USER_ONLY)
+/* With a single TCG thread the BQL already serializes everything, so this
+   is only taken in multi-threaded mode.  */
+static QemuMutex tb_mutex;
+#endif
+static DEFINE_TLS(bool, have_tb_lock);
+
+void tb_lock(void)
+{
+#if defined(CONFIG_USER_ONLY)
+    assert(!tls_var(have_tb_lock));
+    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+#else
+    if (!qemu_tcg_mttcg_enabled()) {
+        return;
+    }
+    assert(!tls_var(have_tb_lock));
+    qemu_mutex_lock(&tb_mutex);
+#endif
+    tls_var(have_tb_lock) = true;
+}
+
+void tb_unlock(void)
+{
+#if defined(CONFIG_USER_ONLY)
+    assert(tls_var(have_tb_lock));
+    tls_var(have_tb_lock) = false;
+    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+#else
+    if (!qemu_tcg_mttcg_enabled()) {
+        return;
+    }
+    assert(tls_var(have_tb_lock));
+    tls_var(have_tb_lock) = false;
+    qemu_mutex_unlock(&tb_mutex);
+#endif
+}
+
+/* Release the lock if we longjmp'ed out of a section holding it.  */
+void tb_lock_reset(void)
+{
+    if (tls_var(have_tb_lock)) {
+        tb_unlock();
+    }
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -589,9 +941,13 @@ static inline void code_gen_alloc(size_t tb_size)
    size. */
 void tcg_exec_init(unsigned long tb_size)
 {
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+#endif
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE,
+             QHT_MODE_AUTO_RESIZE);
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
@@ -606,35 +962,77 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+static inline TBRegion *tb_cur_region(void)
+{
+    return &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+}
+
+static inline bool tb_region_full(TBRegion *r)
+{
+    return r->nb_tbs >= r->max_tbs || r->ptr >= r->end;
+}
+
+/* Allocate a new translation block in the current region.  Returns NULL
+   if the region has too many translation blocks or too much generated
+   code, in which case the next region must be recycled. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = tb_cur_region();
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (tb_region_full(r)) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->exit_count[0] = 0;
+    tb->exit_count[1] = 0;
+    tb->trace = NULL;
+    tb->prof = NULL;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = tb_cur_region();
+
+    g_free(tb->trace);
+    tb->trace = NULL;
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
-        tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
+        r->ptr = tb->tc_ptr;
+        r->nb_tbs--;
     }
 }
 
+static inline int tb_count(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < tcg_ctx.tb_ctx.n_regions; i++) {
+        n += tcg_ctx.tb_ctx.regions[i].nb_tbs;
+    }
+    return n;
+}
+
+static inline size_t tb_code_size(void)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < tcg_ctx.tb_ctx.n_regions; i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+        size += r->ptr - r->start;
+    }
+    return size;
+}
+
 static inline void invalidate_page_bitmap(PageDesc *p)
 {
     if (p->code_bitmap) {
@@ -677,24 +1075,37 @@ static void page_flush_tb(void)
     }
 }
 
+static void tb_free_traces(TBRegion *r)
+{
+    int i;
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        g_free(r->tbs[i].trace);
+    }
+}
+
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+static void do_tb_flush(CPUArchState *env1)
 {
     CPUState *cpu;
+    int i;
 
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
-           tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+    printf("qemu: flush code_size=%zd nb_tbs=%d avg_tb_size=%zd\n",
+           tb_code_size(), tb_count(),
+           tb_count() > 0 ? tb_code_size() / tb_count() : 0);
 #endif
-    if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
-        > tcg_ctx.code_gen_buffer_size) {
-        cpu_abort(env1, "Internal error: code buffer overflow\n");
+    for (i = 0; i < tcg_ctx.tb_ctx.n_regions; i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+        if (r->ptr > r->start + tcg_ctx.tb_ctx.region_size) {
+            cpu_abort(env1, "Internal error: code buffer overflow\n");
+        }
+        tb_free_traces(r);
+        r->ptr = r->start;
+        r->nb_tbs = 0;
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
+    tcg_ctx.tb_ctx.cur_region = 0;
 
     CPU_FOREACH(cpu) {
         CPUArchState *env = cpu->env_ptr;
@@ -702,71 +1113,131 @@ void tb_flush(CPUArchState *env1)
         memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0,
-            CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+    qht_reset(&tcg_ctx.tb_ctx.htable);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+    tcg_ctx.tb_ctx.recycle_pending = false;
+    tcg_ctx.tb_ctx.flush_pending = false;
 }
 
-#ifdef DEBUG_TB_CHECK
+void tb_flush(CPUArchState *env1)
+{
+#if defined(CONFIG_USER_ONLY)
+    /* Other threads may be executing TBs or looking them up without
+       tb_lock, so the flush is left pending; the CPU does it when it
+       leaves cpu_exec, with the other threads stopped.  */
+    tcg_ctx.tb_ctx.flush_pending = true;
+    cpu_exit(ENV_GET_CPU(env1));
+#else
+    do_tb_flush(env1);
+#endif
+}
 
-static void tb_invalidate_check(target_ulong address)
+/* Switch code generation to the next region, invalidating the TBs it
+   holds.  Jumps from TBs of other regions into it are reset by
+   tb_phys_invalidate().  */
+static void tb_recycle(void)
 {
-    TranslationBlock *tb;
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
     int i;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
+    tb_ctx->cur_region = (tb_ctx->cur_region + 1) % tb_ctx->n_regions;
+    r = tb_cur_region();
+#if defined(DEBUG_FLUSH)
+    printf("qemu: recycle region %d code_size=%td nb_tbs=%d\n",
+           tb_ctx->cur_region, r->ptr - r->start, r->nb_tbs);
+#endif
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
         }
     }
+    tb_free_traces(r);
+    r->ptr = r->start;
+    r->nb_tbs = 0;
+
+    tb_ctx->tb_recycle_count++;
+    tb_ctx->recycle_pending = false;
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+/* In multi-threaded mode and in user mode tb_gen_code cannot recycle a
+   region itself, since other vCPUs may be executing from it.  It leaves
+   the recycling pending instead and exits; the vCPU thread then stops all
+   the others and calls tb_recycle_deferred().  Flushes requested from
+   outside the vCPU threads, and all flushes in user mode, are deferred
+   the same way.  */
+static inline bool tb_recycle_must_defer(void)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
+#if defined(CONFIG_USER_ONLY)
+    return true;
+#else
+    return qemu_tcg_mttcg_enabled();
+#endif
+}
+
+bool tb_recycle_pending(void)
+{
+    return tcg_ctx.tb_ctx.recycle_pending || tcg_ctx.tb_ctx.flush_pending;
+}
+
+void tb_recycle_deferred(CPUArchState *env)
+{
+    tb_lock();
+    /* another vCPU may have got there first */
+    if (tcg_ctx.tb_ctx.flush_pending) {
+        do_tb_flush(env);
+    } else if (tcg_ctx.tb_ctx.recycle_pending) {
+        tb_recycle();
+    }
+    tb_unlock();
+}
+
+#ifdef DEBUG_TB_CHECK
+
+static void do_tb_invalidate_check(void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
+
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
     }
 }
 
-#endif
+static void tb_invalidate_check(target_ulong address)
+{
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
+}
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static void do_tb_page_check(void *p, uint32_t hash, void *userp)
 {
-    TranslationBlock *tb1;
+    TranslationBlock *tb = p;
+    int flags1, flags2;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -829,10 +1300,13 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    /* lookups racing with us must not return it */
+    tb->invalid = true;
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb,
+               tb_hash_func(phys_pc, tb->pc, tb->flags));
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -846,13 +1320,12 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         invalidate_page_bitmap(p);
     }
 
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
-
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
         CPUArchState *env = cpu->env_ptr;
 
+        cpu->tb_invalidated_flag = true;
         if (env->tb_jmp_cache[h] == tb) {
             env->tb_jmp_cache[h] = NULL;
         }
@@ -940,30 +1413,43 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
 {
+    CPUState *cpu;
     TranslationBlock *tb;
+    TBRegion *r;
     uint8_t *tc_ptr;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    int64_t ti;
 
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        if (tb_recycle_must_defer()) {
+            tcg_ctx.tb_ctx.recycle_pending = true;
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+        /* the oldest region must be recycled */
+        tb_recycle();
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
-        tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
+        CPU_FOREACH(cpu) {
+            cpu->tb_invalidated_flag = true;
+        }
     }
-    tc_ptr = tcg_ctx.code_gen_ptr;
+    r = tb_cur_region();
+    tc_ptr = r->ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    ti = tb_profile_start(tb);
     cpu_gen_code(env, tb, &code_gen_size);
-    tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
-            code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    tb_profile_end(tb, ti, code_gen_size);
+    r->ptr = (void *)(((uintptr_t)r->ptr + code_gen_size +
+                       CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -975,6 +1461,82 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     return tb;
 }
 
+/* Replace HEAD, whose exits have been counted, by a trace following its
+   hottest exits, if they are taken often enough.  The blocks of a trace
+   must be in the page of HEAD and not before it, so that the trace has
+   a single range of guest code and can be chained to.  Returns the trace
+   or NULL.  Called with tb_lock held, and in system emulation with the
+   BQL (for get_page_addr_code).  */
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *head)
+{
+    TranslationBlock *tb, *b = head;
+    TBTrace *trace;
+    TBRegion *r;
+    int code_gen_size;
+    int64_t ti;
+
+    if (head->invalid || head->trace || head->cflags ||
+        head->page_addr[1] != -1) {
+        return NULL;
+    }
+
+    trace = g_new0(TBTrace, 1);
+    for (;;) {
+        int total = b->exit_count[0] + b->exit_count[1];
+        int hot = b->exit_count[1] > b->exit_count[0];
+        TranslationBlock *next;
+
+        trace->pc[trace->nb_blocks] = b->pc;
+        trace->size[trace->nb_blocks] = b->size;
+        trace->exit[trace->nb_blocks] = hot;
+        trace->nb_blocks++;
+        if (trace->nb_blocks == TB_TRACE_MAX_BLOCKS ||
+            total < TB_TRACE_THRESHOLD || b->exit_count[hot] * 4 < total * 3) {
+            break;
+        }
+        next = tb_htable_lookup(env, b->exit_pc[hot], head->cs_base,
+                                head->flags);
+        if (!next || next->trace || next->cflags ||
+            next->pc < head->pc ||
+            (next->pc & TARGET_PAGE_MASK) != (head->pc & TARGET_PAGE_MASK) ||
+            next->page_addr[1] != -1) {
+            break;
+        }
+        b = next;
+    }
+    if (trace->nb_blocks < 2) {
+        g_free(trace);
+        return NULL;
+    }
+
+    /* do not recycle a region for this, the TBs at hand could go */
+    tb = tb_alloc(head->pc);
+    if (!tb) {
+        g_free(trace);
+        return NULL;
+    }
+    r = tb_cur_region();
+    tb->tc_ptr = r->ptr;
+    tb->cs_base = head->cs_base;
+    tb->flags = head->flags;
+    tb->trace = trace;
+    ti = tb_profile_start(tb);
+    if (cpu_gen_code(env, tb, &code_gen_size) < 0) {
+        tb_free(tb);
+        return NULL;
+    }
+    tb_profile_end(tb, ti, code_gen_size);
+    r->ptr = (void *)(((uintptr_t)r->ptr + code_gen_size +
+                       CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    /* a trace is never part of another one */
+    tb->exit_count[0] = TB_TRACE_THRESHOLD;
+
+    tb_phys_invalidate(head, -1);
+    tb_link_page(tb, get_page_addr_code(env, tb->pc), -1);
+    tcg_ctx.tb_ctx.tb_trace_count++;
+    return tb;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1001,6 +1563,16 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
  */
 void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                                    int is_cpu_write_access)
+{
+    tb_lock();
+    tb_invalidate_phys_page_range_locked(start, end, is_cpu_write_access);
+    tb_unlock();
+}
+
+/* Same as above, but the caller must hold tb_lock.  */
+static void tb_invalidate_phys_page_range_locked(tb_page_addr_t start,
+                                                 tb_page_addr_t end,
+                                                 int is_cpu_write_access)
 {
     TranslationBlock *tb, *tb_next, *saved_tb;
     CPUState *cpu = current_cpu;
@@ -1072,7 +1644,8 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                 restore the CPU state */
 
                 current_tb_modified = 1;
-                cpu_restore_state_from_tb(current_tb, env, env->mem_io_pc);
+                cpu_restore_state_from_tb_nofail(current_tb, env,
+                                                 env->mem_io_pc);
                 cpu_get_tb_cpu_state(env, &current_pc, &current_cs_base,
                                      &current_flags);
             }
@@ -1130,8 +1703,10 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   (intptr_t)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    tb_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_unlock();
         return;
     }
     if (p->code_bitmap) {
@@ -1142,8 +1717,9 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
         }
     } else {
     do_invalidate:
-        tb_invalidate_phys_page_range(start, start + len, 1);
+        tb_invalidate_phys_page_range_locked(start, start + len, 1);
     }
+    tb_unlock();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1191,7 +1767,7 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
                    restore the CPU state */
 
             current_tb_modified = 1;
-            cpu_restore_state_from_tb(current_tb, env, pc);
+            cpu_restore_state_from_tb_nofail(current_tb, env, pc);
             cpu_get_tb_cpu_state(env, &current_pc, &current_cs_base,
                                  &current_flags);
         }
@@ -1206,7 +1782,14 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
            modifying the memory. It will ensure that it cannot modify
            itself */
         cpu->current_tb = NULL;
-        tb_gen_code(env, current_pc, current_cs_base, current_flags, 1);
+        if (tb_region_full(tb_cur_region())) {
+            /* tb_gen_code cannot leave the signal handler to have the
+               region recycled; translate again from cpu_exec, which will
+               do it.  */
+            tcg_ctx.tb_ctx.recycle_pending = true;
+        } else {
+            tb_gen_code(env, current_pc, current_cs_base, current_flags, 1);
+        }
         if (locked) {
             mmap_unlock();
         }
@@ -1280,17 +1863,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1312,6 +1887,11 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the hash table last: lookups do not take tb_lock, and must
+       only find TBs that are completely set up */
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb,
+               tb_hash_func(phys_pc, tb->pc, tb->flags));
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1323,7 +1903,7 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 bool is_tcg_gen_code(uintptr_t tc_ptr)
 {
     /* This can be called during code generation, code_gen_buffer_size
-       is used instead of code_gen_ptr for upper boundary checking */
+       is used instead of the region cursors for upper boundary checking */
     return (tc_ptr >= (uintptr_t)tcg_ctx.code_gen_buffer &&
             tc_ptr < (uintptr_t)(tcg_ctx.code_gen_buffer +
                     tcg_ctx.code_gen_buffer_size));
@@ -1336,21 +1916,28 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
     int m_min, m_max, m;
     uintptr_t v;
+    size_t region;
+    TBRegion *r;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    region = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) /
+             tcg_ctx.tb_ctx.region_size;
+    if (region >= tcg_ctx.tb_ctx.n_regions) {
+        return NULL;
+    }
+    r = &tcg_ctx.tb_ctx.regions[region];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)r->ptr) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1360,7 +1947,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1381,6 +1968,7 @@ void tb_invalidate_phys_addr(hwaddr addr)
 }
 #endif /* TARGET_HAS_ICE && !defined(CONFIG_USER_ONLY) */
 
+/* Called with tb_lock held; the caller longjmps out of the current TB.  */
 void tb_check_watchpoint(CPUArchState *env)
 {
     TranslationBlock *tb;
@@ -1390,7 +1978,7 @@ void tb_check_watchpoint(CPUArchState *env)
         cpu_abort(env, "check_watchpoint: could not find TB for pc=%p",
                   (void *)env->mem_io_pc);
     }
-    cpu_restore_state_from_tb(tb, env, env->mem_io_pc);
+    cpu_restore_state_from_tb_nofail(tb, env, env->mem_io_pc);
     tb_phys_invalidate(tb, -1);
 }
 
@@ -1435,13 +2023,14 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(env, "cpu_io_recompile: could not find TB for pc=%p",
                   (void *)retaddr);
     }
     n = env->icount_decr.u16.low + tb->icount;
-    cpu_restore_state_from_tb(tb, env, retaddr);
+    cpu_restore_state_from_tb_nofail(tb, env, retaddr);
     /* Calculate how many instructions had been executed before the fault
        occurred.  */
     n = n - env->icount_decr.u16.low;
@@ -1478,11 +2067,19 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     /* FIXME: In theory this could raise an exception.  In practice
        we have already translated the block once so it's probably ok.  */
     tb_gen_code(env, pc, cs_base, flags, cflags);
-    /* TODO: If env->pc != tb->pc (i.e. the faulting instruction was not
-       the first in the TB) then we end up generating a whole new TB and
-       repeating the fault, which is horribly inefficient.
-       Better would be to execute just this insn uncached, or generate a
-       second new TB.  */
+#if !defined(TARGET_MIPS) && !defined(TARGET_SH4)
+    /* Execution resumes at the I/O insn.  If it was not the first in the
+       TB, also translate the TB that starts there with just that insn, so
+       that the lookup finds it instead of translating a whole new TB that
+       would fault and be recompiled in turn.  Both stay cached for the
+       next time.  */
+    if (n > 1) {
+        int io_flags;
+
+        cpu_get_tb_cpu_state(env, &pc, &cs_base, &io_flags);
+        tb_gen_code(env, pc, cs_base, io_flags, 1 | CF_LAST_IO);
+    }
+#endif
     cpu_resume_from_signal(env, NULL);
 }
 
@@ -1501,10 +2098,34 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
            TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
+static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf)
+{
+    QHTStats st;
+
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &st);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%zu%% head buckets used)\n",
+                st.used_head_buckets, st.head_buckets,
+                st.head_buckets ?
+                st.used_head_buckets * 100 / st.head_buckets : 0);
+    cpu_fprintf(f, "TB hash avg chain   %0.2f buckets (max=%zu), "
+                "%0.2f TBs/used bucket\n",
+                st.used_head_buckets ?
+                (double)st.chain_buckets / st.used_head_buckets : 0.0,
+                st.max_chain,
+                st.used_head_buckets ?
+                (double)st.entries / st.used_head_buckets : 0.0);
+    cpu_fprintf(f, "TB hash resizes     %u\n", st.resizes);
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    CPUState *cpu;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int nb_tbs, max_tbs;
+    size_t code_size, max_code_size;
+    uint64_t victim_hits, victim_misses;
     TranslationBlock *tb;
 
     target_code_size = 0;
@@ -1512,58 +2133,218 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    nb_tbs = tb_count();
+    max_tbs = 0;
+    code_size = tb_code_size();
+    max_code_size = 0;
+    for (i = 0; i < tb_ctx->n_regions; i++) {
+        TBRegion *r = &tb_ctx->regions[i];
+
+        max_tbs += r->max_tbs;
+        max_code_size += r->end - r->start;
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &r->tbs[j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
-    cpu_fprintf(f, "TB count            %d/%d\n",
-            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n", code_size, max_code_size);
+    cpu_fprintf(f, "code regions        %d of %zd bytes (current=%d)\n",
+                tb_ctx->n_regions, tb_ctx->region_size, tb_ctx->cur_region);
+    cpu_fprintf(f, "TB count            %d/%d\n", nb_tbs, max_tbs);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
-            tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
-                    tcg_ctx.tb_ctx.nb_tbs : 0,
+            nb_tbs ? target_code_size / nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            nb_tbs ? code_size / nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
-            tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
-                                    tcg_ctx.tb_ctx.nb_tbs : 0);
+            nb_tbs ? (cross_page * 100) / nb_tbs : 0);
     cpu_fprintf(f, "direct jump count   %d (%d%%) (2 jumps=%d %d%%)\n",
                 direct_jmp_count,
-                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp_count * 100) /
-                        tcg_ctx.tb_ctx.nb_tbs : 0,
+                nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
-                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
-                        tcg_ctx.tb_ctx.nb_tbs : 0);
+                nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+    print_qht_statistics(f, cpu_fprintf);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB recycle count    %d\n",
+            tcg_ctx.tb_ctx.tb_recycle_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB trace count      %d\n", tcg_ctx.tb_ctx.tb_trace_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    victim_hits = 0;
+    victim_misses = 0;
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        for (i = 0; i < NB_MMU_MODES; i++) {
+            victim_hits += atomic_read(&env->tlb_d[i].victim_hits);
+            victim_misses += atomic_read(&env->tlb_d[i].victim_misses);
+        }
+    }
+    cpu_fprintf(f, "TLB victim hits     %" PRIu64 " (%d%% of misses)\n",
+                victim_hits,
+                victim_hits + victim_misses ?
+                (int)(victim_hits * 100 / (victim_hits + victim_misses)) : 0);
+    cpu_fprintf(f, "TLB victim misses   %" PRIu64 "\n", victim_misses);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+/* Flush all the TBs, from outside the vCPU threads.  In multi-threaded
+   mode the vCPUs are made to do it, see tb_recycle_deferred().  */
+static void tb_flush_all(void)
+{
+    CPUState *cpu;
+
+    if (qemu_tcg_mttcg_enabled()) {
+        tcg_ctx.tb_ctx.flush_pending = true;
+        CPU_FOREACH(cpu) {
+            cpu_exit(cpu);
+        }
+        return;
+    }
+    tb_lock();
+    do_tb_flush(first_cpu->env_ptr);
+    tb_unlock();
+}
+
+static void tb_profile_reset(gpointer key, gpointer value, gpointer opaque)
+{
+    TBProfile *p = value;
+
+    p->exec_count = 0;
+    p->translate_ns = 0;
+}
+
+void qmp_tb_profile(bool enable, Error **errp)
+{
+    bool changed;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "TB profiling requires TCG");
+        return;
+    }
+    tb_lock();
+    if (enable) {
+        if (tb_profiles) {
+            g_hash_table_foreach(tb_profiles, tb_profile_reset, NULL);
+        }
+        tcg_helper_profile_reset();
+    }
+    changed = enable != tb_profile_enabled;
+    tb_profile_enabled = enable;
+    tb_unlock();
+
+    /* translate everything again, with or without the counters */
+    if (changed) {
+        tb_flush_all();
+    }
+}
+
+static gint tb_profile_block_cmp(gconstpointer a, gconstpointer b)
+{
+    const TBProfile *pa = *(TBProfile * const *)a;
+    const TBProfile *pb = *(TBProfile * const *)b;
+
+    return pa->exec_count < pb->exec_count ? 1 :
+           pa->exec_count > pb->exec_count ? -1 : 0;
+}
+
+static gint tb_profile_helper_cmp(gconstpointer a, gconstpointer b)
+{
+    const TbProfileHelperInfo *ha = *(TbProfileHelperInfo * const *)a;
+    const TbProfileHelperInfo *hb = *(TbProfileHelperInfo * const *)b;
+
+    return ha->call_count < hb->call_count ? 1 :
+           ha->call_count > hb->call_count ? -1 : 0;
+}
+
+static void tb_profile_add_helper(const char *name, uint64_t count,
+                                  void *opaque)
+{
+    TbProfileHelperInfo *helper = g_new0(TbProfileHelperInfo, 1);
+
+    helper->name = g_strdup(name);
+    helper->call_count = count;
+    g_ptr_array_add(opaque, helper);
+}
+
+TbProfileInfo *qmp_query_tb_profile(bool has_max, int64_t max, Error **errp)
+{
+    TbProfileInfo *info = g_new0(TbProfileInfo, 1);
+    GPtrArray *blocks = g_ptr_array_new();
+    GPtrArray *helpers = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer value;
+    int64_t i;
+
+    if (!has_max) {
+        max = 20;
+    }
+
+    tb_lock();
+    info->enabled = tb_profile_enabled;
+    if (tb_profiles) {
+        g_hash_table_iter_init(&iter, tb_profiles);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            if (((TBProfile *)value)->exec_count) {
+                g_ptr_array_add(blocks, value);
+            }
+        }
+    }
+    g_ptr_array_sort(blocks, tb_profile_block_cmp);
+    /* the list is built backwards */
+    for (i = MIN(max, (int64_t)blocks->len) - 1; i >= 0; i--) {
+        TBProfile *p = g_ptr_array_index(blocks, i);
+        TbProfileBlockInfoList *entry = g_new0(TbProfileBlockInfoList, 1);
+
+        entry->value = g_new0(TbProfileBlockInfo, 1);
+        entry->value->pc = p->pc;
+        entry->value->exec_count = p->exec_count;
+        entry->value->guest_size = p->guest_size;
+        entry->value->host_size = p->host_size;
+        entry->value->translate_ns = p->translate_ns;
+        entry->next = info->blocks;
+        info->blocks = entry;
+    }
+    tcg_helper_profile_foreach(tb_profile_add_helper, helpers);
+    tb_unlock();
+
+    g_ptr_array_sort(helpers, tb_profile_helper_cmp);
+    for (i = (int64_t)helpers->len - 1; i >= 0; i--) {
+        TbProfileHelperInfo *helper = g_ptr_array_index(helpers, i);
+        TbProfileHelperInfoList *entry;
+
+        if (i >= max) {
+            qapi_free_TbProfileHelperInfo(helper);
+            continue;
+        }
+        entry = g_new0(TbProfileHelperInfoList, 1);
+        entry->value = helper;
+        entry->next = info->helpers;
+        info->helpers = entry;
+    }
+
+    g_ptr_array_free(blocks, TRUE);
+    g_ptr_array_free(helpers, TRUE);
+    return info;
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -21,6 +21,7 @@
 #include "disas/disas.h"
 #include "tcg.h"
 #include "qemu/bitops.h"
+#include "qemu/atomic.h"
 
 #undef EAX
 #undef ECX
@@ -120,6 +121,65 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
     return 1;
 }
 
+/* Atomic operations on guest memory, for the tcg_gen_atomic_* ops.  */
+
+/* only the accesses that cannot use host atomics take it */
+static spinlock_t atomic_slow_spin = SPIN_LOCK_UNLOCKED;
+
+static inline bool atomic_slow_lock(void)
+{
+    spin_lock(&atomic_slow_spin);
+    return true;
+}
+
+static inline void atomic_slow_unlock(bool locked)
+{
+    spin_unlock(&atomic_slow_spin);
+}
+
+/* Guest memory is accessed directly, so just check that the pages are
+   writable: a fault within the helper could not be attributed to the
+   guest instruction.  Pages that are write protected because they hold
+   translated code are still PAGE_WRITE_ORG, and handled by
+   page_unprotect() when the host atomic instruction faults.  */
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               int size, int mmu_idx, uintptr_t retaddr)
+{
+    target_ulong fault_addr = addr;
+
+    if (!(page_get_flags(addr) & PAGE_WRITE_ORG)) {
+        goto fault;
+    }
+    fault_addr = addr + size - 1;
+    if (((addr ^ fault_addr) & TARGET_PAGE_MASK)
+        && !(page_get_flags(fault_addr) & PAGE_WRITE_ORG)) {
+        goto fault;
+    }
+    return g2h(addr);
+
+ fault:
+    cpu_handle_mmu_fault(env, fault_addr, 1, MMU_USER_IDX);
+    if (!cpu_restore_state(env, retaddr - GETPC_ADJ)) {
+        cpu_abort(env, "atomic_mmu_lookup: could not restore the state "
+                  "for pc=%p", (void *)retaddr);
+    }
+    exception_action(env);
+    /* never comes here */
+    return NULL;
+}
+
+#define SHIFT 0
+#include "exec/atomic_template.h"
+
+#define SHIFT 1
+#include "exec/atomic_template.h"
+
+#define SHIFT 2
+#include "exec/atomic_template.h"
+
+#define SHIFT 3
+#include "exec/atomic_template.h"
+
 #if defined(__i386__)
 
 #if defined(__APPLE__)
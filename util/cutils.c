@@ -475,6 +475,15 @@ int64_t pow2floor(int64_t value)
     return value;
 }
 
+/* round up to the nearest power of 2 (0 for 0) */
+int64_t pow2ceil(int64_t value)
+{
+    if (value <= 1) {
+        return value;
+    }
+    return 0x8000000000000000ULL >> (clz64(value - 1) - 1);
+}
+
 /*
  * Implementation of  ULEB128 (http://en.wikipedia.org/wiki/LEB128)
  * Input is limited to 14-bit numbers
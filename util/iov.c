@@ -380,6 +380,32 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
     return iov_memset(qiov->iov, qiov->niov, offset, fillc, bytes);
 }
 
+/*
+ * Checks if all bytes of the vector are zero, using the vectorized
+ * buffer_is_zero() for the bulk of each element.
+ */
+bool qemu_iovec_is_zero(QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        const uint8_t *ptr = qiov->iov[i].iov_base;
+        size_t len = qiov->iov[i].iov_len;
+        size_t offs = len & ~(4 * sizeof(long) - 1);
+
+        if (offs && !buffer_is_zero(ptr, offs)) {
+            return false;
+        }
+        for (; offs < len; offs++) {
+            if (ptr[offs]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 size_t iov_discard_front(struct iovec **iov, unsigned int *iov_cnt,
                          size_t bytes)
 {
@@ -0,0 +1,356 @@
+/*
+ * Resizable hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <assert.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/qht.h"
+
+/* The table is an array of head buckets, each holding a few entries and
+ * a pointer to a chain of overflow buckets.  An entry is a hash and an
+ * object pointer; a NULL pointer marks a free slot.
+ *
+ * Writers are serialized by ht->lock.  They fill a slot by storing the
+ * hash before the pointer, and empty it by clearing the pointer, so a
+ * lookup that sees a pointer always sees a valid object (the hash being
+ * only a hint, the comparison function is the authority).  Entries are
+ * never moved within a map.
+ *
+ * A resize builds a new map and publishes it with a single pointer
+ * store.  Lookups already walking the old map can keep doing so, which
+ * is why retired maps are kept until qht_reset() (their entries are
+ * still cleared by qht_remove()).  The maps double in size, so the
+ * retired ones never take more memory than the current one.
+ */
+
+/* Buckets take a cache line each, so that a lookup touches a single line
+ * per bucket and buckets are not shared between cache lines.  Two more
+ * entries fit in a line with 32-bit pointers.
+ */
+#define QHT_BUCKET_ALIGN 64
+
+#if HOST_LONG_BITS == 32
+#define QHT_BUCKET_ENTRIES 6
+#else
+#define QHT_BUCKET_ENTRIES 4
+#endif
+
+/* average number of entries per head bucket above which the table grows */
+#define QHT_MAX_LOAD 2
+
+typedef struct QHTBucket QHTBucket;
+
+struct QHTBucket {
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    QHTBucket *next;
+} QEMU_ALIGNED(QHT_BUCKET_ALIGN);
+
+QEMU_BUILD_BUG_ON(sizeof(QHTBucket) != QHT_BUCKET_ALIGN);
+
+struct QHTMap {
+    QHTBucket *buckets;
+    size_t n_buckets;
+    QHTMap *retired_next;
+};
+
+/* malloc only guarantees the alignment of the basic types */
+static QHTBucket *qht_bucket_alloc(size_t n)
+{
+    QHTBucket *b = qemu_memalign(QHT_BUCKET_ALIGN, n * sizeof(QHTBucket));
+
+    memset(b, 0, n * sizeof(QHTBucket));
+    return b;
+}
+
+static QHTMap *qht_map_create(size_t n_buckets)
+{
+    QHTMap *map = g_new0(QHTMap, 1);
+
+    map->n_buckets = n_buckets;
+    map->buckets = qht_bucket_alloc(n_buckets);
+    return map;
+}
+
+static void qht_map_destroy(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = map->buckets[i].next;
+
+        while (b) {
+            QHTBucket *next = b->next;
+
+            qemu_vfree(b);
+            b = next;
+        }
+    }
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+static inline QHTBucket *qht_map_to_bucket(QHTMap *map, uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode)
+{
+    size_t n_buckets = pow2ceil(n_elems / QHT_MAX_LOAD);
+
+    memset(ht, 0, sizeof(*ht));
+    ht->mode = mode;
+    qemu_mutex_init(&ht->lock);
+    ht->map = qht_map_create(MAX(n_buckets, 1));
+}
+
+void qht_destroy(QHT *ht)
+{
+    qht_reset(ht);
+    qht_map_destroy(ht->map);
+    qemu_mutex_destroy(&ht->lock);
+}
+
+void *qht_lookup(QHT *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash)
+{
+    QHTMap *map;
+    QHTBucket *b;
+    int i;
+
+    map = atomic_read(&ht->map);
+    smp_read_barrier_depends();
+    b = qht_map_to_bucket(map, hash);
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (atomic_read(&b->hashes[i]) == hash) {
+                void *p = atomic_read(&b->pointers[i]);
+
+                smp_read_barrier_depends();
+                if (p && func(p, userp)) {
+                    return p;
+                }
+            }
+        }
+        b = atomic_read(&b->next);
+        smp_read_barrier_depends();
+    } while (b);
+
+    return NULL;
+}
+
+/* Called with ht->lock held, or on a map not visible yet.  */
+static void qht_map_insert(QHTMap *map, void *p, uint32_t hash)
+{
+    QHTBucket *b = qht_map_to_bucket(map, hash);
+    QHTBucket *prev = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                atomic_set(&b->hashes[i], hash);
+                smp_wmb();
+                atomic_set(&b->pointers[i], p);
+                return;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    b = qht_bucket_alloc(1);
+    b->hashes[0] = hash;
+    b->pointers[0] = p;
+    smp_wmb();
+    atomic_set(&prev->next, b);
+}
+
+/* Called with ht->lock held.  */
+static bool qht_map_remove(QHTMap *map, const void *p, uint32_t hash)
+{
+    QHTBucket *b = qht_map_to_bucket(map, hash);
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == p) {
+                atomic_set(&b->pointers[i], NULL);
+                return true;
+            }
+        }
+        b = b->next;
+    } while (b);
+
+    return false;
+}
+
+static bool qht_map_find(QHTMap *map, const void *p, uint32_t hash)
+{
+    QHTBucket *b = qht_map_to_bucket(map, hash);
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == p) {
+                return true;
+            }
+        }
+        b = b->next;
+    } while (b);
+
+    return false;
+}
+
+static void qht_map_iter(QHTMap *map, qht_iter_func_t func, void *userp)
+{
+    size_t i;
+    int j;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = &map->buckets[i];
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (b->pointers[j]) {
+                    func(b->pointers[j], b->hashes[j], userp);
+                }
+            }
+            b = b->next;
+        } while (b);
+    }
+}
+
+static void qht_map_copy(void *p, uint32_t hash, void *userp)
+{
+    qht_map_insert(userp, p, hash);
+}
+
+/* Called with ht->lock held.  */
+static void qht_grow(QHT *ht)
+{
+    QHTMap *old = ht->map;
+    QHTMap *new = qht_map_create(old->n_buckets * 2);
+
+    qht_map_iter(old, qht_map_copy, new);
+    smp_wmb();
+    atomic_set(&ht->map, new);
+
+    old->retired_next = ht->retired;
+    ht->retired = old;
+    ht->n_resizes++;
+}
+
+bool qht_insert(QHT *ht, void *p, uint32_t hash)
+{
+    bool ret = false;
+
+    assert(p);
+    qemu_mutex_lock(&ht->lock);
+    if (qht_map_find(ht->map, p, hash)) {
+        goto out;
+    }
+    if ((ht->mode & QHT_MODE_AUTO_RESIZE) &&
+        ht->n_entries >= ht->map->n_buckets * QHT_MAX_LOAD) {
+        qht_grow(ht);
+    }
+    qht_map_insert(ht->map, p, hash);
+    ht->n_entries++;
+    ret = true;
+ out:
+    qemu_mutex_unlock(&ht->lock);
+    return ret;
+}
+
+bool qht_remove(QHT *ht, const void *p, uint32_t hash)
+{
+    QHTMap *map;
+    bool ret;
+
+    qemu_mutex_lock(&ht->lock);
+    ret = qht_map_remove(ht->map, p, hash);
+    if (ret) {
+        ht->n_entries--;
+        /* do not let lookups still walking an older map find it */
+        for (map = ht->retired; map; map = map->retired_next) {
+            qht_map_remove(map, p, hash);
+        }
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return ret;
+}
+
+void qht_reset(QHT *ht)
+{
+    QHTMap *map = ht->map;
+    size_t i;
+
+    qemu_mutex_lock(&ht->lock);
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = &map->buckets[i];
+
+        do {
+            memset(b->pointers, 0, sizeof(b->pointers));
+            b = b->next;
+        } while (b);
+    }
+    ht->n_entries = 0;
+
+    while (ht->retired) {
+        QHTMap *next = ht->retired->retired_next;
+
+        qht_map_destroy(ht->retired);
+        ht->retired = next;
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_iter(QHT *ht, qht_iter_func_t func, void *userp)
+{
+    qemu_mutex_lock(&ht->lock);
+    qht_map_iter(ht->map, func, userp);
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_statistics(QHT *ht, QHTStats *stats)
+{
+    QHTMap *map;
+    size_t i;
+    int j;
+
+    memset(stats, 0, sizeof(*stats));
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    stats->head_buckets = map->n_buckets;
+    stats->resizes = ht->n_resizes;
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = &map->buckets[i];
+        size_t entries = 0;
+        size_t chain = 0;
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (b->pointers[j]) {
+                    entries++;
+                }
+            }
+            chain++;
+            b = b->next;
+        } while (b);
+
+        if (entries) {
+            stats->used_head_buckets++;
+            stats->entries += entries;
+            stats->chain_buckets += chain;
+            stats->max_chain = MAX(stats->max_chain, chain);
+        }
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
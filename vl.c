@@ -516,6 +516,25 @@ static QemuOptsList qemu_realtime_opts = {
     },
 };
 
+static QemuOptsList qemu_accel_opts = {
+    .name = "accel",
+    .implied_opt_name = "accel",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_accel_opts.head),
+    .merge_lists = true,
+    .desc = {
+        {
+            .name = "accel",
+            .type = QEMU_OPT_STRING,
+            .help = "Select the type of accelerator",
+        }, {
+            .name = "thread",
+            .type = QEMU_OPT_STRING,
+            .help = "Run TCG vCPUs in a single thread or one thread each",
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_msg_opts = {
     .name = "msg",
     .head = QTAILQ_HEAD_INITIALIZER(qemu_msg_opts.head),
@@ -2887,6 +2906,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_tpmdev_opts);
     qemu_add_opts(&qemu_realtime_opts);
     qemu_add_opts(&qemu_msg_opts);
+    qemu_add_opts(&qemu_accel_opts);
 
     runstate_init();
 
@@ -3497,6 +3517,18 @@ int main(int argc, char **argv, char **envp)
                 olist = qemu_find_opts("machine");
                 qemu_opts_parse(olist, "accel=kvm", 0);
                 break;
+            case QEMU_OPTION_accel:
+                opts = qemu_opts_parse(qemu_find_opts("accel"), optarg, 1);
+                if (!opts) {
+                    exit(1);
+                }
+                optarg = qemu_opt_get(opts, "accel");
+                if (optarg) {
+                    qemu_opts_set(qemu_find_opts("machine"), 0, "accel",
+                                  optarg);
+                }
+                qemu_tcg_configure(opts);
+                break;
             case QEMU_OPTION_machine:
                 olist = qemu_find_opts("machine");
                 opts = qemu_opts_parse(olist, optarg, 1);
@@ -4039,6 +4071,11 @@ int main(int argc, char **argv, char **envp)
 
     configure_accelerator();
 
+    if (qemu_tcg_mttcg_enabled() && !tcg_enabled()) {
+        fprintf(stderr, "qemu: thread=multi is only supported with tcg\n");
+        exit(1);
+    }
+
     if (!qtest_enabled() && qtest_chrdev) {
         qtest_init();
     }
@@ -4108,6 +4145,10 @@ int main(int argc, char **argv, char **envp)
         fprintf(stderr, "-icount is not allowed with kvm or xen\n");
         exit(1);
     }
+    if (icount_option && qemu_tcg_mttcg_enabled()) {
+        fprintf(stderr, "-icount is not allowed with thread=multi\n");
+        exit(1);
+    }
     configure_icount(icount_option);
 
     /* clean up network at qemu process termination */